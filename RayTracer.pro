@@ -4,33 +4,22 @@ CONFIG += c++17
 TARGET = RayTracer
 TEMPLATE = app
 
+include(rendercore.pri)
+
 SOURCES += \
     main.cpp \
     src/MainWindow.cpp \
     src/Viewport.cpp \
-    src/Scene.cpp \
-    src/SceneObject.cpp \
-    src/Material.cpp \
-    src/Camera.cpp \
-    src/ObjLoader.cpp \
     src/PathTracer.cpp \
     src/PropertiesPanel.cpp \
-    src/RenderWindow.cpp \
-    src/BVH.cpp
+    src/RenderWindow.cpp
 
 HEADERS += \
     src/MainWindow.h \
     src/Viewport.h \
-    src/Scene.h \
-    src/SceneObject.h \
-    src/Material.h \
-    src/Camera.h \
-    src/ObjLoader.h \
     src/PathTracer.h \
     src/PropertiesPanel.h \
-    src/RenderWindow.h \
-    src/BVH.h \
-    src/Light.h
+    src/RenderWindow.h
 
 RESOURCES += resources.qrc
 
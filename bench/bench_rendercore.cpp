@@ -0,0 +1,243 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QLoggingCategory>
+#include <QThread>
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <vector>
+#include "CpuRenderer.h"
+#include "ObjLoader.h"
+#include "Scene.h"
+#include "ThreadPool.h"
+
+// Linear RGB average of every pixel
+static std::vector<float> filmAverage(const Film &film, const std::vector<RenderTile> &tiles)
+{
+    std::vector<float> average(film.accum.size(), 0.0f);
+    for (size_t t = 0; t < tiles.size(); ++t) {
+        if (film.tileSamples[t] == 0) continue;
+        const float inv = 1.0f / film.tileSamples[t];
+        for (int y = tiles[t].y0; y < tiles[t].y1; ++y) {
+            for (int x = tiles[t].x0; x < tiles[t].x1; ++x) {
+                for (int c = 0; c < 3; ++c) {
+                    size_t i = (size_t(y) * film.width + x) * 3 + c;
+                    average[i] = film.accum[i] * inv;
+                }
+            }
+        }
+    }
+    return average;
+}
+
+static double rmse(const std::vector<float> &a, const std::vector<float> &b)
+{
+    double sum = 0.0;
+    for (size_t i = 0; i < a.size(); ++i)
+        sum += double(a[i] - b[i]) * double(a[i] - b[i]);
+    return std::sqrt(sum / double(a.size()));
+}
+
+struct CurvePoint {
+    int spp;
+    double ms;   // render time up to spp, without prepare()
+    double rmse; // against the reference image
+};
+
+// Renders at 1, 2, 4, ... maxSpp samples per pixel, continuing the same film,
+// and records the time and error at each step. An empty reference only renders.
+static std::vector<CurvePoint> renderCurve(const Scene &scene, RenderSettings settings, ThreadPool &pool,
+                                           int maxSpp, const std::vector<float> &reference,
+                                           std::vector<float> *average = nullptr)
+{
+    std::vector<CurvePoint> curve;
+    CpuRenderer renderer(scene, settings);
+    Film film(settings.width, settings.height, renderer.tiles());
+    double ms = 0.0;
+    for (int spp = reference.empty() ? maxSpp : 1; spp <= maxSpp; spp *= 2) {
+        settings.spp = spp;
+        renderer.setSettings(settings);
+        if (!renderer.prepare(pool)) return curve;
+        QElapsedTimer timer;
+        timer.start();
+        renderer.render(film, pool);
+        ms += timer.nsecsElapsed() / 1e6;
+        curve.push_back({spp, ms, reference.empty() ? 0.0 : rmse(filmAverage(film, renderer.tiles()), reference)});
+    }
+    if (average) *average = filmAverage(film, renderer.tiles());
+    return curve;
+}
+
+// Time at which the curve reaches target, interpolated log-log between steps;
+// negative if it never does
+static double timeToRmse(const std::vector<CurvePoint> &curve, double target)
+{
+    for (size_t i = 0; i < curve.size(); ++i) {
+        if (curve[i].rmse > target) continue;
+        if (i == 0) return curve[0].ms;
+        const CurvePoint &a = curve[i - 1], &b = curve[i];
+        double f = std::log(a.rmse / target) / std::log(a.rmse / b.rmse);
+        return std::exp(std::log(a.ms) + f * (std::log(b.ms) - std::log(a.ms)));
+    }
+    return -1.0;
+}
+
+// Time-to-equal-RMSE of the samplers. The reference is a long render with
+// white noise; every sampler then renders up to maxSpp, and the time it needs to
+// reach the error of white noise at maxSpp is compared. The white-noise curve
+// shares its first samples with the reference, which keep referenceSpp well
+// above maxSpp to make negligible.
+static int benchSamplers(const QString &scenePath, RenderSettings settings, int maxSpp, int referenceSpp)
+{
+    Scene scene;
+    if (!scene.load(scenePath)) {
+        qCritical() << "Failed to load scene:" << scenePath;
+        return 1;
+    }
+    ThreadPool pool(settings.threads);
+    settings.sampler = SamplerType::Random;
+    std::vector<float> reference;
+    QElapsedTimer timer;
+    timer.start();
+    renderCurve(scene, settings, pool, referenceSpp, {}, &reference);
+    if (reference.empty()) {
+        qCritical() << "Nothing to render";
+        return 1;
+    }
+    qInfo().noquote() << QString("Reference: %1 spp in %2 s").arg(referenceSpp).arg(timer.elapsed() / 1000.0);
+
+    const SamplerType samplers[] = {SamplerType::Random, SamplerType::Sobol, SamplerType::BlueNoise};
+    std::vector<QString> names;
+    std::vector<std::vector<CurvePoint>> curves;
+    for (SamplerType sampler : samplers) {
+        settings.sampler = sampler;
+        names.push_back(QString::fromLatin1(samplerTypeName(sampler)));
+        curves.push_back(renderCurve(scene, settings, pool, maxSpp, reference));
+    }
+
+    QString header = QString("%1").arg("spp", 6);
+    for (const QString &name : names)
+        header += QString("  %1 %2").arg(name + " ms", 14).arg("RMSE", 10);
+    qInfo().noquote() << header;
+    for (size_t i = 0; i < curves[0].size(); ++i) {
+        QString row = QString("%1").arg(curves[0][i].spp, 6);
+        for (const auto &curve : curves)
+            row += QString("  %1 %2").arg(curve[i].ms, 14, 'f', 1).arg(curve[i].rmse, 10, 'g', 4);
+        qInfo().noquote() << row;
+    }
+
+    const CurvePoint &last = curves[0].back();
+    qInfo().noquote() << QString("Time to RMSE %1 (%2 at %3 spp):")
+                              .arg(last.rmse, 0, 'g', 4).arg(names[0]).arg(last.spp);
+    for (size_t s = 0; s < curves.size(); ++s) {
+        double ms = timeToRmse(curves[s], last.rmse);
+        if (ms < 0.0)
+            qInfo().noquote() << QString("  %1 not reached").arg(names[s], -10);
+        else
+            qInfo().noquote() << QString("  %1 %2 ms, %3x the speed of %4")
+                                      .arg(names[s], -10).arg(ms, 0, 'f', 1)
+                                      .arg(last.ms / ms, 0, 'f', 2).arg(names[0]);
+    }
+    return 0;
+}
+
+// Median time of repeat ObjLoader::load() calls, serial for threads == 0
+static double objLoadMs(const QString &path, int threads, int repeat)
+{
+    std::unique_ptr<ThreadPool> pool;
+    if (threads > 0) pool = std::make_unique<ThreadPool>(threads);
+    std::vector<double> times;
+    for (int i = 0; i < repeat; ++i) {
+        Mesh mesh;
+        QElapsedTimer timer;
+        timer.start();
+        if (!ObjLoader::load(path, mesh, pool.get())) return -1.0;
+        times.push_back(timer.nsecsElapsed() / 1e6);
+    }
+    std::nth_element(times.begin(), times.begin() + times.size() / 2, times.end());
+    return times[times.size() / 2];
+}
+
+// Parse scaling of ObjLoader across thread counts, against the serial parse.
+// Reads the file through ObjLoader directly, never from the mesh cache.
+static int benchObj(const QString &path, int maxThreads, int repeat)
+{
+    Mesh mesh;
+    if (!ObjLoader::load(path, mesh)) { // also warms the page cache
+        qCritical() << "Failed to load OBJ:" << path;
+        return 1;
+    }
+    const double megabytes = QFileInfo(path).size() / 1e6;
+    qInfo().noquote() << QString("%1: %2 MB, %3 vertices, %4 triangles")
+                             .arg(path).arg(megabytes, 0, 'f', 1).arg(mesh.vertices.size())
+                             .arg(mesh.indices.size() / 3);
+    qInfo().noquote() << QString("%1 %2 %3 %4").arg("threads", 8).arg("ms", 10).arg("MB/s", 10).arg("speedup", 8);
+
+    const double serialMs = objLoadMs(path, 0, repeat);
+    auto report = [&](const QString &threads, double ms) {
+        qInfo().noquote() << QString("%1 %2 %3 %4").arg(threads, 8).arg(ms, 10, 'f', 1)
+                                 .arg(megabytes * 1000.0 / ms, 10, 'f', 1).arg(serialMs / ms, 8, 'f', 2);
+    };
+    report("serial", serialMs);
+    std::vector<int> counts;
+    for (int threads = 1; threads < maxThreads; threads *= 2)
+        counts.push_back(threads);
+    counts.push_back(maxThreads);
+    for (int threads : counts)
+        report(QString::number(threads), objLoadMs(path, threads, repeat));
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("rendercore-bench");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Benchmarks of the CPU rendering code.\n"
+                                     "samplers <scene>: time to equal RMSE of the samplers\n"
+                                     "obj <file.obj>: OBJ parse time across thread counts");
+    parser.addHelpOption();
+    parser.addPositionalArgument("benchmark", "samplers or obj.");
+    parser.addPositionalArgument("input", "Scene file for samplers, OBJ file for obj.");
+
+    QCommandLineOption widthOpt("width", "Image width.", "px", "160");
+    QCommandLineOption heightOpt("height", "Image height.", "px", "120");
+    QCommandLineOption threadsOpt("threads", "Worker threads, 0 = all cores; for obj the largest count.", "n", "0");
+    QCommandLineOption maxSppOpt("max-spp", "Largest spp of the sampler curves.", "n", "64");
+    QCommandLineOption referenceSppOpt("reference-spp", "Samples per pixel of the reference image.", "n", "4096");
+    QCommandLineOption repeatOpt("repeat", "OBJ loads per thread count; the median is reported.", "n", "5");
+    parser.addOptions({widthOpt, heightOpt, threadsOpt, maxSppOpt, referenceSppOpt, repeatOpt});
+    parser.process(app);
+    // The build and load messages of the code under test would bury the tables
+    QLoggingCategory::setFilterRules("*.debug=false");
+
+    const QStringList args = parser.positionalArguments();
+    if (args.size() != 2) {
+        qCritical() << "Expected a benchmark and its input";
+        parser.showHelp(1);
+    }
+
+    RenderSettings settings;
+    settings.width = parser.value(widthOpt).toInt();
+    settings.height = parser.value(heightOpt).toInt();
+    settings.threads = parser.value(threadsOpt).toInt();
+    const int maxSpp = parser.value(maxSppOpt).toInt();
+    const int referenceSpp = parser.value(referenceSppOpt).toInt();
+    const int repeat = parser.value(repeatOpt).toInt();
+    if (settings.width <= 0 || settings.height <= 0 || settings.threads < 0 || maxSpp <= 0 ||
+        referenceSpp < maxSpp || repeat <= 0) {
+        qCritical() << "Invalid benchmark settings";
+        return 1;
+    }
+
+    if (args[0] == "samplers")
+        return benchSamplers(args[1], settings, maxSpp, referenceSpp);
+    if (args[0] == "obj")
+        return benchObj(args[1], settings.threads > 0 ? settings.threads : QThread::idealThreadCount(), repeat);
+    qCritical() << "Unknown benchmark:" << args[0];
+    return 1;
+}
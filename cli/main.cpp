@@ -0,0 +1,188 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QDebug>
+#include <algorithm>
+#include <atomic>
+#include <csignal>
+#include "Scene.h"
+#include "CpuRenderer.h"
+#include "MeshCache.h"
+#include "SceneBVH.h"
+#include "ThreadPool.h"
+
+// SIGINT/SIGTERM stop the render after the tiles in flight, so a pre-empted job
+// still writes its image and checkpoint
+static std::atomic<bool> g_cancel{false};
+
+static void onSignal(int)
+{
+    g_cancel.store(true);
+}
+
+static bool parseSampler(const QString &name, SamplerType &type)
+{
+    if (name == "random") type = SamplerType::Random;
+    else if (name == "sobol") type = SamplerType::Sobol;
+    else if (name == "bluenoise") type = SamplerType::BlueNoise;
+    else return false;
+    return true;
+}
+
+static bool parseBvhSplit(const QString &name, BVHSplitMethod &method)
+{
+    if (name == "median") method = BVHSplitMethod::Median;
+    else if (name == "morton") method = BVHSplitMethod::Morton;
+    else if (name == "sah") method = BVHSplitMethod::BinnedSAH;
+    else if (name == "sbvh") method = BVHSplitMethod::SpatialSAH;
+    else return false;
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("raytracer-cli");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Renders a scene file with the CPU path tracer.");
+    parser.addHelpOption();
+    parser.addPositionalArgument("scene", "Scene file (.json) saved by RayTracer.");
+
+    QCommandLineOption outputOpt({"o", "output"}, "Output image (png, jpg, ...).", "file", "render.png");
+    QCommandLineOption widthOpt("width", "Image width.", "px", "800");
+    QCommandLineOption heightOpt("height", "Image height.", "px", "600");
+    QCommandLineOption sppOpt("spp", "Samples per pixel.", "n", "128");
+    QCommandLineOption threadsOpt("threads", "Worker threads, 0 = all cores.", "n", "0");
+    QCommandLineOption timeOpt("time", "Fit the render into this many seconds (spp becomes the cap), 0 = no limit.", "sec", "0");
+    QCommandLineOption samplerOpt("sampler", "random, sobol or bluenoise.", "name", "sobol");
+    QCommandLineOption adaptiveOpt("noise-threshold",
+                                   "Render until the estimated noise is below this value "
+                                   "(spp becomes the cap).", "value");
+    QCommandLineOption spendSavedOpt("spend-saved-samples",
+                                     "With --noise-threshold, give the samples saved by converged "
+                                     "tiles to the tiles still above the threshold, up to spp per "
+                                     "pixel on average.");
+    QCommandLineOption checkpointOpt("checkpoint", "Write checkpoints to this file.", "file");
+    QCommandLineOption intervalOpt("checkpoint-interval", "Seconds between checkpoints.", "sec", "300");
+    QCommandLineOption resumeOpt("resume", "Continue from a checkpoint file.", "file");
+    QCommandLineOption denoiseOpt("denoise", "Denoise the final image.");
+    QCommandLineOption bvhOpt("bvh", "BVH build: sah, sbvh (spatial splits, best tree, slowest build), "
+                              "morton (fastest build) or median.", "name", "sah");
+    QCommandLineOption sbvhBudgetOpt("sbvh-budget", "Extra triangle references sbvh may add, as a fraction "
+                                     "of the triangles.", "ratio", "0.3");
+    QCommandLineOption bvhWidthOpt("bvh-width", "CPU BVH traversal width: 2, 4, 8 or 0 for the widest "
+                                   "this CPU supports.", "n", "0");
+    QCommandLineOption bvhCacheOpt("bvh-cache", "Directory of cached mesh BVHs, \"\" to disable.", "dir",
+                                   BLASCache::global().diskCacheDir());
+    QCommandLineOption meshCacheOpt("mesh-cache", "Directory of binary copies of loaded OBJ meshes, "
+                                    "\"\" to disable.", "dir", MeshCache::global().diskCacheDir());
+    parser.addOptions({outputOpt, widthOpt, heightOpt, sppOpt, threadsOpt, timeOpt, samplerOpt,
+                       adaptiveOpt, spendSavedOpt, checkpointOpt, intervalOpt, resumeOpt, denoiseOpt,
+                       bvhOpt, sbvhBudgetOpt, bvhWidthOpt, bvhCacheOpt, meshCacheOpt});
+    parser.process(app);
+
+    const QStringList args = parser.positionalArguments();
+    if (args.size() != 1) {
+        qCritical() << "Expected exactly one scene file";
+        parser.showHelp(1);
+    }
+
+    RenderSettings settings;
+    settings.width = parser.value(widthOpt).toInt();
+    settings.height = parser.value(heightOpt).toInt();
+    settings.spp = parser.value(sppOpt).toInt();
+    settings.threads = parser.value(threadsOpt).toInt();
+    settings.timeBudgetSec = parser.value(timeOpt).toDouble();
+    settings.checkpointPath = parser.value(checkpointOpt);
+    settings.checkpointIntervalSec = parser.value(intervalOpt).toInt();
+    settings.resumePath = parser.value(resumeOpt);
+    settings.denoise = parser.isSet(denoiseOpt);
+    settings.bvh.width = parser.value(bvhWidthOpt).toInt();
+    settings.bvh.spatialSplitBudget = parser.value(sbvhBudgetOpt).toFloat();
+    BLASCache::global().setDiskCacheDir(parser.value(bvhCacheOpt));
+    MeshCache::global().setDiskCacheDir(parser.value(meshCacheOpt));
+    if (parser.isSet(adaptiveOpt)) {
+        settings.adaptive = true;
+        settings.noiseThreshold = parser.value(adaptiveOpt).toFloat();
+        settings.spendSavedSamples = parser.isSet(spendSavedOpt);
+    }
+    if (!parseSampler(parser.value(samplerOpt), settings.sampler)) {
+        qCritical() << "Unknown sampler:" << parser.value(samplerOpt);
+        return 1;
+    }
+    if (!parseBvhSplit(parser.value(bvhOpt), settings.bvh.method)) {
+        qCritical() << "Unknown BVH split method:" << parser.value(bvhOpt);
+        return 1;
+    }
+
+    // A checkpoint fixes resolution and sampler; the sample budget can grow
+    if (!settings.resumePath.isEmpty()) {
+        CheckpointInfo info;
+        if (!Film::readCheckpointInfo(settings.resumePath, info)) {
+            qCritical() << "Not a valid render checkpoint:" << settings.resumePath;
+            return 1;
+        }
+        settings.width = info.width;
+        settings.height = info.height;
+        settings.sampler = info.sampler;
+        settings.spp = std::max(settings.spp, info.maxTileSamples);
+        if (settings.checkpointPath.isEmpty())
+            settings.checkpointPath = settings.resumePath;
+    }
+
+    if (settings.width <= 0 || settings.height <= 0 || settings.spp <= 0 ||
+        settings.threads < 0 || settings.checkpointIntervalSec <= 0 ||
+        !(settings.bvh.spatialSplitBudget >= 0.0f)) {
+        qCritical() << "Invalid render settings";
+        return 1;
+    }
+
+    Scene scene;
+    if (!scene.load(args.first())) {
+        qCritical() << "Failed to load scene:" << args.first();
+        return 1;
+    }
+
+    if (!settings.resumePath.isEmpty()) {
+        CheckpointInfo info;
+        Film::readCheckpointInfo(settings.resumePath, info);
+        if (info.sceneHash != CpuRenderer::sceneHash(scene)) {
+            qCritical() << "Checkpoint belongs to another scene, or the scene was edited since:"
+                        << settings.resumePath;
+            return 1;
+        }
+    }
+
+    ThreadPool pool(settings.threads);
+    CpuRenderer renderer(scene, settings);
+    if (!renderer.prepare(pool)) return 1;
+
+    std::signal(SIGINT, onSignal);
+    std::signal(SIGTERM, onSignal);
+
+    Film film(settings.width, settings.height, renderer.tiles());
+    qDebug() << "Rendering" << settings.width << "x" << settings.height
+             << "@" << settings.spp << "spp," << pool.threadCount() << "threads,"
+             << samplerTypeName(settings.sampler);
+
+    QElapsedTimer progressTimer;
+    progressTimer.start();
+    RenderStats stats = renderer.render(film, pool, &g_cancel, [&](const Film &f, int activeTiles) {
+        if (progressTimer.elapsed() < 5000) return;
+        progressTimer.restart();
+        qDebug() << "Sample" << f.maxTileSamples() << "/" << settings.spp
+                 << "-" << activeTiles << "active tiles";
+    });
+
+    if (stats.resumeFailed) return 1;
+
+    QString output = parser.value(outputOpt);
+    if (!renderer.finalImage(film, pool).save(output)) {
+        qCritical() << "Failed to write" << output;
+        return 1;
+    }
+    qDebug() << "Wrote" << output << "-" << stats.averageSpp << "spp avg,"
+             << stats.mraysPerSecond() << "Mrays/s," << stats.elapsedMs / 1000.0 << "s";
+    return stats.cancelled ? 2 : 0;
+}
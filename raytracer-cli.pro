@@ -0,0 +1,14 @@
+# Headless batch renderer: loads a scene file and renders it with the CPU path
+# tracer. Needs no display server.
+
+QT += core gui opengl
+
+CONFIG += c++17 console
+CONFIG -= app_bundle
+TARGET = raytracer-cli
+TEMPLATE = app
+
+include(rendercore.pri)
+
+SOURCES += \
+    cli/main.cpp
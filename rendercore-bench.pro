@@ -0,0 +1,14 @@
+# Benchmarks of the code in rendercore.pri: qmake rendercore-bench.pro && make
+# Build in release mode; see README.md for the commands.
+
+QT += core gui opengl
+
+CONFIG += c++17 console release
+CONFIG -= app_bundle
+TARGET = rendercore-bench
+TEMPLATE = app
+
+include(rendercore.pri)
+
+SOURCES += \
+    bench/bench_rendercore.cpp
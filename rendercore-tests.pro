@@ -0,0 +1,16 @@
+# Unit tests of the code in rendercore.pri: qmake rendercore-tests.pro && make check
+
+QT += core gui opengl testlib
+
+CONFIG += c++17 console testcase
+CONFIG -= app_bundle
+TARGET = rendercore-tests
+TEMPLATE = app
+
+# Out-of-range std::vector indexing aborts instead of going unnoticed
+DEFINES += _GLIBCXX_ASSERTIONS
+
+include(rendercore.pri)
+
+SOURCES += \
+    tests/tst_rendercore.cpp
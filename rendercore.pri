@@ -0,0 +1,34 @@
+# Scene loading and the CPU renderer, shared by the GUI and raytracer-cli
+
+INCLUDEPATH += $$PWD/src
+
+SOURCES += \
+    $$PWD/src/Scene.cpp \
+    $$PWD/src/SceneObject.cpp \
+    $$PWD/src/Material.cpp \
+    $$PWD/src/Camera.cpp \
+    $$PWD/src/ObjLoader.cpp \
+    $$PWD/src/MeshCache.cpp \
+    $$PWD/src/BVH.cpp \
+    $$PWD/src/SceneBVH.cpp \
+    $$PWD/src/CpuRenderer.cpp \
+    $$PWD/src/ThreadPool.cpp \
+    $$PWD/src/Sampler.cpp \
+    $$PWD/src/Denoiser.cpp
+
+HEADERS += \
+    $$PWD/src/Scene.h \
+    $$PWD/src/SceneObject.h \
+    $$PWD/src/Material.h \
+    $$PWD/src/Camera.h \
+    $$PWD/src/ObjLoader.h \
+    $$PWD/src/MeshCache.h \
+    $$PWD/src/BVH.h \
+    $$PWD/src/BVHTraversal.h \
+    $$PWD/src/SceneBVH.h \
+    $$PWD/src/Light.h \
+    $$PWD/src/CpuRenderer.h \
+    $$PWD/src/ThreadPool.h \
+    $$PWD/src/Random.h \
+    $$PWD/src/Sampler.h \
+    $$PWD/src/Denoiser.h
@@ -1,118 +1,1538 @@
 #include "BVH.h"
+#include "ThreadPool.h"
 #include <QDebug>
+#include <QFile>
+#include <QSaveFile>
+#include <climits>
+#include <cstdint>
+#include <cstring>
 
-void BVH::build(QVector<RenderTriangle> &tris)
-{
-    m_tris = tris;
-    m_nodes.clear();
-    m_nodes.reserve(m_tris.size() * 2);
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define BVH_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// Traversal kernels, one copy per instruction set (see BVHTraversal.h)
+namespace bvh4 {
+#define BVH_TRAVERSAL_WIDTH 4
+#include "BVHTraversal.h"
+#undef BVH_TRAVERSAL_WIDTH
+} // namespace bvh4
 
-    if (m_tris.isEmpty()) return;
+#ifdef BVH_X86
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx2,fma"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+#endif
+namespace bvh8 {
+#define BVH_TRAVERSAL_WIDTH 8
+#include "BVHTraversal.h"
+#undef BVH_TRAVERSAL_WIDTH
 
-    buildRecursive(0, m_tris.size());
-    qDebug() << "BVH built:" << m_nodes.size() << "nodes," << m_tris.size() << "tris";
+// Out-of-line entry point, so no AVX code is inlined into generic callers
+int intersect(const Node *nodes, const BVHTriangle *tris,
+              const QVector3D &orig, const QVector3D &dir, float &outT, float tMax)
+{
+    return closestHit(nodes, tris, orig, dir, outT, tMax);
 }
 
-int BVH::buildRecursive(int start, int count)
+bool occluded(const Node *nodes, const BVHTriangle *tris,
+              const QVector3D &orig, const QVector3D &dir, float tMax)
 {
-    int nodeIdx = (int)m_nodes.size();
-    m_nodes.push_back(BVHNode());
+    return anyHit(nodes, tris, orig, dir, tMax);
+}
+} // namespace bvh8
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+#endif
+
+namespace {
 
-    // Compute bounds
+struct Bin {
     AABB box;
-    for (int i = start; i < start + count; ++i) {
-        box.expand(m_tris[i].v0);
-        box.expand(m_tris[i].v1);
-        box.expand(m_tris[i].v2);
+    int count = 0;
+};
+
+constexpr int MaxBins = 64;
+constexpr int ChunkSize = 16384; // primitives per parallel work item at the top levels
+
+struct BinSet {
+    Bin bin[3][MaxBins];
+};
+
+struct BuildContext {
+    const std::vector<AABB> &bounds;
+    std::vector<QVector3D> centroids;
+    std::vector<uint32_t> mortonCodes; // Morton method only
+    const BVHBuildSettings &settings;
+    std::vector<int> &order;
+    int bins = 16;
+};
+
+// A range left for the parallel phase; slot is its placeholder root node
+struct SubtreeTask {
+    int start, end;
+    int slot;
+    int depth;
+};
+
+int binOf(float c, float lo, float scale, int bins)
+{
+    return std::min(bins - 1, int((c - lo) * scale));
+}
+
+// Runs fn(begin, end) over ChunkSize pieces of [start, end), in parallel when a
+// pool is given and the range is large enough to be worth it
+template <typename Fn>
+void forChunks(ThreadPool *pool, int start, int end, Fn fn)
+{
+    int chunks = (end - start + ChunkSize - 1) / ChunkSize;
+    if (!pool || chunks < 2) {
+        fn(start, end, 0);
+        return;
     }
-    m_nodes[nodeIdx].box = box;
+    pool->parallelFor(chunks, [&](int c, int) {
+        fn(start + c * ChunkSize, std::min(end, start + (c + 1) * ChunkSize), c);
+    });
+}
 
-    if (count <= 4) {
-        m_nodes[nodeIdx].triStart = start;
-        m_nodes[nodeIdx].triCount = count;
-        return nodeIdx;
+void rangeBounds(BuildContext &ctx, ThreadPool *pool, int start, int end,
+                 AABB &box, AABB &centroidBox)
+{
+    auto expand = [&](int begin, int stop, AABB &b, AABB &cb) {
+        for (int i = begin; i < stop; ++i) {
+            int prim = ctx.order[i];
+            b.expand(ctx.bounds[prim]);
+            cb.expand(ctx.centroids[prim]);
+        }
+    };
+    int chunks = (end - start + ChunkSize - 1) / ChunkSize;
+    if (!pool || chunks < 2) {
+        expand(start, end, box, centroidBox);
+        return;
+    }
+
+    std::vector<AABB> boxes(chunks), centroidBoxes(chunks);
+    forChunks(pool, start, end, [&](int begin, int stop, int c) {
+        expand(begin, stop, boxes[c], centroidBoxes[c]);
+    });
+    for (int c = 0; c < chunks; ++c) {
+        box.expand(boxes[c]);
+        centroidBox.expand(centroidBoxes[c]);
     }
+}
 
+void binRange(BuildContext &ctx, int begin, int end, const AABB &centroidBox, BinSet &set)
+{
+    float lo[3], scale[3];
+    for (int axis = 0; axis < 3; ++axis) {
+        lo[axis] = centroidBox.mn[axis];
+        float extent = centroidBox.mx[axis] - lo[axis];
+        scale[axis] = extent > 0.0f ? ctx.bins / extent : 0.0f;
+    }
+    for (int i = begin; i < end; ++i) {
+        int prim = ctx.order[i];
+        const QVector3D &c = ctx.centroids[prim];
+        for (int axis = 0; axis < 3; ++axis) {
+            Bin &b = set.bin[axis][binOf(c[axis], lo[axis], scale[axis], ctx.bins)];
+            b.count++;
+            b.box.expand(ctx.bounds[prim]);
+        }
+    }
+}
+
+int splitMedian(BuildContext &ctx, int start, int end, const AABB &box)
+{
+    const int count = end - start;
+    if (count <= ctx.settings.maxLeafSize) return -1;
     int axis = box.longestAxis();
+    int mid = start + count / 2;
+    std::nth_element(ctx.order.begin() + start, ctx.order.begin() + mid, ctx.order.begin() + end,
+                     [&](int a, int b) { return ctx.centroids[a][axis] < ctx.centroids[b][axis]; });
+    return mid;
+}
+
+// The range is sorted by Morton code; split where the highest differing bit flips
+int splitMorton(BuildContext &ctx, int start, int end)
+{
+    const int count = end - start;
+    if (count <= ctx.settings.maxLeafSize) return -1;
+    uint32_t first = ctx.mortonCodes[ctx.order[start]];
+    uint32_t last = ctx.mortonCodes[ctx.order[end - 1]];
+    if (first == last) return start + count / 2;
+
+    uint32_t diff = first ^ last;
+    uint32_t bit = 1u;
+    while (diff >>= 1) bit <<= 1;
+    auto mid = std::partition_point(ctx.order.begin() + start, ctx.order.begin() + end,
+                                    [&](int prim) { return (ctx.mortonCodes[prim] & bit) == 0; });
+    return int(mid - ctx.order.begin());
+}
+
+int splitSAH(BuildContext &ctx, ThreadPool *pool, int start, int end,
+             const AABB &box, const AABB &centroidBox)
+{
+    const BVHBuildSettings &s = ctx.settings;
+    const int count = end - start;
+    if (count == 1) return -1;
+
+    const int bins = ctx.bins;
+    int chunks = (count + ChunkSize - 1) / ChunkSize;
+    BinSet set;
+    if (!pool || chunks < 2) {
+        binRange(ctx, start, end, centroidBox, set);
+    } else {
+        std::vector<BinSet> sets(chunks);
+        forChunks(pool, start, end, [&](int begin, int stop, int c) {
+            binRange(ctx, begin, stop, centroidBox, sets[c]);
+        });
+        for (const BinSet &chunk : sets) {
+            for (int axis = 0; axis < 3; ++axis) {
+                for (int b = 0; b < bins; ++b) {
+                    const Bin &src = chunk.bin[axis][b];
+                    if (src.count == 0) continue;
+                    set.bin[axis][b].count += src.count;
+                    set.bin[axis][b].box.expand(src.box);
+                }
+            }
+        }
+    }
+
+    const float area = box.surfaceArea();
+    const float invArea = area > 0.0f ? 1.0f / area : 0.0f;
+
+    float bestCost = FLT_MAX;
+    int bestAxis = -1;
+    int bestSplit = 0;
+    for (int axis = 0; axis < 3; ++axis) {
+        if (centroidBox.mx[axis] - centroidBox.mn[axis] <= 0.0f) continue;
+        const Bin *bin = set.bin[axis];
+
+        // Sweep from the right, then evaluate every bin boundary from the left
+        float rightArea[MaxBins];
+        int rightCount[MaxBins];
+        AABB acc;
+        int n = 0;
+        for (int b = bins - 1; b > 0; --b) {
+            if (bin[b].count > 0) acc.expand(bin[b].box);
+            n += bin[b].count;
+            rightArea[b - 1] = acc.surfaceArea();
+            rightCount[b - 1] = n;
+        }
+        acc = AABB();
+        n = 0;
+        for (int b = 0; b < bins - 1; ++b) {
+            if (bin[b].count > 0) acc.expand(bin[b].box);
+            n += bin[b].count;
+            if (n == 0 || rightCount[b] == 0) continue;
+            float cost = s.traversalCost + s.intersectionCost *
+                         (acc.surfaceArea() * n + rightArea[b] * rightCount[b]) * invArea;
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = b;
+            }
+        }
+    }
+
+    if (bestAxis < 0) {
+        // All centroids coincide; split by index if the range is too big for a leaf
+        return count > s.maxLeafSize ? start + count / 2 : -1;
+    }
+    if (count <= s.maxLeafSize && bestCost >= s.intersectionCost * count)
+        return -1;
+
+    float lo = centroidBox.mn[bestAxis];
+    float scale = bins / (centroidBox.mx[bestAxis] - lo);
+    auto mid = std::partition(ctx.order.begin() + start, ctx.order.begin() + end, [&](int prim) {
+        return binOf(ctx.centroids[prim][bestAxis], lo, scale, bins) <= bestSplit;
+    });
+    return int(mid - ctx.order.begin());
+}
+
+// Levels a range needs to reach single-primitive leaves by halving
+int halvingLevels(int count)
+{
+    int levels = 0;
+    while ((1 << levels) < count) ++levels;
+    return levels;
+}
+
+// Partition point of order[start, end) chosen by the settings' split method,
+// or -1 to make the range a leaf. A range at depth whose remaining levels are
+// only just enough for halving is split at the median, which bounds the tree
+// depth by BVHBuilder::MaxDepth even for degenerate SAH or Morton splits.
+int splitRange(BuildContext &ctx, ThreadPool *pool, int start, int end, int depth,
+               const AABB &box, const AABB &centroidBox)
+{
+    if (BVHBuilder::MaxDepth - 1 - depth <= halvingLevels(end - start)) {
+        if (end - start <= ctx.settings.maxLeafSize) return -1;
+        // Morton ranges are already in spatial order and have no bounds yet
+        if (ctx.settings.method == BVHSplitMethod::Morton) return start + (end - start) / 2;
+        return splitMedian(ctx, start, end, box);
+    }
 
-    // Sort triangles by centroid on the longest axis
-    auto getAxis = [axis](const QVector3D &v) -> float {
-        if (axis == 0) return v.x();
-        if (axis == 1) return v.y();
-        return v.z();
+    switch (ctx.settings.method) {
+    case BVHSplitMethod::Median: return splitMedian(ctx, start, end, box);
+    case BVHSplitMethod::Morton: return splitMorton(ctx, start, end);
+    case BVHSplitMethod::BinnedSAH:
+    case BVHSplitMethod::SpatialSAH: break;
+    }
+    return splitSAH(ctx, pool, start, end, box, centroidBox);
+}
+
+// Builds [start, end) into nodes. With a pool, ranges of at most taskSize are
+// not built but queued as tasks; pool is only used on the calling thread.
+int buildNode(BuildContext &ctx, std::vector<BVHNode> &nodes, int start, int end, int depth,
+              ThreadPool *pool = nullptr, int taskSize = 0, std::vector<SubtreeTask> *tasks = nullptr)
+{
+    int nodeIdx = (int)nodes.size();
+    nodes.push_back(BVHNode());
+
+    if (tasks && end - start <= taskSize) {
+        tasks->push_back({start, end, nodeIdx, depth});
+        return nodeIdx;
+    }
+
+    // Morton splits only look at the codes, so bounds are merged bottom-up
+    // instead of scanning every range
+    const bool bottomUp = ctx.settings.method == BVHSplitMethod::Morton;
+    AABB box, centroidBox;
+    if (!bottomUp) {
+        rangeBounds(ctx, pool, start, end, box, centroidBox);
+        nodes[nodeIdx].box = box;
+    }
+
+    int mid = splitRange(ctx, pool, start, end, depth, box, centroidBox);
+    if (mid < 0) {
+        if (bottomUp) rangeBounds(ctx, nullptr, start, end, nodes[nodeIdx].box, centroidBox);
+        nodes[nodeIdx].triStart = start;
+        nodes[nodeIdx].triCount = end - start;
+        return nodeIdx;
+    }
+
+    int left = buildNode(ctx, nodes, start, mid, depth + 1, pool, taskSize, tasks);
+    int right = buildNode(ctx, nodes, mid, end, depth + 1, pool, taskSize, tasks);
+    nodes[nodeIdx].left = left;
+    nodes[nodeIdx].right = right;
+    if (bottomUp) {
+        nodes[nodeIdx].box = nodes[left].box;
+        nodes[nodeIdx].box.expand(nodes[right].box);
+    }
+    return nodeIdx;
+}
+
+// 10 bits per axis interleaved, x in the highest bit
+uint32_t mortonCode(const QVector3D &p)
+{
+    auto spread = [](uint32_t v) {
+        v = (v * 0x00010001u) & 0xFF0000FFu;
+        v = (v * 0x00000101u) & 0x0F00F00Fu;
+        v = (v * 0x00000011u) & 0xC30C30C3u;
+        v = (v * 0x00000005u) & 0x49249249u;
+        return v;
     };
+    auto quantize = [](float f) { return uint32_t(std::clamp(f * 1024.0f, 0.0f, 1023.0f)); };
+    return (spread(quantize(p.x())) << 2) | (spread(quantize(p.y())) << 1) | spread(quantize(p.z()));
+}
 
-    std::sort(m_tris.begin() + start, m_tris.begin() + start + count,
-              [&](const RenderTriangle &a, const RenderTriangle &b) {
-                  QVector3D ca = (a.v0 + a.v1 + a.v2) / 3.0f;
-                  QVector3D cb = (b.v0 + b.v1 + b.v2) / 3.0f;
-                  return getAxis(ca) < getAxis(cb);
-              });
+// Sorts order by Morton code: LSD radix sort over 8-bit digits with per-chunk
+// histograms, so each pass is two parallel loops and a small prefix sum
+void sortByMortonCode(BuildContext &ctx, ThreadPool *pool)
+{
+    const int count = (int)ctx.order.size();
+    const int chunks = (count + ChunkSize - 1) / ChunkSize;
+    std::vector<int> tmp(count);
+    std::vector<uint32_t> histogram(size_t(chunks) * 256);
 
-    int half = count / 2;
+    // Always chunked, so the histograms line up with the scatter
+    auto forEachChunk = [&](auto fn) {
+        auto run = [&](int c, int) { fn(c * ChunkSize, std::min(count, (c + 1) * ChunkSize), c); };
+        if (pool) pool->parallelFor(chunks, run);
+        else for (int c = 0; c < chunks; ++c) run(c, 0);
+    };
 
-    int leftIdx = buildRecursive(start, half);
-    int rightIdx = buildRecursive(start + half, count - half);
+    for (int shift = 0; shift < 30; shift += 8) {
+        std::fill(histogram.begin(), histogram.end(), 0u);
+        forEachChunk([&](int begin, int end, int c) {
+            uint32_t *h = &histogram[size_t(c) * 256];
+            for (int i = begin; i < end; ++i)
+                h[(ctx.mortonCodes[ctx.order[i]] >> shift) & 0xFF]++;
+        });
 
-    m_nodes[nodeIdx].left = leftIdx;
-    m_nodes[nodeIdx].right = rightIdx;
+        // Digit-major prefix sum gives every chunk its write offset per digit
+        uint32_t sum = 0;
+        for (int d = 0; d < 256; ++d) {
+            for (int c = 0; c < chunks; ++c) {
+                uint32_t n = histogram[size_t(c) * 256 + d];
+                histogram[size_t(c) * 256 + d] = sum;
+                sum += n;
+            }
+        }
 
+        forEachChunk([&](int begin, int end, int c) {
+            uint32_t *offset = &histogram[size_t(c) * 256];
+            for (int i = begin; i < end; ++i) {
+                int prim = ctx.order[i];
+                tmp[offset[(ctx.mortonCodes[prim] >> shift) & 0xFF]++] = prim;
+            }
+        });
+        ctx.order.swap(tmp);
+    }
+}
+
+
+// ---- SBVH (Stich et al. 2009) ----
+
+// Part of a triangle inside box; a spatial split gives each side its own part
+struct SpatialRef {
+    int prim;
+    AABB box;
+};
+
+struct SpatialContext {
+    const std::vector<QVector3D> &vertices; // three per primitive
+    const BVHBuildSettings &settings;
+    std::vector<int> &order; // leaf references, appended leaf by leaf
+    int bins = 16;
+    int refBudget = 0;       // references spatial splits may still add
+    float minOverlap = 0.0f; // object split overlap area that makes spatial splits worth a try
+};
+
+// Splits a reference at the plane axis = pos: the triangle's vertices and its
+// edge crossings go to their side, and each side is cut down to the
+// reference's box (the triangle may have been split before)
+void splitReference(const std::vector<QVector3D> &vertices, const SpatialRef &ref, int axis, float pos,
+                    AABB &left, AABB &right)
+{
+    left = AABB();
+    right = AABB();
+    const QVector3D *v = &vertices[size_t(ref.prim) * 3];
+    for (int i = 0; i < 3; ++i) {
+        const QVector3D &a = v[i], &b = v[(i + 1) % 3];
+        if (a[axis] <= pos) left.expand(a);
+        if (a[axis] >= pos) right.expand(a);
+        if ((a[axis] < pos && b[axis] > pos) || (a[axis] > pos && b[axis] < pos)) {
+            QVector3D p = a + (b - a) * ((pos - a[axis]) / (b[axis] - a[axis]));
+            p[axis] = pos;
+            left.expand(p);
+            right.expand(p);
+        }
+    }
+    left.mx[axis] = pos;
+    right.mn[axis] = pos;
+    for (int a = 0; a < 3; ++a) {
+        left.mn[a] = std::max(left.mn[a], ref.box.mn[a]);
+        left.mx[a] = std::min(left.mx[a], ref.box.mx[a]);
+        right.mn[a] = std::max(right.mn[a], ref.box.mn[a]);
+        right.mx[a] = std::min(right.mx[a], ref.box.mx[a]);
+    }
+}
+
+AABB overlap(const AABB &a, const AABB &b)
+{
+    AABB out;
+    for (int i = 0; i < 3; ++i) {
+        out.mn[i] = std::max(a.mn[i], b.mn[i]);
+        out.mx[i] = std::min(a.mx[i], b.mx[i]);
+    }
+    return out;
+}
+
+bool isEmpty(const AABB &box)
+{
+    return box.mn.x() > box.mx.x() || box.mn.y() > box.mx.y() || box.mn.z() > box.mx.z();
+}
+
+struct SpatialSplit {
+    float cost = FLT_MAX;
+    int axis = -1;
+    int bin = 0;      // last bin on the left
+    float pos = 0.0f; // spatial splits: the plane
+    AABB left, right;
+    int leftCount = 0, rightCount = 0;
+};
+
+// Binned SAH over the reference centroids, as splitSAH()
+SpatialSplit objectSplit(SpatialContext &ctx, const std::vector<SpatialRef> &refs,
+                         const AABB &centroidBox, float invArea)
+{
+    const BVHBuildSettings &s = ctx.settings;
+    const int bins = ctx.bins;
+    SpatialSplit best;
+    for (int axis = 0; axis < 3; ++axis) {
+        float lo = centroidBox.mn[axis], extent = centroidBox.mx[axis] - lo;
+        if (extent <= 0.0f) continue;
+        float scale = bins / extent;
+
+        Bin bin[MaxBins];
+        for (const SpatialRef &r : refs) {
+            Bin &b = bin[binOf(r.box.center()[axis], lo, scale, bins)];
+            b.count++;
+            b.box.expand(r.box);
+        }
+
+        AABB rightBox[MaxBins];
+        int rightCount[MaxBins];
+        AABB acc;
+        int n = 0;
+        for (int b = bins - 1; b > 0; --b) {
+            if (bin[b].count > 0) acc.expand(bin[b].box);
+            n += bin[b].count;
+            rightBox[b - 1] = acc;
+            rightCount[b - 1] = n;
+        }
+        acc = AABB();
+        n = 0;
+        for (int b = 0; b < bins - 1; ++b) {
+            if (bin[b].count > 0) acc.expand(bin[b].box);
+            n += bin[b].count;
+            if (n == 0 || rightCount[b] == 0) continue;
+            float cost = s.traversalCost + s.intersectionCost *
+                         (acc.surfaceArea() * n + rightBox[b].surfaceArea() * rightCount[b]) * invArea;
+            if (cost < best.cost) {
+                best.cost = cost;
+                best.axis = axis;
+                best.bin = b;
+                best.left = acc;
+                best.right = rightBox[b];
+                best.leftCount = n;
+                best.rightCount = rightCount[b];
+            }
+        }
+    }
+    return best;
+}
+
+// Binned SAH over planes in the node bounds. A reference is split into every
+// bin it spans; it enters the count of its first bin and leaves from its last.
+SpatialSplit spatialSplit(SpatialContext &ctx, const std::vector<SpatialRef> &refs,
+                          const AABB &box, float invArea)
+{
+    const BVHBuildSettings &s = ctx.settings;
+    const int bins = ctx.bins;
+    SpatialSplit best;
+    for (int axis = 0; axis < 3; ++axis) {
+        float lo = box.mn[axis], extent = box.mx[axis] - lo;
+        if (extent <= 0.0f) continue;
+        float binWidth = extent / bins, scale = bins / extent;
+
+        AABB binBox[MaxBins];
+        int enter[MaxBins] = {}, exit[MaxBins] = {};
+        for (const SpatialRef &r : refs) {
+            int first = binOf(r.box.mn[axis], lo, scale, bins);
+            int last = std::max(first, binOf(r.box.mx[axis], lo, scale, bins));
+            enter[first]++;
+            exit[last]++;
+            // Cut off one bin at a time; the rest goes on to the next plane
+            SpatialRef rest = r;
+            for (int b = first; b < last; ++b) {
+                AABB part, remainder;
+                splitReference(ctx.vertices, rest, axis, lo + (b + 1) * binWidth, part, remainder);
+                rest.box = remainder;
+                if (!isEmpty(part)) binBox[b].expand(part);
+            }
+            if (!isEmpty(rest.box)) binBox[last].expand(rest.box);
+        }
+
+        AABB rightBox[MaxBins];
+        int rightCount[MaxBins];
+        AABB acc;
+        int n = 0;
+        for (int b = bins - 1; b > 0; --b) {
+            if (!isEmpty(binBox[b])) acc.expand(binBox[b]);
+            n += exit[b];
+            rightBox[b - 1] = acc;
+            rightCount[b - 1] = n;
+        }
+        acc = AABB();
+        n = 0;
+        for (int b = 0; b < bins - 1; ++b) {
+            if (!isEmpty(binBox[b])) acc.expand(binBox[b]);
+            n += enter[b];
+            if (n == 0 || rightCount[b] == 0) continue;
+            float cost = s.traversalCost + s.intersectionCost *
+                         (acc.surfaceArea() * n + rightBox[b].surfaceArea() * rightCount[b]) * invArea;
+            if (cost < best.cost) {
+                best.cost = cost;
+                best.axis = axis;
+                best.bin = b;
+                best.pos = lo + (b + 1) * binWidth;
+                best.left = acc;
+                best.right = rightBox[b];
+                best.leftCount = n;
+                best.rightCount = rightCount[b];
+            }
+        }
+    }
+    return best;
+}
+
+// Distributes the references of a spatial split. A straddling reference is
+// split into both sides while the budget lasts, unless moving it whole to
+// one side is cheaper (reference unsplitting); both sides end up non-empty or
+// the split is abandoned.
+bool applySpatialSplit(SpatialContext &ctx, std::vector<SpatialRef> &refs, const SpatialSplit &split,
+                       std::vector<SpatialRef> &left, std::vector<SpatialRef> &right)
+{
+    const int axis = split.axis;
+    AABB leftBox = split.left, rightBox = split.right;
+    float leftCount = float(split.leftCount), rightCount = float(split.rightCount);
+    int budget = ctx.refBudget;
+
+    for (const SpatialRef &r : refs) {
+        if (r.box.mx[axis] <= split.pos) {
+            left.push_back(r);
+            continue;
+        }
+        if (r.box.mn[axis] >= split.pos) {
+            right.push_back(r);
+            continue;
+        }
+
+        AABB leftPart, rightPart;
+        splitReference(ctx.vertices, r, axis, split.pos, leftPart, rightPart);
+        if (isEmpty(rightPart)) {
+            left.push_back({r.prim, leftPart});
+            continue;
+        }
+        if (isEmpty(leftPart)) {
+            right.push_back({r.prim, rightPart});
+            continue;
+        }
+
+        AABB leftWith = leftBox, rightWith = rightBox;
+        leftWith.expand(r.box);
+        rightWith.expand(r.box);
+        float splitCost = leftBox.surfaceArea() * leftCount + rightBox.surfaceArea() * rightCount;
+        float toLeft = leftWith.surfaceArea() * leftCount + rightBox.surfaceArea() * (rightCount - 1);
+        float toRight = leftBox.surfaceArea() * (leftCount - 1) + rightWith.surfaceArea() * rightCount;
+
+        if (budget > 0 && splitCost < std::min(toLeft, toRight)) {
+            left.push_back({r.prim, leftPart});
+            right.push_back({r.prim, rightPart});
+            --budget;
+        } else if (toLeft <= toRight) {
+            left.push_back(r);
+            leftBox = leftWith;
+            rightCount -= 1;
+        } else {
+            right.push_back(r);
+            rightBox = rightWith;
+            leftCount -= 1;
+        }
+    }
+
+    if (left.empty() || right.empty()) {
+        left.clear();
+        right.clear();
+        return false;
+    }
+    ctx.refBudget = budget;
+    return true;
+}
+
+int buildSpatialNode(SpatialContext &ctx, std::vector<BVHNode> &nodes, std::vector<SpatialRef> refs,
+                     int depth)
+{
+    const BVHBuildSettings &s = ctx.settings;
+    const int nodeIdx = (int)nodes.size();
+    nodes.push_back(BVHNode());
+
+    AABB box, centroidBox;
+    for (const SpatialRef &r : refs) {
+        box.expand(r.box);
+        centroidBox.expand(r.box.center());
+    }
+    nodes[nodeIdx].box = box;
+
+    const int count = (int)refs.size();
+    auto makeLeaf = [&]() {
+        nodes[nodeIdx].triStart = (int)ctx.order.size();
+        nodes[nodeIdx].triCount = count;
+        for (const SpatialRef &r : refs)
+            ctx.order.push_back(r.prim);
+        return nodeIdx;
+    };
+    if (count == 1) return makeLeaf();
+
+    std::vector<SpatialRef> left, right;
+    auto splitAtMedian = [&]() {
+        int axis = centroidBox.longestAxis();
+        std::nth_element(refs.begin(), refs.begin() + count / 2, refs.end(),
+                         [axis](const SpatialRef &a, const SpatialRef &b) {
+                             return a.box.center()[axis] < b.box.center()[axis];
+                         });
+        left.assign(refs.begin(), refs.begin() + count / 2);
+        right.assign(refs.begin() + count / 2, refs.end());
+    };
+
+    // Same depth bound as buildNode()
+    if (BVHBuilder::MaxDepth - 1 - depth <= halvingLevels(count)) {
+        if (count <= s.maxLeafSize) return makeLeaf();
+        splitAtMedian();
+    } else {
+        const float area = box.surfaceArea();
+        const float invArea = area > 0.0f ? 1.0f / area : 0.0f;
+        SpatialSplit object = objectSplit(ctx, refs, centroidBox, invArea);
+        SpatialSplit spatial;
+        if (ctx.refBudget > 0 &&
+            (object.axis < 0 || overlap(object.left, object.right).surfaceArea() > ctx.minOverlap))
+            spatial = spatialSplit(ctx, refs, box, invArea);
+
+        float bestCost = std::min(object.cost, spatial.cost);
+        if (bestCost == FLT_MAX || (count <= s.maxLeafSize && bestCost >= s.intersectionCost * count)) {
+            if (count <= s.maxLeafSize) return makeLeaf();
+            splitAtMedian();
+        } else if (spatial.cost < object.cost && applySpatialSplit(ctx, refs, spatial, left, right)) {
+            // left and right are filled in
+        } else if (object.axis >= 0) {
+            float lo = centroidBox.mn[object.axis];
+            float scale = ctx.bins / (centroidBox.mx[object.axis] - lo);
+            for (const SpatialRef &r : refs) {
+                bool toLeft = binOf(r.box.center()[object.axis], lo, scale, ctx.bins) <= object.bin;
+                (toLeft ? left : right).push_back(r);
+            }
+        } else {
+            splitAtMedian();
+        }
+    }
+
+    refs = std::vector<SpatialRef>();
+    int l = buildSpatialNode(ctx, nodes, std::move(left), depth + 1);
+    int r = buildSpatialNode(ctx, nodes, std::move(right), depth + 1);
+    nodes[nodeIdx].left = l;
+    nodes[nodeIdx].right = r;
     return nodeIdx;
 }
 
-bool BVH::triIntersect(const QVector3D &orig, const QVector3D &dir,
-                        const RenderTriangle &tri, float &t)
+// Serial: SBVH is meant for final renders where the build time matters less
+void buildSpatial(const std::vector<AABB> &primBounds, const std::vector<QVector3D> &vertices,
+                  const BVHBuildSettings &settings, BVHBuilder::Result &result)
+{
+    const int count = (int)primBounds.size();
+    std::vector<SpatialRef> refs(count);
+    AABB root;
+    for (int i = 0; i < count; ++i) {
+        refs[i] = {i, primBounds[i]};
+        root.expand(primBounds[i]);
+    }
+
+    SpatialContext ctx{vertices, settings, result.primOrder};
+    ctx.bins = std::clamp(settings.bins, 2, MaxBins);
+    double budget = double(count) * std::max(0.0f, settings.spatialSplitBudget);
+    ctx.refBudget = int(std::min(budget, double(INT_MAX - count)));
+    ctx.minOverlap = 1e-5f * root.surfaceArea();
+    result.primOrder.reserve(size_t(count) + ctx.refBudget);
+    result.nodes.reserve(size_t(count) * 2);
+    buildSpatialNode(ctx, result.nodes, std::move(refs), 0);
+}
+
+} // namespace
+
+const char *bvhSplitMethodName(BVHSplitMethod method)
+{
+    switch (method) {
+    case BVHSplitMethod::Median: return "Median";
+    case BVHSplitMethod::Morton: return "Morton (LBVH)";
+    case BVHSplitMethod::BinnedSAH: return "Binned SAH";
+    case BVHSplitMethod::SpatialSAH: return "Spatial SAH (SBVH)";
+    }
+    return "Unknown";
+}
+
+BVHBuilder::Result BVHBuilder::build(const std::vector<AABB> &primBounds,
+                                     const BVHBuildSettings &settings, ThreadPool *pool,
+                                     const std::vector<QVector3D> *triangleVertices)
 {
-    const float EPSILON = 1e-6f;
-    QVector3D e1 = tri.v1 - tri.v0;
-    QVector3D e2 = tri.v2 - tri.v0;
-    QVector3D h = QVector3D::crossProduct(dir, e2);
-    float a = QVector3D::dotProduct(e1, h);
-    if (std::abs(a) < EPSILON) return false;
-    float f = 1.0f / a;
-    QVector3D s = orig - tri.v0;
-    float u = f * QVector3D::dotProduct(s, h);
-    if (u < 0.0f || u > 1.0f) return false;
-    QVector3D q = QVector3D::crossProduct(s, e1);
-    float v = f * QVector3D::dotProduct(dir, q);
-    if (v < 0.0f || u + v > 1.0f) return false;
-    t = f * QVector3D::dotProduct(e2, q);
-    return t > EPSILON;
+    Result result;
+    const int count = (int)primBounds.size();
+    if (count == 0) return result;
+    if (settings.method == BVHSplitMethod::SpatialSAH && triangleVertices &&
+        triangleVertices->size() >= size_t(count) * 3) {
+        buildSpatial(primBounds, *triangleVertices, settings, result);
+        return result;
+    }
+    if (pool && pool->threadCount() == 1) pool = nullptr;
+
+    BuildContext ctx{primBounds, std::vector<QVector3D>(count), {}, settings, result.primOrder};
+    ctx.bins = std::clamp(settings.bins, 2, MaxBins);
+    result.primOrder.resize(count);
+    forChunks(pool, 0, count, [&](int begin, int end, int) {
+        for (int i = begin; i < end; ++i) {
+            result.primOrder[i] = i;
+            ctx.centroids[i] = primBounds[i].center();
+        }
+    });
+
+    if (settings.method == BVHSplitMethod::Morton) {
+        AABB box, centroidBox;
+        rangeBounds(ctx, pool, 0, count, box, centroidBox);
+        QVector3D extent = centroidBox.mx - centroidBox.mn;
+        QVector3D inv(extent.x() > 0.0f ? 1.0f / extent.x() : 0.0f,
+                      extent.y() > 0.0f ? 1.0f / extent.y() : 0.0f,
+                      extent.z() > 0.0f ? 1.0f / extent.z() : 0.0f);
+        ctx.mortonCodes.resize(count);
+        forChunks(pool, 0, count, [&](int begin, int end, int) {
+            for (int i = begin; i < end; ++i)
+                ctx.mortonCodes[i] = mortonCode((ctx.centroids[i] - centroidBox.mn) * inv);
+        });
+        sortByMortonCode(ctx, pool);
+    }
+
+    if (!pool) {
+        result.nodes.reserve(size_t(count) * 2);
+        buildNode(ctx, result.nodes, 0, count, 0);
+        return result;
+    }
+
+    // Top levels on this thread with parallel binning, until there are enough
+    // subtrees to keep every worker busy; then the subtrees in parallel
+    const int taskSize = std::max(4096, count / (pool->threadCount() * 8));
+    std::vector<SubtreeTask> tasks;
+    buildNode(ctx, result.nodes, 0, count, 0, pool, taskSize, &tasks);
+    const int topNodes = (int)result.nodes.size();
+
+    std::vector<std::vector<BVHNode>> subtrees(tasks.size());
+    pool->parallelFor((int)tasks.size(), [&](int t, int) {
+        subtrees[t].reserve(size_t(tasks[t].end - tasks[t].start) * 2);
+        buildNode(ctx, subtrees[t], tasks[t].start, tasks[t].end, tasks[t].depth);
+    });
+
+    // Splice each subtree in: its root replaces the placeholder, the other nodes
+    // are appended with their child links shifted
+    for (size_t t = 0; t < tasks.size(); ++t) {
+        const std::vector<BVHNode> &sub = subtrees[t];
+        const int offset = (int)result.nodes.size() - 1;
+        for (size_t i = 0; i < sub.size(); ++i) {
+            BVHNode node = sub[i];
+            if (!node.isLeaf()) {
+                node.left += offset;
+                node.right += offset;
+            }
+            if (i == 0) result.nodes[tasks[t].slot] = node;
+            else result.nodes.push_back(node);
+        }
+    }
+
+    // Bottom-up bounds of the top levels waited for their subtrees; children
+    // always follow their parent, so a reverse sweep sees them first
+    if (settings.method == BVHSplitMethod::Morton) {
+        for (int i = topNodes - 1; i >= 0; --i) {
+            BVHNode &node = result.nodes[i];
+            if (node.isLeaf()) continue;
+            node.box = result.nodes[node.left].box;
+            node.box.expand(result.nodes[node.right].box);
+        }
+    }
+    return result;
 }
 
-int BVH::intersect(const QVector3D &orig, const QVector3D &dir, float &outT) const
+float BVHBuilder::sahCost(const std::vector<BVHNode> &nodes, const BVHBuildSettings &settings)
 {
-    if (m_nodes.empty()) return -1;
+    if (nodes.empty()) return 0.0f;
+    float rootArea = nodes[0].box.surfaceArea();
+    if (rootArea <= 0.0f) return 0.0f;
 
+    double cost = 0.0;
+    for (const BVHNode &node : nodes) {
+        float area = node.box.surfaceArea();
+        cost += node.isLeaf() ? settings.intersectionCost * node.triCount * area
+                              : settings.traversalCost * area;
+    }
+    return float(cost / rootArea);
+}
+
+// Writes the binary subtree under binIdx in depth-first order
+static int flattenNode(const std::vector<BVHNode> &bin, int binIdx, std::vector<BVHFlatNode> &out)
+{
+    const BVHNode &n = bin[binIdx];
+    int nodeIdx = (int)out.size();
+    out.emplace_back();
+    for (int a = 0; a < 3; ++a) {
+        out[nodeIdx].bmin[a] = n.box.mn[a];
+        out[nodeIdx].bmax[a] = n.box.mx[a];
+    }
+    if (n.isLeaf()) {
+        out[nodeIdx].rightOrStart = n.triStart;
+        out[nodeIdx].count = n.triCount;
+    } else {
+        flattenNode(bin, n.left, out); // lands at nodeIdx + 1
+        int right = flattenNode(bin, n.right, out);
+        out[nodeIdx].rightOrStart = right;
+        out[nodeIdx].count = 0;
+    }
+    return nodeIdx;
+}
+
+std::vector<BVHFlatNode> BVHBuilder::flatten(const std::vector<BVHNode> &nodes)
+{
+    std::vector<BVHFlatNode> out;
+    out.reserve(nodes.size());
+    if (!nodes.empty()) flattenNode(nodes, 0, out);
+    return out;
+}
+
+void BVHBuilder::refit(std::vector<BVHNode> &nodes, const std::vector<int> &primOrder,
+                       const std::vector<AABB> &primBounds)
+{
+    for (int i = (int)nodes.size() - 1; i >= 0; --i) {
+        BVHNode &node = nodes[i];
+        node.box = AABB();
+        if (node.isLeaf()) {
+            for (int p = node.triStart; p < node.triStart + node.triCount; ++p)
+                node.box.expand(primBounds[primOrder[p]]);
+        } else {
+            node.box.expand(nodes[node.left].box);
+            node.box.expand(nodes[node.right].box);
+        }
+    }
+}
+
+float BVHBuilder::flatCost(const std::vector<BVHFlatNode> &nodes, const BVHBuildSettings &settings)
+{
+    auto area = [](const BVHFlatNode &n) {
+        float dx = n.bmax[0] - n.bmin[0], dy = n.bmax[1] - n.bmin[1], dz = n.bmax[2] - n.bmin[2];
+        return dx < 0.0f ? 0.0f : 2.0f * (dx * dy + dy * dz + dz * dx);
+    };
+    if (nodes.empty() || area(nodes[0]) <= 0.0f) return 0.0f;
+
+    double cost = 0.0;
+    for (const BVHFlatNode &node : nodes) {
+        cost += node.count > 0 ? settings.intersectionCost * node.count * area(node)
+                               : settings.traversalCost * area(node);
+    }
+    return float(cost / area(nodes[0]));
+}
+
+// Collapses the binary subtree under binIdx into wide nodes: the child with the
+// largest surface area is opened until N slots are used or only leaves remain
+template <int N>
+static int collapse(const std::vector<BVHNode> &bin, int binIdx, std::vector<BVHWideNode<N>> &out)
+{
+    int slots[N];
+    int used = 0;
+    if (bin[binIdx].isLeaf()) {
+        slots[used++] = binIdx; // single-leaf root
+    } else {
+        slots[used++] = bin[binIdx].left;
+        slots[used++] = bin[binIdx].right;
+    }
+    while (used < N) {
+        int best = -1;
+        float bestArea = -1.0f;
+        for (int i = 0; i < used; ++i) {
+            const BVHNode &n = bin[slots[i]];
+            if (!n.isLeaf() && n.box.surfaceArea() > bestArea) {
+                bestArea = n.box.surfaceArea();
+                best = i;
+            }
+        }
+        if (best < 0) break;
+        const BVHNode &open = bin[slots[best]];
+        slots[best] = open.left;
+        slots[used++] = open.right;
+    }
+
+    int nodeIdx = (int)out.size();
+    out.emplace_back();
+    for (int i = 0; i < N; ++i) {
+        const bool empty = i >= used;
+        const AABB &box = empty ? AABB() : bin[slots[i]].box;
+        for (int a = 0; a < 3; ++a) {
+            out[nodeIdx].bounds[a][i] = box.mn[a];
+            out[nodeIdx].bounds[a + 3][i] = box.mx[a];
+        }
+        out[nodeIdx].child[i] = -1;
+        out[nodeIdx].count[i] = 0;
+    }
+    for (int i = 0; i < used; ++i) {
+        const BVHNode &n = bin[slots[i]];
+        if (n.isLeaf()) {
+            out[nodeIdx].child[i] = n.triStart;
+            out[nodeIdx].count[i] = n.triCount;
+        } else {
+            int child = collapse(bin, slots[i], out);
+            out[nodeIdx].child[i] = child;
+        }
+    }
+    return nodeIdx;
+}
+
+template <int N>
+static AABB slotBounds(const BVHWideNode<N> &node, int i)
+{
+    AABB box;
+    for (int a = 0; a < 3; ++a) {
+        box.mn[a] = node.bounds[a][i];
+        box.mx[a] = node.bounds[a + 3][i];
+    }
+    return box;
+}
+
+// Union of the used slots; empty slots hold inverted bounds and must be skipped
+template <int N>
+static AABB wideNodeBounds(const BVHWideNode<N> &node)
+{
+    AABB box;
+    for (int i = 0; i < N; ++i) {
+        if (node.count[i] > 0 || node.child[i] >= 0)
+            box.expand(slotBounds(node, i));
+    }
+    return box;
+}
+
+// Bottom-up refit of a collapsed tree; like the binary layouts, children follow
+// their parent
+template <int N, class LeafBounds>
+static void refitWide(std::vector<BVHWideNode<N>> &nodes, LeafBounds leafBounds)
+{
+    for (int ni = (int)nodes.size() - 1; ni >= 0; --ni) {
+        BVHWideNode<N> &node = nodes[ni];
+        for (int i = 0; i < N; ++i) {
+            AABB box;
+            if (node.count[i] > 0) box = leafBounds(node.child[i], node.count[i]);
+            else if (node.child[i] >= 0) box = wideNodeBounds(nodes[node.child[i]]);
+            else continue;
+            for (int a = 0; a < 3; ++a) {
+                node.bounds[a][i] = box.mn[a];
+                node.bounds[a + 3][i] = box.mx[a];
+            }
+        }
+    }
+}
+
+template <int N>
+static float wideCost(const std::vector<BVHWideNode<N>> &nodes, const BVHBuildSettings &settings)
+{
+    if (nodes.empty()) return 0.0f;
+    float rootArea = wideNodeBounds(nodes[0]).surfaceArea();
+    if (rootArea <= 0.0f) return 0.0f;
+
+    double cost = 0.0;
+    for (const BVHWideNode<N> &node : nodes) {
+        cost += settings.traversalCost * wideNodeBounds(node).surfaceArea();
+        for (int i = 0; i < N; ++i) {
+            if (node.count[i] > 0)
+                cost += settings.intersectionCost * node.count[i] * slotBounds(node, i).surfaceArea();
+        }
+    }
+    return float(cost / rootArea);
+}
+
+static size_t nodeSize(int width)
+{
+    switch (width) {
+    case 8: return sizeof(BVHWideNode<8>);
+    case 4: return sizeof(BVHWideNode<4>);
+    default: return sizeof(BVHFlatNode);
+    }
+}
+
+int BVH::supportedWidth()
+{
+#ifdef BVH_X86
+#if defined(__GNUC__)
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return 8;
+#elif defined(_MSC_VER)
+    int regs[4];
+    __cpuid(regs, 0);
+    if (regs[0] >= 7) {
+        __cpuid(regs, 1);
+        bool fma = regs[2] & (1 << 12);
+        bool osxsave = regs[2] & (1 << 27);
+        __cpuidex(regs, 7, 0);
+        bool avx2 = regs[1] & (1 << 5);
+        if (fma && avx2 && osxsave && (_xgetbv(0) & 6) == 6) return 8;
+    }
+#endif
+    return 4;
+#else
+    return 2;
+#endif
+}
+
+int BVH::traversalWidth(int requested)
+{
+    // Requested widths the CPU cannot run fall back to the widest it can
+    int width = requested == 0 ? supportedWidth() : std::min(requested, supportedWidth());
+    return width == 8 || width == 4 ? width : 2;
+}
+
+void BVH::build(QVector<RenderTriangle> tris, const BVHBuildSettings &settings, ThreadPool *pool)
+{
+    m_tris.clear();
+    m_hot.clear();
+    m_nodes.clear();
+    m_nodes4.clear();
+    m_nodes8.clear();
+    m_bounds = AABB();
+    m_sahCost = 0.0f;
+    m_primOrder.clear();
+    m_settings = settings;
+    m_builtCost = 0.0f;
+    m_nodeCount = 0;
+    m_inputCount = tris.size();
+    m_file.reset();
+    m_mappedHot = nullptr;
+    m_mappedNodes = nullptr;
+
+    if (tris.isEmpty()) return;
+
+    std::vector<AABB> bounds(tris.size());
+    for (int i = 0; i < tris.size(); ++i) {
+        bounds[i].expand(tris[i].v0);
+        bounds[i].expand(tris[i].v1);
+        bounds[i].expand(tris[i].v2);
+    }
+
+    // Spatial splits cut the triangles themselves, not just their bounds
+    std::vector<QVector3D> vertices;
+    if (settings.method == BVHSplitMethod::SpatialSAH) {
+        vertices.reserve(size_t(tris.size()) * 3);
+        for (const RenderTriangle &t : tris) {
+            vertices.push_back(t.v0);
+            vertices.push_back(t.v1);
+            vertices.push_back(t.v2);
+        }
+    }
+
+    BVHBuilder::Result result = BVHBuilder::build(bounds, settings, pool, &vertices);
+    bounds = std::vector<AABB>();
+    vertices = std::vector<QVector3D>();
+    m_bounds = result.nodes[0].box;
+    m_sahCost = BVHBuilder::sahCost(result.nodes, settings);
+
+    // Leaf order; the input is released before the hot copy is made
+    const int refCount = int(result.primOrder.size());
+    m_tris.resize(refCount);
+    for (int i = 0; i < refCount; ++i)
+        m_tris[i] = tris[result.primOrder[i]];
+    tris = QVector<RenderTriangle>();
+    m_hot.resize(m_tris.size());
+    for (int i = 0; i < m_tris.size(); ++i) {
+        const RenderTriangle &t = m_tris[i];
+        m_hot[i] = {t.v0, t.v1 - t.v0, t.v2 - t.v0};
+    }
+
+    m_width = traversalWidth(settings.width);
+    if (m_width == 8) {
+        collapse<8>(result.nodes, 0, m_nodes8);
+        m_nodeCount = int(m_nodes8.size());
+    } else if (m_width == 4) {
+        collapse<4>(result.nodes, 0, m_nodes4);
+        m_nodeCount = int(m_nodes4.size());
+    } else {
+        m_nodes = BVHBuilder::flatten(result.nodes);
+        m_nodeCount = int(m_nodes.size());
+    }
+    size_t nodeBytes = m_nodeCount * nodeSize(m_width);
+
+    m_primOrder = std::move(result.primOrder);
+    m_builtCost = settings.method == BVHSplitMethod::SpatialSAH ? wholeTriangleCost() : layoutCost();
+
+    qDebug() << "BVH built:" << result.nodes.size() << "nodes," << m_inputCount << "tris,"
+             << "SAH cost" << m_sahCost;
+    if (refCount > m_inputCount)
+        qDebug() << "BVH spatial splits:" << refCount - m_inputCount << "extra triangle references";
+    qDebug() << "BVH traversal:" << m_width << "wide,"
+             << (nodeBytes + m_hot.size() * sizeof(BVHTriangle)) / 1024 << "KB of nodes and triangles";
+}
+
+bool BVH::refit(QVector<RenderTriangle> tris, ThreadPool *pool)
+{
+    if (m_tris.isEmpty() || tris.size() != m_inputCount) {
+        build(std::move(tris), m_settings, pool);
+        return false;
+    }
+
+    detach();
+    for (int i = 0; i < m_tris.size(); ++i) {
+        const RenderTriangle &t = tris[m_primOrder[i]];
+        m_tris[i] = t;
+        m_hot[i] = {t.v0, t.v1 - t.v0, t.v2 - t.v0};
+    }
+    refitBounds();
+
+    // Moving triangles apart leaves nodes overlapping; past the threshold a
+    // fresh tree pays for itself
+    float cost = layoutCost();
+    if (cost > m_builtCost * m_settings.refitRebuildRatio) {
+        qDebug() << "BVH refit: SAH cost" << cost << "against" << m_builtCost << "built, rebuilding";
+        build(std::move(tris), m_settings, pool);
+        return false;
+    }
+    return true;
+}
+
+void BVH::refitBounds()
+{
+    auto leafBounds = [this](int start, int count) {
+        AABB box;
+        for (int i = start; i < start + count; ++i) {
+            box.expand(m_tris[i].v0);
+            box.expand(m_tris[i].v1);
+            box.expand(m_tris[i].v2);
+        }
+        return box;
+    };
+    if (m_width == 8) {
+        refitWide(m_nodes8, leafBounds);
+        m_bounds = wideNodeBounds(m_nodes8[0]);
+    } else if (m_width == 4) {
+        refitWide(m_nodes4, leafBounds);
+        m_bounds = wideNodeBounds(m_nodes4[0]);
+    } else {
+        BVHBuilder::refitFlat(m_nodes, leafBounds);
+        m_bounds = AABB();
+        m_bounds.expand(QVector3D(m_nodes[0].bmin[0], m_nodes[0].bmin[1], m_nodes[0].bmin[2]));
+        m_bounds.expand(QVector3D(m_nodes[0].bmax[0], m_nodes[0].bmax[1], m_nodes[0].bmax[2]));
+    }
+}
+
+float BVH::wholeTriangleCost() const
+{
+    BVH whole;
+    whole.m_tris = m_tris;
+    whole.m_nodes = m_nodes;
+    whole.m_nodes4 = m_nodes4;
+    whole.m_nodes8 = m_nodes8;
+    whole.m_width = m_width;
+    whole.m_settings = m_settings;
+    whole.refitBounds();
+    return whole.layoutCost();
+}
+
+float BVH::layoutCost() const
+{
+    switch (m_width) {
+    case 8: return wideCost(m_nodes8, m_settings);
+    case 4: return wideCost(m_nodes4, m_settings);
+    default: return BVHBuilder::flatCost(m_nodes, m_settings);
+    }
+}
+
+static constexpr quint32 CacheMagic = 0x48564252; // "RBVH"
+static constexpr quint32 CacheVersion = 4; // 2: depth bounded by BVHBuilder::MaxDepth, 3: SBVH input count, 4: SBVH built cost
+static constexpr quint64 CacheAlign = 64; // BVHWideNode alignment
+
+// Header of a BVH cache file. The arrays follow at aligned offsets and are the
+// in-memory structs, so a file only loads on a build with the same layout.
+struct BVHCacheHeader {
+    quint32 magic;
+    quint32 version;
+    quint8 key[32];
+    qint32 keySize;
+    qint32 structSizes[4]; // RenderTriangle, BVHTriangle, traversal node, pointer
+    qint32 width;
+    qint32 triCount;   // leaf references, more than inputCount after spatial splits
+    qint32 inputCount; // triangles given to build()
+    qint32 nodeCount;
+    float sahCost;
+    float builtCost;
+    float bounds[6];
+    quint64 hotOffset;   // BVHTriangle[triCount]
+    quint64 nodeOffset;  // node[nodeCount]
+    quint64 primOffset;  // qint32[triCount]
+    quint64 trisOffset;  // RenderTriangle[triCount]
+    quint64 fileSize;
+};
+
+static void fillStructSizes(qint32 sizes[4], int width)
+{
+    sizes[0] = sizeof(RenderTriangle);
+    sizes[1] = sizeof(BVHTriangle);
+    sizes[2] = qint32(nodeSize(width));
+    sizes[3] = sizeof(void *);
+}
+
+static quint64 cacheAlign(quint64 offset)
+{
+    return (offset + CacheAlign - 1) / CacheAlign * CacheAlign;
+}
+
+// Children follow their parent, leaves stay inside the triangles and no node is
+// deeper than the traversal stacks allow, so a corrupt file can neither loop nor
+// read or write out of bounds. Parents come first, so one pass finds each
+// node's deepest path from the root.
+static bool validNodes(const BVHFlatNode *nodes, int count, int triCount)
+{
+    std::vector<int> depth(count, 0);
+    for (int i = 0; i < count; ++i) {
+        const BVHFlatNode &n = nodes[i];
+        if (n.count > 0 ? n.rightOrStart < 0 || n.rightOrStart > triCount - n.count
+                        : n.count < 0 || n.rightOrStart <= i + 1 || n.rightOrStart >= count)
+            return false;
+        if (depth[i] >= BVHBuilder::MaxDepth) return false;
+        if (n.count == 0) {
+            depth[i + 1] = std::max(depth[i + 1], depth[i] + 1);
+            depth[n.rightOrStart] = std::max(depth[n.rightOrStart], depth[i] + 1);
+        }
+    }
+    return true;
+}
+
+template <int N>
+static bool validNodes(const BVHWideNode<N> *nodes, int count, int triCount)
+{
+    std::vector<int> depth(count, 0);
+    for (int i = 0; i < count; ++i) {
+        if (depth[i] >= BVHBuilder::MaxDepth) return false;
+        for (int c = 0; c < N; ++c) {
+            int child = nodes[i].child[c], n = nodes[i].count[c];
+            if (n > 0 ? child < 0 || child > triCount - n
+                      : n < 0 || (child >= 0 && (child <= i || child >= count)))
+                return false;
+            if (n == 0 && child >= 0) depth[child] = std::max(depth[child], depth[i] + 1);
+        }
+    }
+    return true;
+}
+
+bool BVH::save(const QString &path, const QByteArray &key) const
+{
+    BVHCacheHeader h;
+    std::memset(&h, 0, sizeof(h));
+    if (m_tris.isEmpty() || key.size() > int(sizeof(h.key))) return false;
+
+    h.magic = CacheMagic;
+    h.version = CacheVersion;
+    std::memcpy(h.key, key.constData(), key.size());
+    h.keySize = key.size();
+    fillStructSizes(h.structSizes, m_width);
+    h.width = m_width;
+    h.triCount = m_tris.size();
+    h.inputCount = m_inputCount;
+    h.nodeCount = m_nodeCount;
+    h.sahCost = m_sahCost;
+    h.builtCost = m_builtCost;
+    for (int a = 0; a < 3; ++a) {
+        h.bounds[a] = m_bounds.mn[a];
+        h.bounds[a + 3] = m_bounds.mx[a];
+    }
+    h.hotOffset = cacheAlign(sizeof(h));
+    h.nodeOffset = cacheAlign(h.hotOffset + quint64(h.triCount) * sizeof(BVHTriangle));
+    h.primOffset = cacheAlign(h.nodeOffset + quint64(h.nodeCount) * nodeSize(m_width));
+    h.trisOffset = cacheAlign(h.primOffset + quint64(h.triCount) * sizeof(qint32));
+    h.fileSize = h.trisOffset + quint64(h.triCount) * sizeof(RenderTriangle);
+
+    const void *nodes = m_width == 8 ? static_cast<const void *>(nodeData(m_nodes8))
+                      : m_width == 4 ? static_cast<const void *>(nodeData(m_nodes4))
+                                     : static_cast<const void *>(nodeData(m_nodes));
+    std::vector<qint32> primOrder(m_primOrder.begin(), m_primOrder.end());
+
+    QSaveFile f(path);
+    if (!f.open(QIODevice::WriteOnly)) {
+        qWarning() << "Cannot write BVH cache:" << path;
+        return false;
+    }
+    quint64 pos = 0;
+    auto writeAt = [&](quint64 offset, const void *data, quint64 bytes) {
+        bool ok = f.write(QByteArray(int(offset - pos), '\0')) == qint64(offset - pos) &&
+                  f.write(static_cast<const char *>(data), qint64(bytes)) == qint64(bytes);
+        pos = offset + bytes;
+        return ok;
+    };
+    bool ok = writeAt(0, &h, sizeof(h)) &&
+              writeAt(h.hotOffset, hotData(), quint64(h.triCount) * sizeof(BVHTriangle)) &&
+              writeAt(h.nodeOffset, nodes, quint64(h.nodeCount) * nodeSize(m_width)) &&
+              writeAt(h.primOffset, primOrder.data(), primOrder.size() * sizeof(qint32)) &&
+              writeAt(h.trisOffset, m_tris.constData(), quint64(h.triCount) * sizeof(RenderTriangle));
+    if (!ok) {
+        f.cancelWriting();
+        return false;
+    }
+    return f.commit();
+}
+
+bool BVH::load(const QString &path, const QByteArray &key, const BVHBuildSettings &settings)
+{
+    auto file = std::make_shared<QFile>(path);
+    if (!file->open(QIODevice::ReadOnly) || file->size() < qint64(sizeof(BVHCacheHeader)))
+        return false;
+    const uchar *data = file->map(0, file->size());
+    if (!data) return false;
+
+    BVHCacheHeader h;
+    std::memcpy(&h, data, sizeof(h));
+    qint32 sizes[4];
+    fillStructSizes(sizes, h.width);
+    int width = traversalWidth(settings.width);
+    bool valid = h.magic == CacheMagic && h.version == CacheVersion &&
+                 h.keySize == key.size() && std::memcmp(h.key, key.constData(), key.size()) == 0 &&
+                 std::memcmp(h.structSizes, sizes, sizeof(sizes)) == 0 && h.width == width &&
+                 h.triCount > 0 && h.inputCount > 0 && h.inputCount <= h.triCount &&
+                 h.nodeCount > 0 && h.fileSize == quint64(file->size());
+    valid = valid &&
+            h.hotOffset >= sizeof(h) && h.hotOffset % CacheAlign == 0 &&
+            h.nodeOffset >= h.hotOffset + quint64(h.triCount) * sizeof(BVHTriangle) &&
+            h.nodeOffset % CacheAlign == 0 &&
+            h.primOffset >= h.nodeOffset + quint64(h.nodeCount) * nodeSize(width) &&
+            h.trisOffset >= h.primOffset + quint64(h.triCount) * sizeof(qint32) &&
+            h.fileSize == h.trisOffset + quint64(h.triCount) * sizeof(RenderTriangle);
+    if (!valid) {
+        qWarning() << "Ignoring stale BVH cache:" << path;
+        return false;
+    }
+
+    const void *nodes = data + h.nodeOffset;
+    if (width == 8) valid = validNodes(static_cast<const BVHWideNode<8> *>(nodes), h.nodeCount, h.triCount);
+    else if (width == 4) valid = validNodes(static_cast<const BVHWideNode<4> *>(nodes), h.nodeCount, h.triCount);
+    else valid = validNodes(static_cast<const BVHFlatNode *>(nodes), h.nodeCount, h.triCount);
+    std::vector<int> primOrder(h.triCount);
+    std::memcpy(primOrder.data(), data + h.primOffset, primOrder.size() * sizeof(qint32));
+    for (int p : primOrder)
+        valid = valid && p >= 0 && p < h.inputCount;
+    if (!valid) {
+        qWarning() << "Corrupt BVH cache:" << path;
+        return false;
+    }
+
+    build(QVector<RenderTriangle>(), settings);
+    m_tris.resize(h.triCount);
+    std::memcpy(static_cast<void *>(m_tris.data()), data + h.trisOffset,
+                size_t(h.triCount) * sizeof(RenderTriangle));
+    m_primOrder = std::move(primOrder);
+    m_inputCount = h.inputCount;
+    m_width = width;
+    m_nodeCount = h.nodeCount;
+    m_sahCost = h.sahCost;
+    m_builtCost = h.builtCost;
+    m_bounds.mn = QVector3D(h.bounds[0], h.bounds[1], h.bounds[2]);
+    m_bounds.mx = QVector3D(h.bounds[3], h.bounds[4], h.bounds[5]);
+    m_file = std::move(file);
+    m_mappedHot = reinterpret_cast<const BVHTriangle *>(data + h.hotOffset);
+    m_mappedNodes = nodes;
+    return true;
+}
+
+void BVH::detach()
+{
+    if (!m_file) return;
+    m_hot.assign(m_mappedHot, m_mappedHot + m_tris.size());
+    if (m_width == 8) m_nodes8.assign(nodeData(m_nodes8), nodeData(m_nodes8) + m_nodeCount);
+    else if (m_width == 4) m_nodes4.assign(nodeData(m_nodes4), nodeData(m_nodes4) + m_nodeCount);
+    else m_nodes.assign(nodeData(m_nodes), nodeData(m_nodes) + m_nodeCount);
+    m_file.reset();
+    m_mappedHot = nullptr;
+    m_mappedNodes = nullptr;
+}
+
+int BVH::intersect(const QVector3D &orig, const QVector3D &dir, float &outT, float tMax) const
+{
+    outT = tMax;
+    if (m_tris.isEmpty()) return -1;
+    switch (m_width) {
+#ifdef BVH_X86
+    case 8: return bvh8::intersect(nodeData(m_nodes8), hotData(), orig, dir, outT, tMax);
+#endif
+    case 4: return bvh4::closestHit(nodeData(m_nodes4), hotData(), orig, dir, outT, tMax);
+    default: return intersectBinary(orig, dir, outT, tMax);
+    }
+}
+
+int BVH::intersectBinary(const QVector3D &orig, const QVector3D &dir, float &outT, float tMax) const
+{
     QVector3D invDir(1.0f / dir.x(), 1.0f / dir.y(), 1.0f / dir.z());
-    outT = FLT_MAX;
+    outT = tMax;
     int hitIdx = -1;
+    const BVHFlatNode *nodes = nodeData(m_nodes);
+    const BVHTriangle *hot = hotData();
+
+    // Near child first, so the closest hit shrinks outT before the far child is
+    // popped; entries the hit has moved in front of are skipped. At most one
+    // far child waits per level.
+    struct Entry {
+        int node;
+        float t;
+    };
+    Entry stack[BVHBuilder::MaxDepth];
+    int stackPtr = 0;
+    float tRoot;
+    if (!nodes[0].hit(orig, invDir, outT, tRoot)) return -1;
+    stack[stackPtr++] = {0, tRoot};
+
+    while (stackPtr > 0) {
+        const Entry entry = stack[--stackPtr];
+        if (entry.t >= outT) continue;
+        const BVHFlatNode &node = nodes[entry.node];
+
+        if (node.count > 0) {
+            for (int i = node.rightOrStart; i < node.rightOrStart + node.count; ++i) {
+                float t;
+                if (triIntersect(orig, dir, hot[i], t) && t < outT) {
+                    outT = t;
+                    hitIdx = i;
+                }
+            }
+            continue;
+        }
+
+        Entry left{entry.node + 1, 0.0f}, right{node.rightOrStart, 0.0f};
+        bool hitLeft = nodes[left.node].hit(orig, invDir, outT, left.t);
+        bool hitRight = nodes[right.node].hit(orig, invDir, outT, right.t);
+        if (hitLeft && hitRight) {
+            if (right.t < left.t) std::swap(left, right);
+            stack[stackPtr++] = right;
+            stack[stackPtr++] = left;
+        } else if (hitLeft) {
+            stack[stackPtr++] = left;
+        } else if (hitRight) {
+            stack[stackPtr++] = right;
+        }
+    }
+
+    return hitIdx;
+}
 
-    // Stack-based traversal
-    int stack[64];
+bool BVH::occluded(const QVector3D &orig, const QVector3D &dir, float tMax) const
+{
+    if (m_tris.isEmpty()) return false;
+    switch (m_width) {
+#ifdef BVH_X86
+    case 8: return bvh8::occluded(nodeData(m_nodes8), hotData(), orig, dir, tMax);
+#endif
+    case 4: return bvh4::anyHit(nodeData(m_nodes4), hotData(), orig, dir, tMax);
+    default: return occludedBinary(orig, dir, tMax);
+    }
+}
+
+bool BVH::occludedBinary(const QVector3D &orig, const QVector3D &dir, float tMax) const
+{
+    QVector3D invDir(1.0f / dir.x(), 1.0f / dir.y(), 1.0f / dir.z());
+    const BVHFlatNode *nodes = nodeData(m_nodes);
+    const BVHTriangle *hot = hotData();
+
+    int stack[BVHBuilder::MaxDepth];
     int stackPtr = 0;
     stack[stackPtr++] = 0;
 
     while (stackPtr > 0) {
         int ni = stack[--stackPtr];
-        const BVHNode &node = m_nodes[ni];
+        const BVHFlatNode &node = nodes[ni];
 
-        if (!node.box.hit(orig, invDir, outT))
+        if (!node.hit(orig, invDir, tMax))
             continue;
 
-        if (node.isLeaf()) {
-            for (int i = node.triStart; i < node.triStart + node.triCount; ++i) {
+        if (node.count > 0) {
+            for (int i = node.rightOrStart; i < node.rightOrStart + node.count; ++i) {
                 float t;
-                if (triIntersect(orig, dir, m_tris[i], t) && t < outT) {
-                    outT = t;
-                    hitIdx = i;
-                }
+                if (triIntersect(orig, dir, hot[i], t) && t < tMax)
+                    return true;
             }
         } else {
-            if (node.left >= 0) stack[stackPtr++] = node.left;
-            if (node.right >= 0) stack[stackPtr++] = node.right;
+            stack[stackPtr++] = ni + 1;
+            stack[stackPtr++] = node.rightOrStart;
         }
     }
 
-    return hitIdx;
-}
\ No newline at end of file
+    return false;
+}
@@ -1,7 +1,9 @@
 #pragma once
 
+#include <QByteArray>
 #include <QVector3D>
 #include <QVector>
+#include <memory>
 #include <vector>
 #include <algorithm>
 #include <cmath>
@@ -12,6 +14,7 @@ struct RenderTriangle {
     QVector3D normal;
     QVector3D color;
     bool emissive = false;
+    int lightIndex = -1; // scene light this quad half belongs to, -1 otherwise
 };
 
 struct AABB {
@@ -34,6 +37,12 @@ struct AABB {
 
     QVector3D center() const { return (mn + mx) * 0.5f; }
 
+    float surfaceArea() const {
+        QVector3D d = mx - mn;
+        if (d.x() < 0.0f) return 0.0f;
+        return 2.0f * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+    }
+
     int longestAxis() const {
         QVector3D d = mx - mn;
         if (d.x() > d.y() && d.x() > d.z()) return 0;
@@ -76,21 +85,259 @@ struct BVHNode {
     bool isLeaf() const { return triCount > 0; }
 };
 
+// Binary traversal node, 32 bytes in depth-first order: an inner node's left
+// child is the next node, so only the right child is stored
+struct alignas(32) BVHFlatNode {
+    float bmin[3];
+    int rightOrStart; // right child, or first triangle of a leaf
+    float bmax[3];
+    int count;        // leaf triangle count, 0 for inner nodes
+
+    bool hit(const QVector3D &orig, const QVector3D &invDir, float tMax) const {
+        float tNear;
+        return hit(orig, invDir, tMax, tNear);
+    }
+
+    // Also returns the entry distance, for near-to-far traversal
+    bool hit(const QVector3D &orig, const QVector3D &invDir, float tMax, float &tNear) const {
+        float tmin = 0.0f, tmax = tMax;
+        for (int a = 0; a < 3; ++a) {
+            float t1 = (bmin[a] - orig[a]) * invDir[a];
+            float t2 = (bmax[a] - orig[a]) * invDir[a];
+            if (t1 > t2) std::swap(t1, t2);
+            tmin = std::max(tmin, t1);
+            tmax = std::min(tmax, t2);
+            if (tmin > tmax) return false;
+        }
+        tNear = tmin;
+        return true;
+    }
+};
+
+// Intersection data of a triangle: a vertex and the two edges from it. The
+// shading data stays in RenderTriangle and is only read for the closest hit.
+struct BVHTriangle {
+    QVector3D v0;
+    QVector3D e1;
+    QVector3D e2;
+};
+
+// Node of the wide BVH traversed on the CPU, collapsed from the binary tree. The
+// bounds of all N children are stored SoA so one SIMD pass tests them all.
+template <int N>
+struct alignas(64) BVHWideNode {
+    float bounds[6][N]; // min x, y, z, max x, y, z; inverted for empty slots
+    int child[N];       // inner node index, or first triangle of a leaf
+    int count[N];       // leaf triangle count, 0 for inner nodes and empty slots
+};
+
+class QFile;
+class QString;
+class ThreadPool;
+
+// Ordered from fastest build to best tree
+enum class BVHSplitMethod {
+    Median,    // sort on the longest axis and split at the middle primitive
+    Morton,    // LBVH: radix sort by Morton code, split at the highest differing bit
+    BinnedSAH, // surface area heuristic evaluated at bin boundaries
+    SpatialSAH // SBVH: binned SAH that may also split space, cutting triangles in two
+};
+
+const char *bvhSplitMethodName(BVHSplitMethod method);
+
+struct BVHBuildSettings {
+    BVHSplitMethod method = BVHSplitMethod::BinnedSAH;
+    int bins = 16;
+    int maxLeafSize = 8;          // larger ranges are always split
+    float traversalCost = 1.0f;   // SAH cost of visiting a node ...
+    float intersectionCost = 1.0f; // ... relative to one primitive test
+
+    // CPU traversal: 2 = binary, 4 = BVH4 (SSE), 8 = BVH8 (AVX2), 0 = the widest
+    // this CPU supports
+    int width = 0;
+
+    // A refitted tree is kept until its SAH cost exceeds this multiple of the
+    // cost right after the build; then it is rebuilt
+    float refitRebuildRatio = 1.5f;
+
+    // SpatialSAH: extra triangle references the spatial splits may add, as a
+    // fraction of the triangle count
+    float spatialSplitBudget = 0.3f;
+};
+
+// Builds a binary BVH over primitive bounds. Used by the CPU BVH and by the GPU
+// upload in PathTracer, which only differ in how they store the result. With a
+// pool, the top levels bin in parallel and the subtrees below are built as
+// independent tasks; the tree matches a serial build, only the node order differs.
+class BVHBuilder {
+public:
+    // Levels of any built tree. Ranges that could not otherwise reach a leaf in
+    // time are split at the median, so traversal stacks of MaxDepth entries per
+    // level cannot overflow, whatever the split method and input.
+    static constexpr int MaxDepth = 64;
+
+    struct Result {
+        std::vector<BVHNode> nodes; // root first; leaves index into primOrder
+        std::vector<int> primOrder; // primitive index for every leaf slot
+    };
+
+    // SpatialSAH splits triangles and needs their vertices, three per primitive;
+    // without them it builds as BinnedSAH. A spatial split puts a triangle in
+    // both children, so primOrder can list a primitive more than once.
+    static Result build(const std::vector<AABB> &primBounds,
+                        const BVHBuildSettings &settings = BVHBuildSettings(),
+                        ThreadPool *pool = nullptr,
+                        const std::vector<QVector3D> *triangleVertices = nullptr);
+
+    // Expected cost of a random ray hitting the root, in the units of the
+    // settings' traversal and intersection costs
+    static float sahCost(const std::vector<BVHNode> &nodes,
+                         const BVHBuildSettings &settings = BVHBuildSettings());
+
+    // Depth-first binary layout of a built tree
+    static std::vector<BVHFlatNode> flatten(const std::vector<BVHNode> &nodes);
+
+    // Recomputes the bounds of a built tree for moved primitives, bottom-up in
+    // O(n); the topology and primOrder are kept
+    static void refit(std::vector<BVHNode> &nodes, const std::vector<int> &primOrder,
+                      const std::vector<AABB> &primBounds);
+
+    // The same for a flat layout; leafBounds(start, count) returns the bounds of
+    // the primitives of a leaf
+    template <class LeafBounds>
+    static void refitFlat(std::vector<BVHFlatNode> &nodes, LeafBounds leafBounds);
+
+    // sahCost() of a flat layout
+    static float flatCost(const std::vector<BVHFlatNode> &nodes,
+                          const BVHBuildSettings &settings = BVHBuildSettings());
+};
+
+template <class LeafBounds>
+void BVHBuilder::refitFlat(std::vector<BVHFlatNode> &nodes, LeafBounds leafBounds)
+{
+    // Children follow their parent, so a reverse sweep sees them first
+    for (int i = (int)nodes.size() - 1; i >= 0; --i) {
+        BVHFlatNode &node = nodes[i];
+        AABB box;
+        if (node.count > 0) {
+            box = leafBounds(node.rightOrStart, node.count);
+        } else {
+            const BVHFlatNode &l = nodes[i + 1], &r = nodes[node.rightOrStart];
+            for (int a = 0; a < 3; ++a) {
+                box.mn[a] = std::min(l.bmin[a], r.bmin[a]);
+                box.mx[a] = std::max(l.bmax[a], r.bmax[a]);
+            }
+        }
+        for (int a = 0; a < 3; ++a) {
+            node.bmin[a] = box.mn[a];
+            node.bmax[a] = box.mx[a];
+        }
+    }
+}
+
 class BVH {
 public:
-    void build(QVector<RenderTriangle> &tris);
+    // Takes the triangles by value; pass an rvalue to avoid keeping two copies
+    void build(QVector<RenderTriangle> tris, const BVHBuildSettings &settings = BVHBuildSettings(),
+               ThreadPool *pool = nullptr);
 
-    // Returns index of hit triangle, -1 if miss
-    int intersect(const QVector3D &orig, const QVector3D &dir, float &outT) const;
+    // Returns index of hit triangle in triangles(), -1 if nothing is hit
+    // closer than tMax
+    int intersect(const QVector3D &orig, const QVector3D &dir, float &outT,
+                  float tMax = FLT_MAX) const;
 
+    // Whether any triangle is hit closer than tMax. Returns on the first hit
+    // found, for shadow rays.
+    bool occluded(const QVector3D &orig, const QVector3D &dir, float tMax) const;
+
+    // Moves the triangles of the last build, passed in the same order as to
+    // build(), and refits the node bounds bottom-up in O(n) without re-sorting.
+    // Rebuilds instead, and returns false, when the count changed or the refit
+    // tree's SAH cost passed settings.refitRebuildRatio times its built cost.
+    bool refit(QVector<RenderTriangle> tris, ThreadPool *pool = nullptr);
+
+    // Shading data in BVH leaf order. An SBVH lists split triangles once per leaf.
     const QVector<RenderTriangle> &triangles() const { return m_tris; }
+    const AABB &bounds() const { return m_bounds; }
+    float sahCost() const { return m_sahCost; }
+    int width() const { return m_width; }
+
+    // Moller-Trumbore, two-sided; inline so the wide traversal kernels inline it
+    static inline bool triIntersect(const QVector3D &orig, const QVector3D &dir,
+                                    const BVHTriangle &tri, float &t);
+
+    // Widest traversal this CPU runs: 8 with AVX2 and FMA, 4 on other x86, else 2
+    static int supportedWidth();
+    // Width build() uses for a requested settings.width on this CPU
+    static int traversalWidth(int requested);
+
+    // Cache file of the built tree. key names the input triangles and the
+    // settings (see BLASCache); load() rejects a file with another key or struct
+    // layout, and traverses the nodes and intersection triangles in place from
+    // a read-only mapping of the file.
+    bool save(const QString &path, const QByteArray &key) const;
+    bool load(const QString &path, const QByteArray &key, const BVHBuildSettings &settings);
 
 private:
-    int buildRecursive(int start, int count);
+    int intersectBinary(const QVector3D &orig, const QVector3D &dir, float &outT, float tMax) const;
+    bool occludedBinary(const QVector3D &orig, const QVector3D &dir, float tMax) const;
 
-    static bool triIntersect(const QVector3D &orig, const QVector3D &dir,
-                             const RenderTriangle &tri, float &t);
+    // Traversal arrays: the vectors below, or the mapped cache file
+    const BVHTriangle *hotData() const { return m_file ? m_mappedHot : m_hot.data(); }
+    template <class Node>
+    const Node *nodeData(const std::vector<Node> &nodes) const {
+        return m_file ? static_cast<const Node *>(m_mappedNodes) : nodes.data();
+    }
+    // Copies the mapped arrays into the vectors, which refit() modifies
+    void detach();
 
+    // SAH cost of the stored node layout, comparable before and after a refit
+    float layoutCost() const;
+    // Node bounds and m_bounds from the whole triangles of each leaf
+    void refitBounds();
+    // layoutCost() once refitBounds() has grown an SBVH's clipped leaves to the
+    // whole triangles, which is what refit() compares against
+    float wholeTriangleCost() const;
+
+    // Only the node array of the traversal width is kept
     QVector<RenderTriangle> m_tris;
-    std::vector<BVHNode> m_nodes;
-};
\ No newline at end of file
+    std::vector<BVHTriangle> m_hot;
+    std::vector<BVHFlatNode> m_nodes;
+    std::vector<BVHWideNode<4>> m_nodes4;
+    std::vector<BVHWideNode<8>> m_nodes8;
+    int m_width = 2;
+    int m_nodeCount = 0;
+    int m_inputCount = 0; // triangles passed to build(), before any spatial splits
+    AABB m_bounds;
+    float m_sahCost = 0.0f;
+
+    // Refit state: input index of every leaf slot, and the build's settings and cost
+    std::vector<int> m_primOrder;
+    BVHBuildSettings m_settings;
+    float m_builtCost = 0.0f;
+
+    // Mapping made by load(); copies of the BVH share it
+    std::shared_ptr<QFile> m_file;
+    const BVHTriangle *m_mappedHot = nullptr;
+    const void *m_mappedNodes = nullptr;
+};
+
+inline bool BVH::triIntersect(const QVector3D &orig, const QVector3D &dir,
+                              const BVHTriangle &tri, float &t)
+{
+    const float EPSILON = 1e-6f;
+    const QVector3D &e1 = tri.e1;
+    const QVector3D &e2 = tri.e2;
+    QVector3D h = QVector3D::crossProduct(dir, e2);
+    float a = QVector3D::dotProduct(e1, h);
+    if (std::abs(a) < EPSILON) return false;
+    float f = 1.0f / a;
+    QVector3D s = orig - tri.v0;
+    float u = f * QVector3D::dotProduct(s, h);
+    if (u < 0.0f || u > 1.0f) return false;
+    QVector3D q = QVector3D::crossProduct(s, e1);
+    float v = f * QVector3D::dotProduct(dir, q);
+    if (v < 0.0f || u + v > 1.0f) return false;
+    t = f * QVector3D::dotProduct(e2, q);
+    return t > EPSILON;
+}
\ No newline at end of file
@@ -0,0 +1,162 @@
+// Wide BVH traversal kernels. Not a regular header: BVH.cpp includes it once
+// per instruction set, each time inside its own namespace and with
+// BVH_TRAVERSAL_WIDTH set to 4 (SSE) or 8 (AVX2 + FMA, under a target pragma).
+// The includer provides the intrinsics headers.
+
+constexpr int Width = BVH_TRAVERSAL_WIDTH;
+using Node = BVHWideNode<Width>;
+
+// Entries per traversal stack: a node pushes at most Width - 1 more than it
+// pops, and the collapsed tree is no deeper than the binary one
+constexpr int StackSize = (Width - 1) * BVHBuilder::MaxDepth + 1;
+
+struct RayData {
+    float org[3];
+    float inv[3];
+    float orgInv[3]; // org * inv, for the fused multiply-subtract slab test
+    int nearPlane[3]; // bounds row hit first along each axis: min for positive directions
+    int farPlane[3];
+
+    RayData(const QVector3D &o, const QVector3D &d) {
+        for (int a = 0; a < 3; ++a) {
+            org[a] = o[a];
+            inv[a] = 1.0f / d[a];
+            orgInv[a] = org[a] * inv[a];
+            nearPlane[a] = inv[a] >= 0.0f ? a : a + 3;
+            farPlane[a] = inv[a] >= 0.0f ? a + 3 : a;
+        }
+    }
+};
+
+// Slab test of the ray against every child; returns the hit mask and writes the
+// entry distances. Empty slots have inverted bounds and never hit. The running
+// near/far values are the second max/min operand so a NaN slab is ignored.
+inline int hitChildren(const Node &node, const RayData &ray, float tMax, float *tNear)
+{
+#if BVH_TRAVERSAL_WIDTH == 8
+    __m256 tn = _mm256_setzero_ps();
+    __m256 tf = _mm256_set1_ps(tMax);
+    for (int a = 0; a < 3; ++a) {
+        __m256 inv = _mm256_set1_ps(ray.inv[a]);
+        __m256 orgInv = _mm256_set1_ps(ray.orgInv[a]);
+        tn = _mm256_max_ps(_mm256_fmsub_ps(_mm256_load_ps(node.bounds[ray.nearPlane[a]]), inv, orgInv), tn);
+        tf = _mm256_min_ps(_mm256_fmsub_ps(_mm256_load_ps(node.bounds[ray.farPlane[a]]), inv, orgInv), tf);
+    }
+    _mm256_store_ps(tNear, tn);
+    return _mm256_movemask_ps(_mm256_cmp_ps(tn, tf, _CMP_LE_OQ));
+#elif defined(BVH_X86)
+    __m128 tn = _mm_setzero_ps();
+    __m128 tf = _mm_set1_ps(tMax);
+    for (int a = 0; a < 3; ++a) {
+        __m128 org = _mm_set1_ps(ray.org[a]);
+        __m128 inv = _mm_set1_ps(ray.inv[a]);
+        tn = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[ray.nearPlane[a]]), org), inv), tn);
+        tf = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[ray.farPlane[a]]), org), inv), tf);
+    }
+    _mm_store_ps(tNear, tn);
+    return _mm_movemask_ps(_mm_cmple_ps(tn, tf));
+#else
+    int mask = 0;
+    for (int i = 0; i < Width; ++i) {
+        float tn = 0.0f, tf = tMax;
+        for (int a = 0; a < 3; ++a) {
+            float n = (node.bounds[ray.nearPlane[a]][i] - ray.org[a]) * ray.inv[a];
+            float f = (node.bounds[ray.farPlane[a]][i] - ray.org[a]) * ray.inv[a];
+            tn = n > tn ? n : tn;
+            tf = f < tf ? f : tf;
+        }
+        tNear[i] = tn;
+        if (tn <= tf) mask |= 1 << i;
+    }
+    return mask;
+#endif
+}
+
+struct StackEntry {
+    int child;
+    int count; // > 0: leaf with this many triangles
+    float t;   // entry distance of the child's box
+};
+
+inline int closestHit(const Node *nodes, const BVHTriangle *tris,
+                      const QVector3D &orig, const QVector3D &dir, float &outT, float tMax)
+{
+    const RayData ray(orig, dir);
+    outT = tMax;
+    int hitIdx = -1;
+
+    StackEntry stack[StackSize];
+    int stackPtr = 0;
+    stack[stackPtr++] = {0, 0, 0.0f};
+
+    while (stackPtr > 0) {
+        const StackEntry entry = stack[--stackPtr];
+        if (entry.t >= outT) continue;
+
+        if (entry.count > 0) {
+            for (int i = entry.child; i < entry.child + entry.count; ++i) {
+                float t;
+                if (BVH::triIntersect(orig, dir, tris[i], t) && t < outT) {
+                    outT = t;
+                    hitIdx = i;
+                }
+            }
+            continue;
+        }
+
+        const Node &node = nodes[entry.child];
+        alignas(32) float tNear[Width];
+        int mask = hitChildren(node, ray, outT, tNear);
+
+        // Sort the hit children far to near so the nearest is popped first
+        StackEntry hits[Width];
+        int hitCount = 0;
+        for (int i = 0; i < Width; ++i) {
+            if (!(mask & (1 << i))) continue;
+            StackEntry h{node.child[i], node.count[i], tNear[i]};
+            int j = hitCount++;
+            for (; j > 0 && hits[j - 1].t < h.t; --j)
+                hits[j] = hits[j - 1];
+            hits[j] = h;
+        }
+        for (int i = 0; i < hitCount; ++i)
+            stack[stackPtr++] = hits[i];
+    }
+
+    return hitIdx;
+}
+
+// Any hit closer than tMax: stops at the first triangle found, so the children
+// are pushed unsorted and no hit distance is kept
+inline bool anyHit(const Node *nodes, const BVHTriangle *tris,
+                   const QVector3D &orig, const QVector3D &dir, float tMax)
+{
+    const RayData ray(orig, dir);
+
+    StackEntry stack[StackSize];
+    int stackPtr = 0;
+    stack[stackPtr++] = {0, 0, 0.0f};
+
+    while (stackPtr > 0) {
+        const StackEntry entry = stack[--stackPtr];
+
+        if (entry.count > 0) {
+            for (int i = entry.child; i < entry.child + entry.count; ++i) {
+                float t;
+                if (BVH::triIntersect(orig, dir, tris[i], t) && t < tMax)
+                    return true;
+            }
+            continue;
+        }
+
+        const Node &node = nodes[entry.child];
+        alignas(32) float tNear[Width];
+        int mask = hitChildren(node, ray, tMax, tNear);
+        for (int i = 0; i < Width; ++i) {
+            if (mask & (1 << i))
+                stack[stackPtr++] = {node.child[i], node.count[i], 0.0f};
+        }
+    }
+
+    return false;
+}
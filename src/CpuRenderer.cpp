@@ -0,0 +1,833 @@
+#include "CpuRenderer.h"
+#include "ThreadPool.h"
+#include "Denoiser.h"
+#include <QElapsedTimer>
+#include <QDebug>
+#include <QCryptographicHash>
+#include <QFile>
+#include <QSaveFile>
+#include <QDataStream>
+#include <algorithm>
+#include <array>
+#include <climits>
+#include <cmath>
+#include <map>
+#include <tuple>
+
+Film::Film(int width, int height, const std::vector<RenderTile> &tiles)
+    : width(width), height(height),
+      accum(size_t(width) * height * 3, 0.0f),
+      lumSq(size_t(width) * height, 0.0f),
+      albedo(size_t(width) * height * 3, 0.0f),
+      normal(size_t(width) * height * 3, 0.0f),
+      depth(size_t(width) * height, 0.0f),
+      tileSamples(tiles.size(), 0),
+      tileDone(tiles.size(), 0),
+      tileRays(tiles.size(), 0)
+{
+    for (const auto &t : tiles)
+        tilePixels.push_back((t.x1 - t.x0) * (t.y1 - t.y0));
+}
+
+long long Film::totalSamples() const
+{
+    long long total = 0;
+    for (size_t t = 0; t < tileSamples.size(); ++t)
+        total += (long long)tilePixels[t] * tileSamples[t];
+    return total;
+}
+
+long long Film::totalRays() const
+{
+    long long total = 0;
+    for (long long r : tileRays) total += r;
+    return total;
+}
+
+int Film::maxTileSamples() const
+{
+    return tileSamples.empty() ? 0 : *std::max_element(tileSamples.begin(), tileSamples.end());
+}
+
+void Film::resetDone(int spp)
+{
+    for (size_t t = 0; t < tileSamples.size(); ++t)
+        tileDone[t] = tileSamples[t] >= spp;
+}
+
+static constexpr quint32 CheckpointMagic = 0x4b435452; // "RTCK"
+static constexpr quint32 CheckpointVersion = 3; // 2: scene hash, 3: denoiser feature sums
+
+static_assert(Q_BYTE_ORDER == Q_LITTLE_ENDIAN, "checkpoint float arrays are written raw");
+
+static bool readCheckpointHeader(QDataStream &in, CheckpointInfo &info, int &tileCount)
+{
+    quint32 magic = 0, version = 0;
+    qint32 w = 0, h = 0, tiles = 0, sampler = 0;
+    QByteArray sceneHash;
+    in >> magic >> version >> w >> h >> tiles >> sampler >> sceneHash;
+    if (in.status() != QDataStream::Ok || magic != CheckpointMagic ||
+        version != CheckpointVersion || w <= 0 || h <= 0 || tiles <= 0 ||
+        sampler < int(SamplerType::Random) || sampler > int(SamplerType::BlueNoise))
+        return false;
+
+    info.width = w;
+    info.height = h;
+    info.sampler = SamplerType(sampler);
+    info.sceneHash = sceneHash;
+    tileCount = tiles;
+    return true;
+}
+
+bool Film::saveCheckpoint(const QString &path, SamplerType sampler, const QByteArray &sceneHash) const
+{
+    QSaveFile f(path);
+    if (!f.open(QIODevice::WriteOnly)) {
+        qWarning() << "Cannot write checkpoint:" << path;
+        return false;
+    }
+
+    QDataStream out(&f);
+    out.setByteOrder(QDataStream::LittleEndian);
+    out << CheckpointMagic << CheckpointVersion
+        << qint32(width) << qint32(height) << qint32(tileSamples.size()) << qint32(sampler)
+        << sceneHash;
+    for (int n : tileSamples)
+        out << qint32(n);
+    for (const std::vector<float> *buffer : {&accum, &lumSq, &albedo, &normal, &depth})
+        out.writeRawData(reinterpret_cast<const char *>(buffer->data()),
+                         int(buffer->size() * sizeof(float)));
+
+    return out.status() == QDataStream::Ok && f.commit();
+}
+
+bool Film::loadCheckpoint(const QString &path, SamplerType sampler, const QByteArray &sceneHash)
+{
+    QFile f(path);
+    if (!f.open(QIODevice::ReadOnly)) {
+        qWarning() << "Cannot open checkpoint:" << path;
+        return false;
+    }
+
+    QDataStream in(&f);
+    in.setByteOrder(QDataStream::LittleEndian);
+    CheckpointInfo info;
+    int tileCount = 0;
+    if (!readCheckpointHeader(in, info, tileCount)) {
+        qWarning() << "Not a render checkpoint:" << path;
+        return false;
+    }
+    if (info.width != width || info.height != height || tileCount != (int)tileSamples.size()) {
+        qWarning() << "Checkpoint is" << info.width << "x" << info.height
+                   << "but the render is" << width << "x" << height;
+        return false;
+    }
+    if (info.sampler != sampler) {
+        // Continuing with another sampler would reuse sample indices of a different sequence
+        qWarning() << "Checkpoint was rendered with" << samplerTypeName(info.sampler);
+        return false;
+    }
+    if (info.sceneHash != sceneHash) {
+        qWarning() << "Checkpoint belongs to another scene, or the scene was edited since:" << path;
+        return false;
+    }
+
+    std::vector<int> samples(tileCount);
+    for (int &n : samples) {
+        qint32 v = 0;
+        in >> v;
+        n = v;
+    }
+    std::vector<float> buffers[5];
+    std::vector<float> *targets[5] = {&accum, &lumSq, &albedo, &normal, &depth};
+    for (int i = 0; i < 5; ++i) {
+        buffers[i].resize(targets[i]->size());
+        int bytes = int(buffers[i].size() * sizeof(float));
+        if (in.readRawData(reinterpret_cast<char *>(buffers[i].data()), bytes) != bytes) {
+            qWarning() << "Truncated checkpoint:" << path;
+            return false;
+        }
+    }
+
+    tileSamples = std::move(samples);
+    for (int i = 0; i < 5; ++i)
+        *targets[i] = std::move(buffers[i]);
+    return true;
+}
+
+bool Film::readCheckpointInfo(const QString &path, CheckpointInfo &info)
+{
+    QFile f(path);
+    if (!f.open(QIODevice::ReadOnly)) return false;
+
+    QDataStream in(&f);
+    in.setByteOrder(QDataStream::LittleEndian);
+    int tileCount = 0;
+    if (!readCheckpointHeader(in, info, tileCount)) return false;
+
+    info.minTileSamples = INT_MAX;
+    info.maxTileSamples = 0;
+    for (int t = 0; t < tileCount; ++t) {
+        qint32 v = 0;
+        in >> v;
+        info.minTileSamples = std::min(info.minTileSamples, int(v));
+        info.maxTileSamples = std::max(info.maxTileSamples, int(v));
+    }
+    return in.status() == QDataStream::Ok;
+}
+
+static float luminance(const QVector3D &c)
+{
+    return 0.2126f * c.x() + 0.7152f * c.y() + 0.0722f * c.z();
+}
+
+// Gamma 2.2 display LUT indexed by sqrt(linear), which keeps precision in the
+// steep dark end without a pow() per channel
+static constexpr int DisplayLutSize = 4096;
+
+static const uchar *displayLut()
+{
+    static const std::array<uchar, DisplayLutSize> lut = []() {
+        std::array<uchar, DisplayLutSize> l{};
+        for (int i = 0; i < DisplayLutSize; ++i) {
+            float s = float(i) / (DisplayLutSize - 1);
+            l[i] = (uchar)std::min(255, (int)(std::pow(s * s, 1.0f / 2.2f) * 255.0f + 0.5f));
+        }
+        return l;
+    }();
+    return lut.data();
+}
+
+static inline uchar toDisplay(const uchar *lut, float v)
+{
+    v = std::clamp(v, 0.0f, 1.0f);
+    return lut[(int)(std::sqrt(v) * (DisplayLutSize - 1) + 0.5f)];
+}
+
+CpuRenderer::CpuRenderer(const Scene &scene, const RenderSettings &settings)
+    : m_scene(scene), m_settings(settings),
+      m_tiles(makeTiles(settings.width, settings.height))
+{
+}
+
+void CpuRenderer::setSettings(const RenderSettings &settings)
+{
+    auto buildKey = [](const BVHBuildSettings &b) {
+        return std::make_tuple(int(b.method), b.bins, b.maxLeafSize, b.traversalCost,
+                               b.intersectionCost, b.width, b.spatialSplitBudget);
+    };
+    if (buildKey(settings.bvh) != buildKey(m_settings.bvh)) {
+        m_bvh = SceneBVH();
+        m_lightBVH.reset();
+    }
+    if (settings.width != m_settings.width || settings.height != m_settings.height)
+        m_tiles = makeTiles(settings.width, settings.height);
+    m_settings = settings;
+}
+
+// SHA-1 of the arrays a render reads; an edited OBJ under the same path changes it
+static QByteArray meshContentHash(const Mesh &mesh)
+{
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    const qint32 sizes[] = {qint32(mesh.vertices.size()), qint32(mesh.normals.size()),
+                            qint32(mesh.indices.size())};
+    hash.addData(QByteArrayView(reinterpret_cast<const char *>(sizes), sizeof(sizes)));
+    hash.addData(QByteArrayView(reinterpret_cast<const char *>(mesh.vertices.constData()),
+                                mesh.vertices.size() * sizeof(QVector3D)));
+    hash.addData(QByteArrayView(reinterpret_cast<const char *>(mesh.normals.constData()),
+                                mesh.normals.size() * sizeof(QVector3D)));
+    hash.addData(QByteArrayView(reinterpret_cast<const char *>(mesh.indices.constData()),
+                                mesh.indices.size() * sizeof(unsigned int)));
+    return hash.result();
+}
+
+QByteArray CpuRenderer::sceneHash(const Scene &scene)
+{
+    QByteArray data;
+    QDataStream out(&data, QIODevice::WriteOnly);
+    out.setFloatingPointPrecision(QDataStream::SinglePrecision);
+
+    const Camera &cam = scene.camera();
+    out << cam.position() << cam.target() << cam.fov();
+    // Instances of one mesh hash it once
+    std::map<const Mesh *, QByteArray> meshHashes;
+    for (const auto &obj : scene.objects()) {
+        QByteArray &meshHash = meshHashes[&obj->mesh()];
+        if (meshHash.isEmpty()) meshHash = meshContentHash(obj->mesh());
+        out << obj->name() << obj->objPath() << obj->transform() << obj->material().color
+            << meshHash;
+    }
+    for (const auto &light : scene.lights()) {
+        QVector3D v0, v1, v2, v3;
+        light.getCorners(v0, v1, v2, v3);
+        out << v0 << v1 << v2 << v3 << light.color << light.intensity;
+    }
+    return QCryptographicHash::hash(data, QCryptographicHash::Sha1);
+}
+
+std::vector<RenderTile> CpuRenderer::makeTiles(int width, int height)
+{
+    std::vector<RenderTile> tiles;
+    for (int y = 0; y < height; y += TileSize) {
+        for (int x = 0; x < width; x += TileSize) {
+            tiles.push_back({x, y,
+                             std::min(x + TileSize, width),
+                             std::min(y + TileSize, height)});
+        }
+    }
+    return tiles;
+}
+
+bool CpuRenderer::prepare(ThreadPool &pool)
+{
+    const Camera &cam = m_scene.camera();
+    m_eye = cam.position();
+    m_aspect = float(width()) / float(height());
+    m_tanHalf = std::tan(cam.fov() * 0.5f * 3.14159265f / 180.0f);
+
+    m_forward = (cam.target() - m_eye).normalized();
+    QVector3D worldUp(0, 1, 0);
+    m_right = QVector3D::crossProduct(m_forward, worldUp).normalized();
+    m_up = QVector3D::crossProduct(m_right, m_forward).normalized();
+
+    QElapsedTimer bvhTimer;
+    bvhTimer.start();
+
+    // One instance per object; objects sharing a mesh share its BLAS
+    std::vector<BVHInstance> instances;
+    for (const auto &obj : m_scene.objects()) {
+        if (obj->mesh().indices.isEmpty()) continue;
+        BVHInstance inst;
+        inst.blas = BLASCache::global().get(obj->sharedMesh(), m_settings.bvh, &pool);
+        inst.objectToWorld = obj->transform();
+        inst.color = obj->material().color;
+        inst.emissive = obj->name().contains("light", Qt::CaseInsensitive);
+        instances.push_back(std::move(inst));
+    }
+
+    // Light quads change with every edit, so they get a small BLAS of their own
+    QVector<RenderTriangle> lightTris;
+    m_lights.clear();
+    float totalPower = 0.0f;
+    for (const auto &light : m_scene.lights()) {
+        QVector3D v0, v1, v2, v3;
+        light.getCorners(v0, v1, v2, v3);
+
+        AreaLight al;
+        al.corner = v0;
+        al.edge1 = v1 - v0;
+        al.edge2 = v3 - v0;
+        al.normal = light.normal();
+        al.emission = light.color * light.intensity;
+        al.area = QVector3D::crossProduct(al.edge1, al.edge2).length();
+        al.selectPdf = luminance(al.emission) * al.area;
+        totalPower += al.selectPdf;
+        int lightIndex = (int)m_lights.size();
+        m_lights.push_back(al);
+
+        RenderTriangle t1;
+        t1.v0 = v0; t1.v1 = v1; t1.v2 = v2;
+        t1.normal = light.normal();
+        t1.color = al.emission;
+        t1.emissive = true;
+        t1.lightIndex = lightIndex;
+        lightTris.append(t1);
+
+        RenderTriangle t2;
+        t2.v0 = v0; t2.v1 = v2; t2.v2 = v3;
+        t2.normal = light.normal();
+        t2.color = al.emission;
+        t2.emissive = true;
+        t2.lightIndex = lightIndex;
+        lightTris.append(t2);
+    }
+
+    // Power-proportional selection CDF; fall back to uniform for black lights
+    float cdf = 0.0f;
+    for (auto &al : m_lights) {
+        al.selectPdf = totalPower > 0.0f ? al.selectPdf / totalPower : 1.0f / m_lights.size();
+        cdf += al.selectPdf;
+        al.cdf = cdf;
+    }
+    if (!m_lights.empty()) m_lights.back().cdf = 1.0f;
+
+    bool refit = true;
+    if (lightTris.isEmpty()) {
+        m_lightBVH.reset();
+    } else {
+        if (!m_lightBVH) {
+            m_lightBVH = std::make_shared<BVH>();
+            m_lightBVH->build(std::move(lightTris), m_settings.bvh, &pool);
+            refit = false;
+        } else {
+            refit = m_lightBVH->refit(std::move(lightTris), &pool) && refit;
+        }
+        BVHInstance inst;
+        inst.blas = m_lightBVH;
+        inst.emissive = true;
+        instances.push_back(std::move(inst));
+    }
+
+    refit = m_bvh.refit(std::move(instances)) && refit;
+    m_refitted = refit;
+    qDebug() << "BVH" << (refit ? "refit" : "build") << "time:" << bvhTimer.elapsed() << "ms -"
+             << bvhSplitMethodName(m_settings.bvh.method) << "on" << pool.threadCount() << "threads";
+    qDebug() << "Instances:" << m_bvh.instanceCount() << "triangles:" << m_bvh.instancedTriangles()
+             << "lights:" << m_lights.size();
+    qDebug() << "Camera pos:" << m_eye << "target:" << cam.target();
+
+    if (m_bvh.instanceCount() == 0) {
+        qWarning() << "No triangles!";
+        return false;
+    }
+    return true;
+}
+
+// Path vertices after the camera ray
+static constexpr int MaxBounces = 4;
+
+// Power heuristic with beta = 2 (Veach 1997)
+static inline float powerHeuristic(float pdfA, float pdfB)
+{
+    float a = pdfA * pdfA;
+    float b = pdfB * pdfB;
+    return a + b > 0.0f ? a / (a + b) : 0.0f;
+}
+
+static QVector3D cosineHemisphere(const QVector3D &normal, float r1, float r2)
+{
+    float r = std::sqrt(r1);
+    float phi = 2.0f * 3.14159265f * r2;
+
+    const QVector3D &w = normal;
+    QVector3D a = (std::abs(w.x()) > 0.9f) ? QVector3D(0, 1, 0) : QVector3D(1, 0, 0);
+    QVector3D u = QVector3D::crossProduct(a, w).normalized();
+    QVector3D v = QVector3D::crossProduct(w, u);
+
+    return (u * (r * std::cos(phi)) +
+            v * (r * std::sin(phi)) +
+            w * std::sqrt(std::max(0.0f, 1.0f - r1))).normalized();
+}
+
+float CpuRenderer::lightPdf(int lightIndex, const QVector3D &dir, float dist) const
+{
+    const AreaLight &light = m_lights[lightIndex];
+    float cosLight = std::abs(QVector3D::dotProduct(light.normal, dir));
+    if (cosLight < 1e-6f || light.area <= 0.0f) return 0.0f;
+    return light.selectPdf * dist * dist / (cosLight * light.area);
+}
+
+QVector3D CpuRenderer::sampleDirect(const QVector3D &point, const QVector3D &normal,
+                                    const QVector3D &albedo, Sampler &sampler, int &rays) const
+{
+    float uPick = sampler.get1D();
+    float u, v;
+    sampler.get2D(u, v);
+    if (m_lights.empty()) return QVector3D(0, 0, 0);
+
+    int li = 0;
+    while (li + 1 < (int)m_lights.size() && uPick >= m_lights[li].cdf) ++li;
+    const AreaLight &light = m_lights[li];
+
+    QVector3D target = light.corner + light.edge1 * u + light.edge2 * v;
+    QVector3D toLight = target - point;
+    float dist = toLight.length();
+    if (dist < 1e-4f) return QVector3D(0, 0, 0);
+    QVector3D L = toLight / dist;
+
+    float cosSurface = QVector3D::dotProduct(normal, L);
+    if (cosSurface <= 0.0f) return QVector3D(0, 0, 0);
+    float pdfLight = lightPdf(li, L, dist);
+    if (pdfLight <= 0.0f) return QVector3D(0, 0, 0);
+
+    // Shadow ray: anything closer than the sampled point blocks it
+    bool blocked = m_bvh.occluded(point, L, dist * (1.0f - 1e-3f));
+    ++rays;
+    if (blocked) return QVector3D(0, 0, 0);
+
+    float pdfBsdf = cosSurface / 3.14159265f;
+    float weight = powerHeuristic(pdfLight, pdfBsdf);
+    return albedo / 3.14159265f * light.emission * (cosSurface * weight / pdfLight);
+}
+
+QVector3D CpuRenderer::tracePath(QVector3D orig, QVector3D dir, Sampler &sampler, int &rays,
+                                 PathFeatures &features) const
+{
+    QVector3D throughput(1, 1, 1);
+    QVector3D radiance(0, 0, 0);
+    float bsdfPdf = 0.0f; // pdf of the last bounce direction, 0 for camera rays
+
+    for (int bounce = 0; bounce <= MaxBounces; ++bounce) {
+        sampler.setBounce(bounce + 1);
+
+        // The bounce sampled at the last vertex is traced for light quads only:
+        // their MIS weight there is split with the light sample already taken
+        const bool lastSegment = bounce == MaxBounces;
+
+        SceneHit hit;
+        bool found = m_bvh.intersect(orig, dir, hit);
+        ++rays;
+
+        if (!found) {
+            if (lastSegment) break;
+            float sky_t = 0.5f * (dir.y() + 1.0f);
+            QVector3D sky = (1.0f - sky_t) * QVector3D(0.2f, 0.2f, 0.25f) +
+                            sky_t * QVector3D(0.4f, 0.5f, 0.7f);
+            radiance += throughput * sky;
+            break;
+        }
+
+        const BVHInstance &inst = m_bvh.instance(hit.instance);
+        const RenderTriangle &tri = m_bvh.triangle(hit);
+        const float t = hit.t;
+        if (lastSegment && (!inst.emissive || tri.lightIndex < 0)) break;
+
+        QVector3D hitPoint = orig + t * dir;
+        QVector3D normal = m_bvh.normal(hit);
+
+        if (QVector3D::dotProduct(normal, dir) > 0)
+            normal = -normal;
+
+        // Emitters keep the sky's features so the denoiser leaves them out
+        if (bounce == 0 && !inst.emissive) {
+            features.albedo = inst.color;
+            features.normal = normal;
+            features.depth = t;
+        }
+
+        if (inst.emissive) {
+            // Scene lights were already sampled directly at the previous vertex.
+            // Light quads carry their own radiance, emissive meshes their color.
+            float weight = 1.0f;
+            if (tri.lightIndex >= 0 && bsdfPdf > 0.0f)
+                weight = powerHeuristic(bsdfPdf, lightPdf(tri.lightIndex, dir, t));
+            radiance += throughput * (tri.lightIndex >= 0 ? tri.color : inst.color) * weight;
+            break;
+        }
+
+        orig = hitPoint + normal * 0.001f;
+        radiance += throughput * sampleDirect(orig, normal, inst.color, sampler, rays);
+
+        throughput *= inst.color;
+
+        if (bounce > 1) {
+            float p = std::max({throughput.x(), throughput.y(), throughput.z()});
+            if (sampler.get1D() > p) break;
+            throughput /= p;
+        }
+
+        // Cosine-weighted bounce; albedo is the whole BSDF weight
+        float r1, r2;
+        sampler.get2D(r1, r2);
+        dir = cosineHemisphere(normal, r1, r2);
+        bsdfPdf = std::max(QVector3D::dotProduct(normal, dir), 0.0f) / 3.14159265f;
+    }
+
+    return radiance;
+}
+
+float CpuRenderer::tileError(int tileIndex, const Film &film) const
+{
+    const RenderTile &tile = m_tiles[tileIndex];
+    int n = film.tileSamples[tileIndex];
+    if (n < 2) return FLT_MAX;
+
+    float maxError = 0.0f;
+    for (int y = tile.y0; y < tile.y1; ++y) {
+        for (int x = tile.x0; x < tile.x1; ++x) {
+            int p = y * width() + x;
+            QVector3D sum(film.accum[p * 3 + 0], film.accum[p * 3 + 1], film.accum[p * 3 + 2]);
+            float mean = luminance(sum) / n;
+            float var = std::max(0.0f, film.lumSq[p] / n - mean * mean) * n / (n - 1);
+            float stdErr = std::sqrt(var / n);
+
+            // Propagate through the 1/2.2 display gamma: d(m^g)/dm = g * m^(g - 1)
+            float m = std::clamp(mean, 1e-3f, 1.0f);
+            float displayError = stdErr * (1.0f / 2.2f) * std::pow(m, 1.0f / 2.2f - 1.0f);
+            maxError = std::max(maxError, displayError);
+        }
+    }
+    return maxError;
+}
+
+int CpuRenderer::reopenNoisiestTiles(Film &film, ThreadPool &pool) const
+{
+    long long spare = (long long)m_settings.spp * width() * height() - film.totalSamples();
+    if (spare <= 0) return 0;
+
+    std::vector<float> errors(m_tiles.size());
+    pool.parallelFor((int)m_tiles.size(), [&](int t, int) {
+        errors[t] = tileError(t, film);
+    });
+    std::vector<int> order;
+    for (int t = 0; t < (int)m_tiles.size(); ++t) {
+        if (errors[t] > m_settings.noiseThreshold) order.push_back(t);
+    }
+    if (order.empty()) return 0;
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+        return errors[a] > errors[b];
+    });
+
+    // A quarter of the tiles per pass, so the samples follow the error as it drops
+    std::fill(film.tileDone.begin(), film.tileDone.end(), 1);
+    int reopened = 0;
+    int maxTiles = std::max(1, (int)m_tiles.size() / 4);
+    for (int t : order) {
+        if (reopened == maxTiles) break;
+        if (film.tilePixels[t] > spare) continue;
+        spare -= film.tilePixels[t];
+        film.tileDone[t] = 0;
+        ++reopened;
+    }
+    return reopened;
+}
+
+void CpuRenderer::renderTile(int tileIndex, Film &film) const
+{
+    const RenderTile &tile = m_tiles[tileIndex];
+    int sampleIndex = film.tileSamples[tileIndex];
+    int rays = 0;
+
+    for (int y = tile.y0; y < tile.y1; ++y) {
+        for (int x = tile.x0; x < tile.x1; ++x) {
+            // Bounce 0 of the sampler is the camera ray
+            Sampler sampler(m_settings.sampler, x, y, uint32_t(sampleIndex));
+            float jx, jy;
+            sampler.get2D(jx, jy);
+            float u = (2.0f * (x + jx) / width() - 1.0f) * m_aspect * m_tanHalf;
+            float v = (1.0f - 2.0f * (y + jy) / height()) * m_tanHalf;
+
+            QVector3D dir = (m_forward + m_right * u + m_up * v).normalized();
+            PathFeatures features;
+            QVector3D color = tracePath(m_eye, dir, sampler, rays, features);
+
+            int p = y * width() + x;
+            float *accum = &film.accum[p * 3];
+            accum[0] += color.x();
+            accum[1] += color.y();
+            accum[2] += color.z();
+
+            float *albedo = &film.albedo[p * 3];
+            float *normal = &film.normal[p * 3];
+            for (int c = 0; c < 3; ++c) {
+                albedo[c] += features.albedo[c];
+                normal[c] += features.normal[c];
+            }
+            film.depth[p] += features.depth;
+
+            float lum = luminance(color);
+            film.lumSq[p] += lum * lum;
+        }
+    }
+
+    film.tileRays[tileIndex] += rays;
+    int samples = ++film.tileSamples[tileIndex];
+    if (samples >= m_settings.spp) {
+        film.tileDone[tileIndex] = 1;
+    } else if (m_settings.adaptive && samples >= m_settings.minAdaptiveSpp &&
+               tileError(tileIndex, film) < m_settings.noiseThreshold) {
+        film.tileDone[tileIndex] = 1;
+    }
+}
+
+void CpuRenderer::tonemapTile(int tileIndex, const Film &film, uchar *rgb, int bytesPerLine) const
+{
+    const RenderTile &tile = m_tiles[tileIndex];
+    int n = film.tileSamples[tileIndex];
+    if (n == 0) return;
+
+    const uchar *lut = displayLut();
+    float invS = 1.0f / n;
+
+    for (int y = tile.y0; y < tile.y1; ++y) {
+        const float *src = &film.accum[(size_t(y) * width() + tile.x0) * 3];
+        uchar *dst = rgb + (size_t)y * bytesPerLine + tile.x0 * 3;
+        int count = (tile.x1 - tile.x0) * 3;
+        for (int i = 0; i < count; ++i)
+            dst[i] = toDisplay(lut, src[i] * invS);
+    }
+}
+
+QImage CpuRenderer::toImage(const Film &film, ThreadPool &pool) const
+{
+    QImage image(width(), height(), QImage::Format_RGB888);
+    image.fill(Qt::black);
+    uchar *bits = image.bits();
+    int bytesPerLine = image.bytesPerLine();
+    pool.parallelFor((int)m_tiles.size(), [&](int t, int) {
+        tonemapTile(t, film, bits, bytesPerLine);
+    });
+    return image;
+}
+
+QImage CpuRenderer::finalImage(const Film &film, ThreadPool &pool) const
+{
+    if (!m_settings.denoise) return toImage(film, pool);
+
+    QElapsedTimer timer;
+    timer.start();
+
+    // Per-pixel averages; tiles differ in sample count under adaptive sampling
+    const size_t pixels = size_t(width()) * height();
+    DenoiseBuffers buffers;
+    buffers.width = width();
+    buffers.height = height();
+    buffers.color.resize(pixels * 3);
+    buffers.albedo.resize(pixels * 3);
+    buffers.normal.resize(pixels * 3);
+    buffers.depth.resize(pixels);
+    pool.parallelFor((int)m_tiles.size(), [&](int t, int) {
+        const RenderTile &tile = m_tiles[t];
+        float inv = film.tileSamples[t] > 0 ? 1.0f / film.tileSamples[t] : 0.0f;
+        for (int y = tile.y0; y < tile.y1; ++y) {
+            for (int x = tile.x0; x < tile.x1; ++x) {
+                size_t p = size_t(y) * width() + x;
+                for (int c = 0; c < 3; ++c) {
+                    buffers.color[p * 3 + c] = film.accum[p * 3 + c] * inv;
+                    buffers.albedo[p * 3 + c] = film.albedo[p * 3 + c] * inv;
+                    buffers.normal[p * 3 + c] = film.normal[p * 3 + c] * inv;
+                }
+                buffers.depth[p] = film.depth[p] * inv;
+            }
+        }
+    });
+
+    std::vector<float> denoised = Denoiser::denoise(buffers, pool);
+
+    QImage image(width(), height(), QImage::Format_RGB888);
+    const uchar *lut = displayLut();
+    pool.parallelFor(height(), [&](int y, int) {
+        const float *src = &denoised[size_t(y) * width() * 3];
+        uchar *dst = image.scanLine(y);
+        for (int i = 0; i < width() * 3; ++i)
+            dst[i] = toDisplay(lut, src[i]);
+    });
+
+    qDebug() << "Denoise time:" << timer.elapsed() << "ms";
+    return image;
+}
+
+int CpuRenderer::renderPass(Film &film, ThreadPool &pool, const std::atomic<bool> *cancel,
+                            int maxTiles, QDeadlineTimer deadline) const
+{
+    // Converged tiles drop out, so later passes only visit noisy regions
+    std::vector<int> activeTiles;
+    for (int t = 0; t < (int)film.tileDone.size(); ++t) {
+        if (!film.tileDone[t]) activeTiles.push_back(t);
+    }
+
+    // A partial pass goes to the tiles that are furthest behind
+    if (maxTiles >= 0 && maxTiles < (int)activeTiles.size()) {
+        std::stable_sort(activeTiles.begin(), activeTiles.end(), [&](int a, int b) {
+            return film.tileSamples[a] < film.tileSamples[b];
+        });
+        activeTiles.resize(std::max(maxTiles, 1));
+    }
+
+    // A cancelled or late pass leaves some tiles one sample behind, which the
+    // per-tile counts already account for
+    pool.parallelFor((int)activeTiles.size(), [&](int i, int) {
+        if ((!cancel || !cancel->load(std::memory_order_relaxed)) && !deadline.hasExpired())
+            renderTile(activeTiles[i], film);
+    });
+    return (int)activeTiles.size();
+}
+
+RenderStats CpuRenderer::render(Film &film, ThreadPool &pool, const std::atomic<bool> *cancel,
+                                const std::function<void(const Film &, int)> &onPass) const
+{
+    auto isCancelled = [cancel]() {
+        return cancel && cancel->load(std::memory_order_relaxed);
+    };
+    // Hashing reads every mesh, so only for renders that use checkpoints
+    const bool checkpoints = !m_settings.checkpointPath.isEmpty() || !m_settings.resumePath.isEmpty();
+    const QByteArray hash = checkpoints ? sceneHash(m_scene) : QByteArray();
+    auto writeCheckpoint = [&]() {
+        if (m_settings.checkpointPath.isEmpty()) return;
+        QElapsedTimer t;
+        t.start();
+        if (film.saveCheckpoint(m_settings.checkpointPath, m_settings.sampler, hash))
+            qDebug() << "Checkpoint written:" << m_settings.checkpointPath << t.elapsed() << "ms";
+    };
+
+    RenderStats stats;
+    if (!m_settings.resumePath.isEmpty()) {
+        // Rendering from scratch would overwrite the checkpoint the user asked for
+        if (!film.loadCheckpoint(m_settings.resumePath, m_settings.sampler, hash)) {
+            qWarning() << "Cannot resume from" << m_settings.resumePath;
+            stats.resumeFailed = true;
+            return stats;
+        }
+        qDebug() << "Resumed from" << m_settings.resumePath
+                 << "at" << film.maxTileSamples() << "spp";
+    }
+    film.resetDone(m_settings.spp);
+
+    const long long startSamples = film.totalSamples();
+    const long long startRays = film.totalRays();
+    QElapsedTimer timer;
+    timer.start();
+    QElapsedTimer checkpointTimer;
+    checkpointTimer.start();
+    const qint64 budgetMs = qint64(m_settings.timeBudgetSec * 1000.0);
+    // Checked before every tile, so no pass, not even the first one with no time
+    // estimate yet, overshoots the budget by more than the tiles in flight
+    const QDeadlineTimer deadline = budgetMs > 0 ? QDeadlineTimer(budgetMs)
+                                                 : QDeadlineTimer(QDeadlineTimer::Forever);
+
+    // Time per tile-sample, smoothed over passes; used to fit the last pass
+    // into what is left of the time budget
+    double msPerTile = 0.0;
+
+    while (!isCancelled()) {
+        int maxTiles = -1;
+        if (budgetMs > 0) {
+            qint64 remaining = budgetMs - timer.elapsed();
+            if (remaining <= 0) {
+                stats.outOfTime = true;
+                break;
+            }
+            if (msPerTile > 0.0)
+                maxTiles = int(remaining / msPerTile);
+            if (maxTiles == 0) {
+                stats.outOfTime = true;
+                break;
+            }
+        }
+
+        qint64 passStart = timer.elapsed();
+        int active = renderPass(film, pool, cancel, maxTiles, deadline);
+        if (active == 0 && m_settings.adaptive && m_settings.spendSavedSamples &&
+            reopenNoisiestTiles(film, pool) > 0)
+            continue;
+        if (active == 0) break;
+        ++stats.passes;
+
+        double passMsPerTile = double(timer.elapsed() - passStart) / active;
+        msPerTile = msPerTile > 0.0 ? 0.7 * msPerTile + 0.3 * passMsPerTile : passMsPerTile;
+
+        if (onPass) onPass(film, active);
+
+        if (checkpointTimer.elapsed() >= m_settings.checkpointIntervalSec * 1000LL) {
+            checkpointTimer.restart();
+            writeCheckpoint();
+        }
+    }
+
+    stats.cancelled = isCancelled();
+    stats.elapsedMs = timer.elapsed();
+    stats.samples = film.totalSamples() - startSamples;
+    stats.rays = film.totalRays() - startRays;
+    stats.averageSpp = double(film.totalSamples()) / (double(width()) * height());
+
+    if (stats.cancelled)
+        qDebug() << "Render cancelled at" << film.maxTileSamples() << "spp";
+    else if (stats.outOfTime)
+        qDebug() << "Time budget reached at" << film.maxTileSamples() << "spp";
+    qDebug() << "Average spp:" << stats.averageSpp
+             << "Mrays/s:" << stats.mraysPerSecond()
+             << "time:" << stats.elapsedMs << "ms";
+
+    writeCheckpoint();
+    return stats;
+}
@@ -0,0 +1,226 @@
+#pragma once
+
+#include <QDeadlineTimer>
+#include <QImage>
+#include <QVector3D>
+#include <atomic>
+#include <functional>
+#include <vector>
+#include "SceneBVH.h"
+#include "Scene.h"
+#include "Sampler.h"
+
+class ThreadPool;
+
+struct RenderSettings {
+    int width = 800;
+    int height = 600;
+    int spp = 128;
+    int threads = 0; // 0 = all cores
+    SamplerType sampler = SamplerType::Sobol;
+    // Time budget mode: spp becomes the per-pixel cap and the last pass is cut
+    // down to the tiles that fit in the remaining time. 0 = no limit
+    double timeBudgetSec = 0.0;
+
+    // Adaptive mode: a tile stops once every pixel's estimated error (in display
+    // units, 1/255 = one 8-bit step) is below noiseThreshold or it reaches spp,
+    // and the render ends when every tile has stopped. With spendSavedSamples the
+    // samples saved by early tiles then go to the tiles still above the
+    // threshold, which may pass spp, until spp per pixel on average are spent.
+    bool adaptive = false;
+    float noiseThreshold = 0.01f;
+    int minAdaptiveSpp = 16;
+    bool spendSavedSamples = false;
+
+    // Edge-aware denoise of the final frame, guided by first-hit features
+    bool denoise = false;
+
+    BVHBuildSettings bvh;
+
+    // Film checkpoint written every checkpointIntervalSec and when the render
+    // stops; resumePath continues from an earlier checkpoint (spp may be raised).
+    // A checkpoint of another scene or a damaged one stops the render.
+    QString checkpointPath;
+    int checkpointIntervalSec = 300;
+    QString resumePath;
+};
+
+struct CheckpointInfo {
+    int width = 0;
+    int height = 0;
+    SamplerType sampler = SamplerType::Sobol;
+    QByteArray sceneHash; // CpuRenderer::sceneHash() of the rendered scene
+    int minTileSamples = 0;
+    int maxTileSamples = 0;
+};
+
+// Summary of one render() call. samples and rays cover this session only, so a
+// resumed render reports its own throughput; averageSpp includes resumed samples.
+struct RenderStats {
+    int passes = 0;
+    qint64 elapsedMs = 0;
+    long long samples = 0;
+    long long rays = 0; // every traced path segment
+    double averageSpp = 0.0;
+    bool cancelled = false;
+    bool outOfTime = false;
+    bool resumeFailed = false; // settings.resumePath could not be loaded; nothing was rendered
+
+    double mraysPerSecond() const { return elapsedMs > 0 ? rays / (elapsedMs * 1000.0) : 0.0; }
+};
+
+// Scene light quad for next-event estimation. Emits from both faces, like the
+// emissive triangles a BSDF-sampled ray can hit.
+struct AreaLight {
+    QVector3D corner;
+    QVector3D edge1;
+    QVector3D edge2;
+    QVector3D normal;
+    QVector3D emission; // color * intensity
+    float area = 0.0f;
+    float selectPdf = 0.0f; // chosen in proportion to emitted power
+    float cdf = 0.0f;
+};
+
+// First-hit features of one path, accumulated into the film for the denoiser
+struct PathFeatures {
+    QVector3D albedo{1.0f, 1.0f, 1.0f}; // 1 for sky and emitters
+    QVector3D normal;                   // zero for sky and emitters
+    float depth = 0.0f;
+};
+
+struct RenderTile {
+    int x0, y0;
+    int x1, y1; // exclusive
+};
+
+// Accumulation state of one render. Per-tile entries are only written by the
+// worker rendering that tile.
+struct Film {
+    Film(int width, int height, const std::vector<RenderTile> &tiles);
+
+    int width;
+    int height;
+    std::vector<float> accum;      // RGB sums, width * height * 3
+    std::vector<float> lumSq;      // per-pixel sum of squared luminance
+    std::vector<float> albedo;     // first-hit albedo sums, RGB
+    std::vector<float> normal;     // first-hit normal sums, XYZ
+    std::vector<float> depth;      // first-hit distance sums
+    std::vector<int> tileSamples;  // samples taken by every pixel of a tile
+    std::vector<char> tileDone;    // tile reached spp or the noise threshold
+    std::vector<int> tilePixels;
+    std::vector<long long> tileRays; // rays traced this session, not checkpointed
+
+    long long totalSamples() const;
+    long long totalRays() const;
+    int maxTileSamples() const;
+
+    // Marks tiles with at least spp samples done and reopens the rest
+    void resetDone(int spp);
+
+    // The counter-based sampler has no state beyond the per-tile sample counts,
+    // so a checkpoint is the sums, the counts, the sampler type and the hash of
+    // the scene it belongs to. Files are written atomically; float arrays are
+    // stored little-endian.
+    bool saveCheckpoint(const QString &path, SamplerType sampler, const QByteArray &sceneHash) const;
+    bool loadCheckpoint(const QString &path, SamplerType sampler, const QByteArray &sceneHash);
+    static bool readCheckpointInfo(const QString &path, CheckpointInfo &info);
+};
+
+// CPU path tracer shared by RenderWorker. Scene data is gathered once in
+// prepare(); renderTile() is const and safe to call from several threads as long
+// as the tiles do not overlap. Keep one renderer per scene across renders so
+// prepare() can refit its BVHs.
+class CpuRenderer {
+public:
+    static constexpr int TileSize = 32;
+
+    CpuRenderer(const Scene &scene, const RenderSettings &settings);
+
+    // Settings of the next render; takes effect at the next prepare(). Other BVH
+    // build settings drop the BVHs of the last prepare().
+    void setSettings(const RenderSettings &settings);
+
+    // SHA-1 of everything in the scene the image depends on: camera, object
+    // mesh contents, transforms and colors, and lights
+    static QByteArray sceneHash(const Scene &scene);
+
+    // Row-major TileSize x TileSize tiles covering the image
+    static std::vector<RenderTile> makeTiles(int width, int height);
+
+    // Places every object's mesh BVH (built once per mesh, see BLASCache) and the
+    // light quads in a top-level BVH, building on the render pool. Returns false
+    // if there is nothing to render. Call again after moving lights or objects,
+    // e.g. once per animation frame: the light BVH and the top level are refit
+    // instead of rebuilt.
+    bool prepare(ThreadPool &pool);
+    // The last prepare() refit the BVHs of the one before instead of building
+    bool refitted() const { return m_refitted; }
+
+    int width() const { return m_settings.width; }
+    int height() const { return m_settings.height; }
+    const std::vector<RenderTile> &tiles() const { return m_tiles; }
+
+    // Adds the next sample of every pixel in the tile to the film and marks the
+    // tile done when it reaches spp or converges. The result does not depend on
+    // the calling thread.
+    void renderTile(int tileIndex, Film &film) const;
+
+    // Renders one sample of every unfinished tile and returns the number of tiles
+    // visited, 0 once the film is complete. Tiles not started when cancel is set
+    // or the deadline has passed are skipped. maxTiles >= 0 limits the pass to
+    // the tiles with fewest samples.
+    int renderPass(Film &film, ThreadPool &pool, const std::atomic<bool> *cancel = nullptr,
+                   int maxTiles = -1, QDeadlineTimer deadline = QDeadlineTimer::Forever) const;
+
+    // Runs passes until every tile is done, the time budget is spent or cancel is
+    // set; in time budget mode passes are scheduled to end inside the budget.
+    // Resumes from settings.resumePath, or returns with resumeFailed set if that
+    // fails, and writes checkpoints as configured; onPass runs on the calling
+    // thread after every pass.
+    RenderStats render(Film &film, ThreadPool &pool, const std::atomic<bool> *cancel = nullptr,
+                       const std::function<void(const Film &, int activeTiles)> &onPass = {}) const;
+
+    // Writes the tile's gamma-corrected average into rgb (RGB888 rows)
+    void tonemapTile(int tileIndex, const Film &film, uchar *rgb, int bytesPerLine) const;
+    QImage toImage(const Film &film, ThreadPool &pool) const;
+
+    // Final frame: the film average, denoised when settings.denoise is set
+    QImage finalImage(const Film &film, ThreadPool &pool) const;
+
+private:
+    QVector3D tracePath(QVector3D orig, QVector3D dir, Sampler &sampler, int &rays,
+                        PathFeatures &features) const;
+
+    // Direct light at a diffuse hit from one light sample, MIS-weighted against
+    // cosine BSDF sampling
+    QVector3D sampleDirect(const QVector3D &point, const QVector3D &normal,
+                           const QVector3D &albedo, Sampler &sampler, int &rays) const;
+
+    // Solid-angle pdf of sampling this light towards a point at distance dist
+    float lightPdf(int lightIndex, const QVector3D &dir, float dist) const;
+    float tileError(int tileIndex, const Film &film) const;
+
+    // spendSavedSamples, once every tile is done: reopens the tiles with the
+    // highest error above noiseThreshold that fit in the unspent part of the
+    // spp * pixels budget. Returns the number reopened, 0 when the budget is
+    // spent or every tile is below the threshold.
+    int reopenNoisiestTiles(Film &film, ThreadPool &pool) const;
+
+    const Scene &m_scene;
+    RenderSettings m_settings;
+    std::vector<RenderTile> m_tiles;
+
+    // Camera basis
+    QVector3D m_eye;
+    QVector3D m_forward;
+    QVector3D m_right;
+    QVector3D m_up;
+    float m_aspect = 1.0f;
+    float m_tanHalf = 1.0f;
+
+    SceneBVH m_bvh;
+    std::shared_ptr<BVH> m_lightBVH;
+    bool m_refitted = false;
+    std::vector<AreaLight> m_lights;
+};
@@ -0,0 +1,165 @@
+#include "Denoiser.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+// exp(x) for x <= 0 without a libm call or a branch, so the tap loop below
+// vectorizes. Relative error is below 0.03%, plenty for filter weights.
+static inline float fastExp(float x)
+{
+    x *= 1.44269504f;
+    x = 0.5f * (x - 126.0f + std::abs(x + 126.0f)); // max(x, -126)
+    float fl = float(int(x));                         // ceil for x <= 0
+    float f = x - fl + 1.0f;                          // in (0, 1]
+    float p = 0.5f + f * (0.3475893f + f * (0.1131060f + f * 0.0390625f)); // 2^(f - 1)
+    int32_t bits = (int32_t(fl) + 127) << 23;
+    float scale;
+    std::memcpy(&scale, &bits, sizeof(scale));
+    return p * scale;
+}
+
+// Planar image with its guide features; one plane per channel
+struct Planes {
+    std::vector<float> r, g, b;
+    std::vector<float> nx, ny, nz, z;
+    std::vector<float> colorScale, depthScale; // per-pixel edge-stopping scales
+};
+
+// Accumulates one kernel tap for count pixels: p is the first pixel, q its tap
+// neighbour, and the sums start at p's column. The sums are restrict so the
+// compiler does not need a run-time alias check per input plane.
+static void accumulateTap(const Planes &in, size_t p, size_t q, int count, float hk,
+                          float *__restrict sumR, float *__restrict sumG,
+                          float *__restrict sumB, float *__restrict sumW)
+{
+    const float *pr = &in.r[p], *pg = &in.g[p], *pb = &in.b[p];
+    const float *pnx = &in.nx[p], *pny = &in.ny[p], *pnz = &in.nz[p], *pz = &in.z[p];
+    const float *cs = &in.colorScale[p], *ds = &in.depthScale[p];
+    const float *qr = &in.r[q], *qg = &in.g[q], *qb = &in.b[q];
+    const float *qnx = &in.nx[q], *qny = &in.ny[q], *qnz = &in.nz[q], *qz = &in.z[q];
+
+    for (int x = 0; x < count; ++x) {
+        float dr = qr[x] - pr[x], dg = qg[x] - pg[x], db = qb[x] - pb[x];
+        float wc = fastExp(-(dr * dr + dg * dg + db * db) * cs[x]);
+
+        // max(0, dot(n_p, n_q))^64; the abs form keeps the loop branch-free
+        float wn = pnx[x] * qnx[x] + pny[x] * qny[x] + pnz[x] * qnz[x];
+        wn = 0.5f * (wn + std::abs(wn));
+        wn *= wn; wn *= wn; wn *= wn; wn *= wn; wn *= wn; wn *= wn;
+
+        float wz = fastExp(-std::abs(qz[x] - pz[x]) * ds[x]);
+
+        float w = hk * wc * wn * wz;
+        sumR[x] += w * qr[x];
+        sumG[x] += w * qg[x];
+        sumB[x] += w * qb[x];
+        sumW[x] += w;
+    }
+}
+
+std::vector<float> Denoiser::denoise(const DenoiseBuffers &in, ThreadPool &pool,
+                                     const DenoiseSettings &settings)
+{
+    const int w = in.width;
+    const int h = in.height;
+    const size_t count = size_t(w) * h;
+
+    // Planar copies keep every tap loop a unit-stride walk over floats
+    Planes planes;
+    for (auto *plane : {&planes.r, &planes.g, &planes.b, &planes.nx, &planes.ny, &planes.nz,
+                        &planes.z, &planes.colorScale, &planes.depthScale})
+        plane->resize(count);
+    std::vector<float> ar(count), ag(count), ab(count);
+
+    pool.parallelFor(h, [&](int y, int) {
+        for (int x = 0; x < w; ++x) {
+            size_t p = size_t(y) * w + x;
+            ar[p] = std::max(in.albedo[p * 3 + 0], 1e-3f);
+            ag[p] = std::max(in.albedo[p * 3 + 1], 1e-3f);
+            ab[p] = std::max(in.albedo[p * 3 + 2], 1e-3f);
+            planes.r[p] = in.color[p * 3 + 0] / ar[p];
+            planes.g[p] = in.color[p * 3 + 1] / ag[p];
+            planes.b[p] = in.color[p * 3 + 2] / ab[p];
+
+            // Averaged normals shrink at silhouettes; renormalize so the
+            // centre tap keeps weight 1
+            float x0 = in.normal[p * 3 + 0], y0 = in.normal[p * 3 + 1], z0 = in.normal[p * 3 + 2];
+            float len = std::sqrt(x0 * x0 + y0 * y0 + z0 * z0);
+            float inv = len > 1e-4f ? 1.0f / len : 0.0f;
+            planes.nx[p] = x0 * inv;
+            planes.ny[p] = y0 * inv;
+            planes.nz[p] = z0 * inv;
+            planes.z[p] = in.depth[p];
+        }
+    });
+
+    std::vector<float> outR(count), outG(count), outB(count);
+    static const float kernel[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+
+    float colorSigma = settings.colorSigma;
+    for (int it = 0, step = 1; it < settings.iterations; ++it, step *= 2) {
+        pool.parallelFor(h, [&](int y, int) {
+            for (int x = 0; x < w; ++x) {
+                size_t p = size_t(y) * w + x;
+                float lum = 0.2126f * planes.r[p] + 0.7152f * planes.g[p] + 0.0722f * planes.b[p];
+                float s = colorSigma * (lum + 0.05f);
+                planes.colorScale[p] = 1.0f / (s * s);
+                planes.depthScale[p] = 1.0f / (settings.depthSigma * step * planes.z[p] + 1e-4f);
+            }
+        });
+
+        pool.parallelFor(h, [&](int y, int) {
+            const size_t row = size_t(y) * w;
+            std::vector<float> sumR(w, 0.0f), sumG(w, 0.0f), sumB(w, 0.0f), sumW(w, 0.0f);
+
+            for (int ky = 0; ky < 5; ++ky) {
+                int qy = y + (ky - 2) * step;
+                if (qy < 0 || qy >= h) continue;
+                for (int kx = 0; kx < 5; ++kx) {
+                    // Columns whose neighbour at ox is inside the row; none
+                    // when the step is wider than the image
+                    int ox = (kx - 2) * step;
+                    int x0 = std::max(0, -ox);
+                    int x1 = std::min(w, w - ox);
+                    if (x0 >= x1) continue;
+                    accumulateTap(planes, row + x0, size_t(qy) * w + x0 + ox, x1 - x0,
+                                  kernel[ky] * kernel[kx], sumR.data() + x0, sumG.data() + x0,
+                                  sumB.data() + x0, sumW.data() + x0);
+                }
+            }
+
+            // Pixels without geometry (sky) have no normal and pass through
+            for (int x = 0; x < w; ++x) {
+                size_t p = row + x;
+                if (sumW[x] > 1e-6f) {
+                    float inv = 1.0f / sumW[x];
+                    outR[p] = sumR[x] * inv;
+                    outG[p] = sumG[x] * inv;
+                    outB[p] = sumB[x] * inv;
+                } else {
+                    outR[p] = planes.r[p];
+                    outG[p] = planes.g[p];
+                    outB[p] = planes.b[p];
+                }
+            }
+        });
+
+        planes.r.swap(outR);
+        planes.g.swap(outG);
+        planes.b.swap(outB);
+        colorSigma *= 0.5f;
+    }
+
+    std::vector<float> result(count * 3);
+    pool.parallelFor(h, [&](int y, int) {
+        for (int x = 0; x < w; ++x) {
+            size_t p = size_t(y) * w + x;
+            result[p * 3 + 0] = planes.r[p] * ar[p];
+            result[p * 3 + 1] = planes.g[p] * ag[p];
+            result[p * 3 + 2] = planes.b[p] * ab[p];
+        }
+    });
+    return result;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <vector>
+
+class ThreadPool;
+
+// Per-pixel averages handed to the denoiser. color, albedo and normal are
+// interleaved RGB / XYZ; a zero normal marks pixels that hit nothing.
+struct DenoiseBuffers {
+    int width = 0;
+    int height = 0;
+    std::vector<float> color;
+    std::vector<float> albedo;
+    std::vector<float> normal;
+    std::vector<float> depth;
+};
+
+struct DenoiseSettings {
+    int iterations = 4;       // 5x5 taps at step 1, 2, 4, 8: a 61 pixel footprint
+    float colorSigma = 1.5f;  // relative to the centre luminance, halved every iteration
+    float depthSigma = 0.02f; // relative depth difference per pixel of step
+};
+
+// Edge-avoiding A-trous wavelet filter (Dammertz et al. 2010). Lighting is
+// divided by albedo before filtering and multiplied back afterwards, so texture
+// and material edges survive; normal and depth stop the kernel at geometric
+// edges. shaders/denoise.comp is the GPU version of the same filter.
+class Denoiser {
+public:
+    // Returns the filtered RGB image; runs rows in parallel on pool
+    static std::vector<float> denoise(const DenoiseBuffers &in, ThreadPool &pool,
+                                      const DenoiseSettings &settings = DenoiseSettings());
+};
@@ -1,11 +1,17 @@
 #include "MainWindow.h"
 #include "RenderWindow.h"
 #include <QApplication>
+#include <QCryptographicHash>
 #include <QMenuBar>
 #include <QFileDialog>
 #include <QHBoxLayout>
 #include <QMessageBox>
 #include <QStatusBar>
+#include <QStandardPaths>
+#include <QThread>
+#include <QDir>
+#include <QFileInfo>
+#include <algorithm>
 
 MainWindow::MainWindow(QWidget *parent) : QMainWindow(parent)
 {
@@ -15,6 +21,11 @@ MainWindow::MainWindow(QWidget *parent) : QMainWindow(parent)
     resize(1200, 700);
 }
 
+MainWindow::~MainWindow()
+{
+    if (m_loadThread) m_loadThread->wait();
+}
+
 void MainWindow::setupMenuBar()
 {
     QMenuBar *mb = menuBar();
@@ -33,6 +44,7 @@ void MainWindow::setupMenuBar()
     viewMenu->addAction("Render Preview", this, &MainWindow::showRenderPreview, QKeySequence("F6"));
     viewMenu->addSeparator();
     viewMenu->addAction("Render", this, &MainWindow::startRender, QKeySequence("F7"));
+    viewMenu->addAction("Resume Render...", this, &MainWindow::resumeRender);
 }
 
 void MainWindow::setupUI()
@@ -72,34 +84,59 @@ void MainWindow::onViewportInitialized()
     }
 }
 
+void MainWindow::loadScene(const QString &path)
+{
+    if (m_loadThread) {
+        statusBar()->showMessage("Still loading the previous scene");
+        return;
+    }
+
+    // Built away from m_scene, which the viewport keeps drawing until the new
+    // scene is complete. Progress reaches the status bar as queued calls, so
+    // the event loop runs as usual and nothing sees a half-loaded scene.
+    auto scene = std::make_shared<Scene>();
+    auto ok = std::make_shared<bool>(true);
+    Scene::LoadProgress progress = [this](int loaded, int total) {
+        QMetaObject::invokeMethod(this, [this, loaded, total]() {
+            statusBar()->showMessage(QString("Loading meshes... %1/%2").arg(loaded).arg(total));
+        }, Qt::QueuedConnection);
+    };
+    m_loadThread = QThread::create([scene, ok, path, progress]() {
+        if (path.isEmpty()) scene->createDefault(progress);
+        else *ok = scene->load(path, progress);
+    });
+    connect(m_loadThread, &QThread::finished, this, [this, scene, ok, path]() {
+        m_loadThread->deleteLater();
+        m_loadThread = nullptr;
+        if (!*ok) {
+            statusBar()->clearMessage();
+            QMessageBox::warning(this, "Error", "Failed to load scene file.");
+            return;
+        }
+        m_scene = std::move(*scene);
+        m_viewport->setScene(&m_scene);
+        m_propertiesPanel->setScene(&m_scene);
+        m_currentFilePath = path;
+        statusBar()->showMessage(path.isEmpty() ? QString("New scene created") : "Loaded: " + path);
+    });
+    statusBar()->showMessage("Loading scene...");
+    m_loadThread->start();
+}
+
 void MainWindow::newFile()
 {
     if (!m_viewportReady) {
         m_pendingNewFile = true;
         return;
     }
-
-    m_scene.createDefault();
-    m_viewport->setScene(&m_scene);
-    m_propertiesPanel->setScene(&m_scene);
-    m_currentFilePath.clear();
-    statusBar()->showMessage("New scene created");
+    loadScene(QString());
 }
 
 void MainWindow::openFile()
 {
     QString path = QFileDialog::getOpenFileName(this, "Open Scene", QString(), "Scene Files (*.scene)");
     if (path.isEmpty()) return;
-
-    if (!m_scene.load(path)) {
-        QMessageBox::warning(this, "Error", "Failed to load scene file.");
-        return;
-    }
-
-    m_viewport->setScene(&m_scene);
-    m_propertiesPanel->setScene(&m_scene);
-    m_currentFilePath = path;
-    statusBar()->showMessage("Loaded: " + path);
+    loadScene(path);
 }
 
 void MainWindow::saveFile()
@@ -138,35 +175,91 @@ void MainWindow::showViewport()
 void MainWindow::showRenderPreview()
 {
     int spp = m_propertiesPanel->viewportSamples();
-    statusBar()->showMessage(QString("Viewport render preview (%1 spp)...").arg(spp));
+    SamplerType sampler = m_propertiesPanel->viewportSampler();
+    bool denoise = m_propertiesPanel->viewportDenoise();
+    statusBar()->showMessage(QString("Viewport render preview (%1 spp, %2%3)...")
+                                 .arg(spp).arg(samplerTypeName(sampler))
+                                 .arg(denoise ? ", denoised" : ""));
     QApplication::processEvents();
 
-    m_viewport->renderPathTraced(spp);
+    m_viewport->renderPathTraced(spp, sampler, denoise);
     statusBar()->showMessage("Preview complete");
 }
 
 void MainWindow::startRender()
 {
-    int spp = m_propertiesPanel->renderSamples();
+    launchRender(renderSettingsFromPanel());
+}
+
+void MainWindow::resumeRender()
+{
+    QString path = QFileDialog::getOpenFileName(this, "Resume Render", "",
+                                                "Render Checkpoint (*.rtck)");
+    if (path.isEmpty()) return;
+
+    CheckpointInfo info;
+    if (!Film::readCheckpointInfo(path, info)) {
+        QMessageBox::warning(this, "Error", "Not a valid render checkpoint:\n" + path);
+        return;
+    }
+    if (info.sceneHash != CpuRenderer::sceneHash(m_scene)) {
+        QMessageBox::warning(this, "Error", "The checkpoint belongs to another scene, or the scene "
+                                            "was edited after it was written:\n" + path);
+        return;
+    }
 
-    // Get render resolution from properties panel
-    QSpinBox *wSpin = m_propertiesPanel->findChild<QSpinBox *>("", Qt::FindDirectChildrenOnly);
+    // Resolution and sampler must match the checkpoint; the sample budget can grow
+    RenderSettings settings = renderSettingsFromPanel();
+    settings.width = info.width;
+    settings.height = info.height;
+    settings.sampler = info.sampler;
+    settings.spp = std::max(settings.spp, info.maxTileSamples);
+    settings.resumePath = path;
+    settings.checkpointPath = path;
 
-    // Use default or get from panel
-    int w = 800, h = 600;
+    launchRender(settings);
+}
 
-    // Find width/height spinboxes
-    QList<QSpinBox *> spins = m_propertiesPanel->findChildren<QSpinBox *>();
-    for (auto *spin : spins) {
-        if (spin->maximum() == 4096) {
-            if (w == 800) { w = spin->value(); }
-            else { h = spin->value(); break; }
-        }
+RenderSettings MainWindow::renderSettingsFromPanel() const
+{
+    RenderSettings settings;
+    settings.width = m_propertiesPanel->renderWidth();
+    settings.height = m_propertiesPanel->renderHeight();
+    settings.spp = m_propertiesPanel->renderSamples();
+    settings.threads = m_propertiesPanel->renderThreads();
+    settings.sampler = m_propertiesPanel->renderSampler();
+    settings.adaptive = m_propertiesPanel->renderAdaptive();
+    settings.noiseThreshold = float(m_propertiesPanel->renderNoiseThreshold());
+    settings.timeBudgetSec = m_propertiesPanel->renderTimeBudget();
+    settings.denoise = m_propertiesPanel->renderDenoise();
+    settings.bvh.method = m_propertiesPanel->renderBvhMethod();
+
+    // One checkpoint per scene file, so rendering another scene keeps it
+    QString name = "untitled";
+    if (!m_currentFilePath.isEmpty()) {
+        QFileInfo file(m_currentFilePath);
+        QByteArray pathHash = QCryptographicHash::hash(file.absoluteFilePath().toUtf8(),
+                                                       QCryptographicHash::Sha1);
+        name = file.completeBaseName() + "-" + QString::fromLatin1(pathHash.toHex().left(8));
     }
+    QString dir = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation);
+    if (!dir.isEmpty() && QDir().mkpath(dir + "/checkpoints"))
+        settings.checkpointPath = dir + "/checkpoints/" + name + ".rtck";
+    return settings;
+}
 
-    statusBar()->showMessage(QString("Rendering %1x%2 @ %3 spp...").arg(w).arg(h).arg(spp));
+void MainWindow::launchRender(const RenderSettings &settings)
+{
+    statusBar()->showMessage(QString("Rendering %1x%2 @ %3 spp, %4 threads, %5%6...")
+                                 .arg(settings.width).arg(settings.height).arg(settings.spp)
+                                 .arg(settings.threads)
+                                 .arg(samplerTypeName(settings.sampler))
+                                 .arg(settings.resumePath.isEmpty() ? "" : " (resumed)"));
 
-    auto *renderWin = new RenderWindow(&m_scene, w, h, spp, this);
+    // A render that is still running keeps its renderer; this one gets a new one
+    if (!m_renderer || m_renderer.use_count() > 1)
+        m_renderer = std::make_shared<CpuRenderer>(m_scene, settings);
+    auto *renderWin = new RenderWindow(m_renderer, settings, this);
     renderWin->setAttribute(Qt::WA_DeleteOnClose);
     renderWin->show();
     renderWin->startRender();
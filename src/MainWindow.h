@@ -1,14 +1,19 @@
 #pragma once
 
 #include <QMainWindow>
+#include <memory>
 #include "Scene.h"
 #include "Viewport.h"
 #include "PropertiesPanel.h"
+#include "CpuRenderer.h"
+
+class QThread;
 
 class MainWindow : public QMainWindow {
     Q_OBJECT
 public:
     explicit MainWindow(QWidget *parent = nullptr);
+    ~MainWindow() override;
 
 private slots:
     void newFile();
@@ -18,16 +23,25 @@ private slots:
     void showViewport();
     void showRenderPreview();
     void startRender();
+    void resumeRender();
     void onViewportInitialized();
 
 private:
     void setupUI();
     void setupMenuBar();
+    RenderSettings renderSettingsFromPanel() const;
+    void launchRender(const RenderSettings &settings);
+    // Loads the scene file at path, or the default scene for an empty path, on
+    // a thread of its own and replaces m_scene once it is complete
+    void loadScene(const QString &path);
 
     Viewport *m_viewport = nullptr;
     PropertiesPanel *m_propertiesPanel = nullptr;
     Scene m_scene;
+    // Kept across renders so moving objects or lights refits its BVHs
+    std::shared_ptr<CpuRenderer> m_renderer;
     QString m_currentFilePath;
     bool m_viewportReady = false;
     bool m_pendingNewFile = false;
+    QThread *m_loadThread = nullptr; // running loadScene(), if any
 };
\ No newline at end of file
@@ -0,0 +1,190 @@
+#include "MeshCache.h"
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <cstring>
+
+static constexpr quint32 MeshCacheMagic = 0x48534d52; // "RMSH"
+static constexpr quint32 MeshCacheVersion = 1;
+static constexpr quint64 MeshCacheAlign = 64;
+
+static_assert(Q_BYTE_ORDER == Q_LITTLE_ENDIAN, "mesh cache arrays are written raw");
+static_assert(sizeof(QVector3D) == 3 * sizeof(float), "mesh cache stores QVector3D as three floats");
+
+// Header of a mesh cache file; the arrays follow at aligned offsets
+struct MeshCacheHeader {
+    quint32 magic;
+    quint32 version;
+    qint64 sourceSize;  // OBJ size in bytes
+    qint64 sourceMtime; // OBJ modification time, ms since the epoch
+    qint32 vertexCount;
+    qint32 indexCount;
+    quint64 vertexOffset; // float[3 * vertexCount]
+    quint64 normalOffset; // float[3 * vertexCount]
+    quint64 indexOffset;  // quint32[indexCount]
+    quint64 fileSize;
+};
+
+static quint64 meshCacheAlign(quint64 offset)
+{
+    return (offset + MeshCacheAlign - 1) / MeshCacheAlign * MeshCacheAlign;
+}
+
+MeshCache::MeshCache()
+{
+    QString base = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+    if (!base.isEmpty())
+        m_diskDir = base + "/mesh";
+}
+
+MeshCache &MeshCache::global()
+{
+    static MeshCache cache;
+    return cache;
+}
+
+void MeshCache::setDiskCacheDir(const QString &dir)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_diskDir = dir;
+}
+
+QString MeshCache::diskCacheDir()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_diskDir;
+}
+
+QString MeshCache::cachePath(const QString &objPath)
+{
+    QString dir = diskCacheDir();
+    if (dir.isEmpty()) return QString();
+    QByteArray name = QCryptographicHash::hash(QFileInfo(objPath).absoluteFilePath().toUtf8(),
+                                               QCryptographicHash::Sha1);
+    return dir + "/" + QString::fromLatin1(name.toHex()) + ".mesh";
+}
+
+MeshCache::SourceStamp MeshCache::stamp(const QString &objPath)
+{
+    SourceStamp stamp;
+    QFileInfo info(objPath);
+    if (info.exists()) {
+        stamp.size = info.size();
+        stamp.mtime = info.lastModified().toMSecsSinceEpoch();
+    }
+    return stamp;
+}
+
+bool MeshCache::load(const QString &objPath, Mesh &mesh)
+{
+    QString path = cachePath(objPath);
+    SourceStamp source = stamp(objPath);
+    if (path.isEmpty() || source.size < 0) return false;
+
+    auto file = std::make_shared<QFile>(path);
+    if (!file->open(QIODevice::ReadOnly) || file->size() < qint64(sizeof(MeshCacheHeader)))
+        return false;
+    const uchar *data = file->map(0, file->size());
+    if (!data) return false;
+
+    MeshCacheHeader h;
+    std::memcpy(&h, data, sizeof(h));
+    bool valid = h.magic == MeshCacheMagic && h.version == MeshCacheVersion &&
+                 h.sourceSize == source.size && h.sourceMtime == source.mtime &&
+                 h.vertexCount >= 0 && h.indexCount >= 0 && h.fileSize == quint64(file->size());
+    valid = valid &&
+            h.vertexOffset >= sizeof(h) && h.vertexOffset % MeshCacheAlign == 0 &&
+            h.normalOffset >= h.vertexOffset + quint64(h.vertexCount) * sizeof(QVector3D) &&
+            h.normalOffset % MeshCacheAlign == 0 &&
+            h.indexOffset >= h.normalOffset + quint64(h.vertexCount) * sizeof(QVector3D) &&
+            h.indexOffset % MeshCacheAlign == 0 &&
+            h.fileSize == h.indexOffset + quint64(h.indexCount) * sizeof(quint32);
+    if (!valid) {
+        qDebug() << "Ignoring stale mesh cache:" << path;
+        return false;
+    }
+
+    // Out-of-range indices would be read unchecked by the renderers
+    const quint32 *indices = reinterpret_cast<const quint32 *>(data + h.indexOffset);
+    for (qint32 i = 0; i < h.indexCount; ++i) {
+        if (indices[i] >= quint32(h.vertexCount)) {
+            qWarning() << "Corrupt mesh cache:" << path;
+            return false;
+        }
+    }
+
+    mesh.vertices = QVector<QVector3D>::fromRawData(
+        reinterpret_cast<const QVector3D *>(data + h.vertexOffset), h.vertexCount);
+    mesh.normals = QVector<QVector3D>::fromRawData(
+        reinterpret_cast<const QVector3D *>(data + h.normalOffset), h.vertexCount);
+    mesh.indices = QVector<unsigned int>::fromRawData(indices, h.indexCount);
+    mesh.mapping = std::move(file);
+    return true;
+}
+
+bool MeshCache::save(const QString &objPath, const Mesh &mesh, const SourceStamp &source)
+{
+    QString path = cachePath(objPath);
+    if (path.isEmpty() || source.size < 0 || mesh.vertices.isEmpty() ||
+        mesh.normals.size() != mesh.vertices.size())
+        return false;
+
+    MeshCacheHeader h;
+    std::memset(&h, 0, sizeof(h));
+    h.magic = MeshCacheMagic;
+    h.version = MeshCacheVersion;
+    h.sourceSize = source.size;
+    h.sourceMtime = source.mtime;
+    h.vertexCount = mesh.vertices.size();
+    h.indexCount = mesh.indices.size();
+    h.vertexOffset = meshCacheAlign(sizeof(h));
+    h.normalOffset = meshCacheAlign(h.vertexOffset + quint64(h.vertexCount) * sizeof(QVector3D));
+    h.indexOffset = meshCacheAlign(h.normalOffset + quint64(h.vertexCount) * sizeof(QVector3D));
+    h.fileSize = h.indexOffset + quint64(h.indexCount) * sizeof(quint32);
+
+    if (!QDir().mkpath(QFileInfo(path).absolutePath())) return false;
+    QSaveFile f(path);
+    if (!f.open(QIODevice::WriteOnly)) {
+        qWarning() << "Cannot write mesh cache:" << path;
+        return false;
+    }
+    quint64 pos = 0;
+    auto writeAt = [&](quint64 offset, const void *data, quint64 bytes) {
+        bool ok = f.write(QByteArray(int(offset - pos), '\0')) == qint64(offset - pos) &&
+                  f.write(static_cast<const char *>(data), qint64(bytes)) == qint64(bytes);
+        pos = offset + bytes;
+        return ok;
+    };
+    bool ok = writeAt(0, &h, sizeof(h)) &&
+              writeAt(h.vertexOffset, mesh.vertices.constData(), quint64(h.vertexCount) * sizeof(QVector3D)) &&
+              writeAt(h.normalOffset, mesh.normals.constData(), quint64(h.vertexCount) * sizeof(QVector3D)) &&
+              writeAt(h.indexOffset, mesh.indices.constData(), quint64(h.indexCount) * sizeof(quint32));
+    if (!ok) {
+        f.cancelWriting();
+        return false;
+    }
+    return f.commit();
+}
+
+bool MeshCache::loadOrParse(const QString &objPath, Mesh &mesh, ThreadPool *pool)
+{
+    QElapsedTimer timer;
+    timer.start();
+    // Stamped before parsing: an edit during the parse must not get the new stamp
+    SourceStamp source = stamp(objPath);
+    if (load(objPath, mesh)) {
+        qDebug() << "Mesh loaded from cache:" << objPath << "verts:" << mesh.vertices.size()
+                 << "tris:" << mesh.indices.size() / 3 << "in" << timer.elapsed() << "ms";
+        return true;
+    }
+    if (!ObjLoader::load(objPath, mesh, pool)) return false;
+    if (save(objPath, mesh, source))
+        qDebug() << "Mesh cached:" << cachePath(objPath);
+    return true;
+}
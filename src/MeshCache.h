@@ -0,0 +1,45 @@
+#pragma once
+
+#include <QString>
+#include <mutex>
+#include "ObjLoader.h"
+
+// Binary copies of loaded OBJ meshes, so a later load maps the arrays instead
+// of parsing text. A cache file is named after the OBJ's absolute path and
+// records the OBJ's size and modification time; a file that does not match
+// them, or has another format version, is ignored and rewritten. Thread-safe.
+class MeshCache {
+public:
+    MeshCache();
+
+    static MeshCache &global();
+
+    // Maps the cache file of objPath into mesh. The mesh arrays point into the
+    // mapping, which mesh.mapping keeps alive. False if there is no valid file.
+    bool load(const QString &objPath, Mesh &mesh);
+
+    // Size and modification time of an OBJ; size is -1 if it does not exist
+    struct SourceStamp {
+        qint64 size = -1;
+        qint64 mtime = 0; // ms since the epoch
+    };
+    static SourceStamp stamp(const QString &objPath);
+
+    // Writes the cache file of objPath, atomically. source is the OBJ's stamp
+    // from before mesh was parsed, so an OBJ changed meanwhile is parsed again.
+    bool save(const QString &objPath, const Mesh &mesh, const SourceStamp &source);
+
+    // The cache file, or loads the OBJ with ObjLoader and caches it
+    bool loadOrParse(const QString &objPath, Mesh &mesh, ThreadPool *pool = nullptr);
+
+    // Directory of the cache files; empty disables the cache. Defaults to
+    // "mesh" in the user's cache location. Stale files are never deleted.
+    void setDiskCacheDir(const QString &dir);
+    QString diskCacheDir();
+
+private:
+    QString cachePath(const QString &objPath);
+
+    std::mutex m_mutex;
+    QString m_diskDir;
+};
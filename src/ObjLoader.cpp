@@ -1,87 +1,367 @@
 #include "ObjLoader.h"
-#include <QFile>
-#include <QTextStream>
+#include "ThreadPool.h"
+#include <QByteArray>
 #include <QDebug>
+#include <QElapsedTimer>
+#include <QFile>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
 
-bool ObjLoader::load(const QString &path, Mesh &mesh)
+namespace {
+
+// Byte-level tokenizer over the file data. Nothing here allocates: tokens are
+// pointer ranges and numbers are parsed in place.
+bool isSpace(char c)
 {
-    QFile file(path);
-    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
-        qWarning() << "Cannot open OBJ file:" << path;
-        return false;
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+bool isDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+// Next whitespace-separated token of the line [p, end); false at the end of the line
+bool nextToken(const char *&p, const char *end, const char *&tokBegin, const char *&tokEnd)
+{
+    while (p < end && isSpace(*p))
+        ++p;
+    if (p == end) return false;
+    tokBegin = p;
+    while (p < end && !isSpace(*p))
+        ++p;
+    tokEnd = p;
+    return true;
+}
+
+bool tokenIs(const char *begin, const char *end, const char *word)
+{
+    for (; begin < end; ++begin, ++word)
+        if (*word == '\0' || *begin != *word) return false;
+    return *word == '\0';
+}
+
+// Whole-token integer, 0 when the token is not one (as QString::toInt())
+int parseInt(const char *p, const char *end)
+{
+    bool negative = false;
+    if (p < end && (*p == '+' || *p == '-')) negative = *p++ == '-';
+    if (p == end) return 0;
+    long long value = 0;
+    for (; p < end; ++p) {
+        if (!isDigit(*p)) return 0;
+        value = value * 10 + (*p - '0');
+        if (value > INT32_MAX) return 0;
+    }
+    return int(negative ? -value : value);
+}
+
+// Whole-token float, 0 when the token is not one (as QString::toFloat()).
+// Up to 19 significant digits and a decimal exponent within +-22 are exact in
+// the double arithmetic below, so the result is the correctly rounded double
+// narrowed to float, the same as Qt's conversion. Anything longer takes the
+// slow path.
+float parseFloat(const char *begin, const char *end)
+{
+    static const double powers[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+                                    1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+                                    1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    const char *p = begin;
+    bool negative = false;
+    if (p < end && (*p == '+' || *p == '-')) negative = *p++ == '-';
+
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool anyDigit = false;
+    for (; p < end && isDigit(*p); ++p) {
+        anyDigit = true;
+        if (mantissa == 0 && *p == '0') continue;
+        if (digits < 19) mantissa = mantissa * 10 + (*p - '0');
+        else ++exponent;
+        ++digits;
+    }
+    if (p < end && *p == '.') {
+        for (++p; p < end && isDigit(*p); ++p) {
+            anyDigit = true;
+            if (mantissa == 0 && *p == '0') {
+                --exponent;
+                continue;
+            }
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                --exponent;
+            }
+            ++digits;
+        }
+    }
+    if (!anyDigit) return 0.0f;
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        ++p;
+        bool negExp = false;
+        if (p < end && (*p == '+' || *p == '-')) negExp = *p++ == '-';
+        if (p == end || !isDigit(*p)) return 0.0f;
+        int e = 0;
+        for (; p < end && isDigit(*p); ++p)
+            e = e < 10000 ? e * 10 + (*p - '0') : e;
+        exponent += negExp ? -e : e;
     }
+    if (p != end) return 0.0f;
 
+    double value;
+    if (mantissa == 0) {
+        value = 0.0;
+    } else if (digits <= 19 && mantissa < (uint64_t(1) << 53) && exponent >= -22 && exponent <= 22) {
+        value = exponent < 0 ? double(mantissa) / powers[-exponent] : double(mantissa) * powers[exponent];
+    } else {
+        // Rare in OBJ files; allocates
+        bool ok = false;
+        value = QByteArray(begin, int(end - begin)).toDouble(&ok);
+        return ok ? float(value) : 0.0f;
+    }
+    return float(negative ? -value : value);
+}
+
+struct VertexKey {
+    int posIdx;
+    int normIdx;
+};
+
+// Records of one newline-aligned piece of the file. Face indices point into
+// the chunk's corners. Negative OBJ indices count back from the last vertex
+// read, so they are resolved against the chunk's own vertex counts and listed
+// in relativePos/relativeNorm; the merge shifts them by the earlier chunks.
+struct ObjChunk {
     QVector<QVector3D> positions;
     QVector<QVector3D> normals;
+    QVector<VertexKey> corners;
+    QVector<unsigned int> indices;
+    QVector<int> relativePos;  // corners with a chunk-relative posIdx
+    QVector<int> relativeNorm; // corners with a chunk-relative normIdx
+};
 
-    struct VertexKey {
-        int posIdx;
-        int normIdx;
-    };
+constexpr qint64 MinChunkBytes = 1 << 20; // smaller pieces are not worth a task
 
-    QVector<VertexKey> faceVertices;
-    QVector<unsigned int> faceIndices;
+// 1-based or negative OBJ index to 0-based; 0 and malformed indices give -1
+int resolveIndex(int objIndex, int count, bool &relative)
+{
+    relative = objIndex < 0;
+    return objIndex > 0 ? objIndex - 1 : objIndex < 0 ? count + objIndex : -1;
+}
+
+void parseChunk(const char *data, const char *dataEnd, ObjChunk &chunk)
+{
+    QVector<int> polyIndices; // reused by every face
 
-    QTextStream in(&file);
-    while (!in.atEnd()) {
-        QString line = in.readLine().trimmed();
-        if (line.startsWith('#') || line.isEmpty())
+    for (const char *line = data; line < dataEnd;) {
+        const char *lineEnd = static_cast<const char *>(std::memchr(line, '\n', dataEnd - line));
+        if (!lineEnd) lineEnd = dataEnd;
+        const char *p = line;
+        line = lineEnd + 1;
+
+        const char *tok, *tokEnd;
+        if (!nextToken(p, lineEnd, tok, tokEnd) || *tok == '#')
             continue;
 
-        QStringList parts = line.split(' ', Qt::SkipEmptyParts);
-        if (parts.isEmpty()) continue;
-
-        if (parts[0] == "v" && parts.size() >= 4) {
-            positions.append(QVector3D(
-                parts[1].toFloat(),
-                parts[2].toFloat(),
-                parts[3].toFloat()));
-        } else if (parts[0] == "vn" && parts.size() >= 4) {
-            normals.append(QVector3D(
-                parts[1].toFloat(),
-                parts[2].toFloat(),
-                parts[3].toFloat()));
-        } else if (parts[0] == "f") {
-            QVector<int> polyIndices;
-            for (int i = 1; i < parts.size(); ++i) {
-                QStringList sub = parts[i].split('/');
-                int pi = sub[0].toInt() - 1;
+        if (tokenIs(tok, tokEnd, "v") || tokenIs(tok, tokEnd, "vn")) {
+            const bool normal = tokEnd - tok == 2;
+            float xyz[3];
+            int n = 0;
+            for (; n < 3 && nextToken(p, lineEnd, tok, tokEnd); ++n)
+                xyz[n] = parseFloat(tok, tokEnd);
+            if (n < 3) continue;
+            (normal ? chunk.normals : chunk.positions).append(QVector3D(xyz[0], xyz[1], xyz[2]));
+        } else if (tokenIs(tok, tokEnd, "f")) {
+            polyIndices.clear();
+            while (nextToken(p, lineEnd, tok, tokEnd)) {
+                // v, v/vt, v//vn or v/vt/vn
+                const int idx = chunk.corners.size();
+                bool relative;
+                const char *slash1 = static_cast<const char *>(std::memchr(tok, '/', tokEnd - tok));
+                int pi = resolveIndex(parseInt(tok, slash1 ? slash1 : tokEnd), chunk.positions.size(), relative);
+                if (relative) chunk.relativePos.append(idx);
                 int ni = -1;
-                if (sub.size() >= 3 && !sub[2].isEmpty())
-                    ni = sub[2].toInt() - 1;
+                if (slash1) {
+                    const char *slash2 = static_cast<const char *>(
+                        std::memchr(slash1 + 1, '/', tokEnd - slash1 - 1));
+                    if (slash2 && slash2 + 1 < tokEnd) {
+                        const char *normEnd = static_cast<const char *>(
+                            std::memchr(slash2 + 1, '/', tokEnd - slash2 - 1));
+                        ni = resolveIndex(parseInt(slash2 + 1, normEnd ? normEnd : tokEnd),
+                                          chunk.normals.size(), relative);
+                        if (relative) chunk.relativeNorm.append(idx);
+                    }
+                }
 
-                // find or create vertex
-                int idx = faceVertices.size();
-                faceVertices.append({pi, ni});
+                // one corner per face vertex; shared vertices are merged after parsing
+                chunk.corners.append({pi, ni});
                 polyIndices.append(idx);
             }
             // triangulate polygon (fan)
             for (int i = 1; i + 1 < polyIndices.size(); ++i) {
-                faceIndices.append(polyIndices[0]);
-                faceIndices.append(polyIndices[i]);
-                faceIndices.append(polyIndices[i + 1]);
+                chunk.indices.append(polyIndices[0]);
+                chunk.indices.append(polyIndices[i]);
+                chunk.indices.append(polyIndices[i + 1]);
             }
         }
     }
+}
+
+// Runs fn(begin, end) over blocks of [0, count), in parallel when a pool is given
+template <typename Fn>
+void forBlocks(ThreadPool *pool, int count, Fn fn)
+{
+    const int blockSize = 1 << 16;
+    int blocks = (count + blockSize - 1) / blockSize;
+    if (!pool || blocks < 2) {
+        fn(0, count);
+        return;
+    }
+    pool->parallelFor(blocks, [&](int b, int) {
+        fn(b * blockSize, std::min(count, (b + 1) * blockSize));
+    });
+}
+
+} // namespace
+
+bool ObjLoader::load(const QString &path, Mesh &mesh, ThreadPool *pool)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        qWarning() << "Cannot open OBJ file:" << path;
+        return false;
+    }
 
-    mesh.vertices.resize(faceVertices.size());
-    mesh.normals.resize(faceVertices.size());
-
-    for (int i = 0; i < faceVertices.size(); ++i) {
-        const auto &v = faceVertices[i];
-        mesh.vertices[i] = (v.posIdx >= 0 && v.posIdx < positions.size())
-                               ? positions[v.posIdx]
-                               : QVector3D();
-        if (v.normIdx >= 0 && v.normIdx < normals.size()) {
-            mesh.normals[i] = normals[v.normIdx];
-        } else {
-            mesh.normals[i] = QVector3D(0, 1, 0);
+    // Parsed in place from the mapped file; read into memory where it cannot be mapped
+    qint64 fileSize = file.size();
+    const char *data = nullptr;
+    QByteArray contents;
+    if (fileSize > 0) {
+        data = reinterpret_cast<const char *>(file.map(0, fileSize));
+        if (!data) {
+            contents = file.readAll();
+            data = contents.constData();
+            fileSize = contents.size();
         }
     }
 
-    mesh.indices.resize(faceIndices.size());
-    for (int i = 0; i < faceIndices.size(); ++i)
-        mesh.indices[i] = faceIndices[i];
+    // Chunk boundaries sit just past a newline, so no record is cut in two
+    const int chunkCount = pool ? int(std::clamp<qint64>(fileSize / MinChunkBytes, 1,
+                                                         pool->threadCount() * 4)) : 1;
+    std::vector<const char *> bounds(chunkCount + 1, data + fileSize);
+    bounds[0] = data;
+    for (int c = 1; c < chunkCount; ++c) {
+        const char *p = std::max(bounds[c - 1], data + fileSize * c / chunkCount);
+        const char *nl = static_cast<const char *>(std::memchr(p, '\n', data + fileSize - p));
+        bounds[c] = nl ? nl + 1 : data + fileSize;
+    }
+
+    std::vector<ObjChunk> chunks(chunkCount);
+    if (chunkCount > 1)
+        pool->parallelFor(chunkCount, [&](int c, int) { parseChunk(bounds[c], bounds[c + 1], chunks[c]); });
+    else
+        parseChunk(bounds[0], bounds[1], chunks[0]);
+
+    QVector<QVector3D> positions;
+    QVector<QVector3D> normals;
+    QVector<VertexKey> faceVertices;
+    QVector<unsigned int> faceIndices;
+    if (chunkCount == 1) {
+        positions = std::move(chunks[0].positions);
+        normals = std::move(chunks[0].normals);
+        faceVertices = std::move(chunks[0].corners);
+        faceIndices = std::move(chunks[0].indices);
+    } else {
+        // Concatenate in file order. OBJ indices are global, so only the
+        // relative ones and the face indices into the corners move.
+        struct Offsets {
+            int positions = 0, normals = 0, corners = 0, indices = 0;
+        };
+        std::vector<Offsets> offsets(chunkCount + 1);
+        for (int c = 0; c < chunkCount; ++c) {
+            offsets[c + 1].positions = offsets[c].positions + chunks[c].positions.size();
+            offsets[c + 1].normals = offsets[c].normals + chunks[c].normals.size();
+            offsets[c + 1].corners = offsets[c].corners + chunks[c].corners.size();
+            offsets[c + 1].indices = offsets[c].indices + chunks[c].indices.size();
+        }
+        positions.resize(offsets[chunkCount].positions);
+        normals.resize(offsets[chunkCount].normals);
+        faceVertices.resize(offsets[chunkCount].corners);
+        faceIndices.resize(offsets[chunkCount].indices);
+
+        pool->parallelFor(chunkCount, [&](int c, int) {
+            ObjChunk &chunk = chunks[c];
+            const Offsets &o = offsets[c];
+            for (int i : chunk.relativePos)
+                chunk.corners[i].posIdx += o.positions;
+            for (int i : chunk.relativeNorm)
+                chunk.corners[i].normIdx += o.normals;
+            std::copy(chunk.positions.begin(), chunk.positions.end(), positions.begin() + o.positions);
+            std::copy(chunk.normals.begin(), chunk.normals.end(), normals.begin() + o.normals);
+            std::copy(chunk.corners.begin(), chunk.corners.end(), faceVertices.begin() + o.corners);
+            for (int i = 0; i < chunk.indices.size(); ++i)
+                faceIndices[o.indices + i] = chunk.indices[i] + o.corners;
+            chunk = ObjChunk();
+        });
+    }
+    chunks = std::vector<ObjChunk>();
+
+    // Corners with the same position and normal become one vertex, numbered in
+    // order of first use. Every position heads a list of its vertices (one per
+    // distinct normal, so usually a single entry), which makes the lookup a
+    // direct index instead of a hash probe. Without normals in the file each
+    // corner gets its face normal below, so corners stay separate.
+    QVector<VertexKey> vertexKeys;
+    if (!normals.isEmpty()) {
+        std::vector<int> head(size_t(positions.size()) + 1, -1); // [0]: invalid positions
+        std::vector<int> next;
+        QVector<int> cornerVertex(faceVertices.size());
+        for (int i = 0; i < faceVertices.size(); ++i) {
+            VertexKey key = faceVertices[i];
+            if (key.posIdx < 0 || key.posIdx >= positions.size()) key.posIdx = -1;
+            if (key.normIdx < 0 || key.normIdx >= normals.size()) key.normIdx = -1;
+            int &first = head[size_t(key.posIdx) + 1];
+            int v = first;
+            while (v >= 0 && vertexKeys[v].normIdx != key.normIdx)
+                v = next[v];
+            if (v < 0) {
+                v = vertexKeys.size();
+                vertexKeys.append(key);
+                next.push_back(first);
+                first = v;
+            }
+            cornerVertex[i] = v;
+        }
+        faceVertices = QVector<VertexKey>();
+        forBlocks(pool, faceIndices.size(), [&](int begin, int end) {
+            for (int i = begin; i < end; ++i)
+                faceIndices[i] = cornerVertex[faceIndices[i]];
+        });
+    } else {
+        vertexKeys = std::move(faceVertices);
+    }
+
+    mesh.vertices.resize(vertexKeys.size());
+    mesh.normals.resize(vertexKeys.size());
+
+    forBlocks(pool, vertexKeys.size(), [&](int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+            const auto &v = vertexKeys[i];
+            mesh.vertices[i] = (v.posIdx >= 0 && v.posIdx < positions.size())
+                                   ? positions[v.posIdx]
+                                   : QVector3D();
+            if (v.normIdx >= 0 && v.normIdx < normals.size()) {
+                mesh.normals[i] = normals[v.normIdx];
+            } else {
+                mesh.normals[i] = QVector3D(0, 1, 0);
+            }
+        }
+    });
+
+    mesh.indices = std::move(faceIndices);
 
     // compute normals if missing
     if (normals.isEmpty()) {
@@ -96,8 +376,12 @@ bool ObjLoader::load(const QString &path, Mesh &mesh)
         }
     }
 
+    qint64 ms = timer.elapsed();
     qDebug() << "Loaded OBJ:" << path
              << "verts:" << mesh.vertices.size()
-             << "tris:" << mesh.indices.size() / 3;
+             << "tris:" << mesh.indices.size() / 3
+             << "in" << ms << "ms"
+             << "(" << (ms > 0 ? fileSize / 1000.0 / ms : 0.0) << "MB/s,"
+             << chunkCount << (chunkCount == 1 ? "chunk)" : "chunks)");
     return true;
-}
\ No newline at end of file
+}
@@ -3,14 +3,28 @@
 #include <QString>
 #include <QVector>
 #include <QVector3D>
+#include <memory>
+
+class QFile;
 
 struct Mesh {
     QVector<QVector3D> vertices;
     QVector<QVector3D> normals;
     QVector<unsigned int> indices;
+    // Set when the arrays are raw views of a mapped cache file (MeshCache)
+    std::shared_ptr<QFile> mapping;
 };
 
+class ThreadPool;
+
 class ObjLoader {
 public:
-    static bool load(const QString &path, Mesh &mesh);
+    // Reads v, vn and f records; polygons are fan-triangulated and negative
+    // (relative) indices resolved. Face corners that share a position and a
+    // normal share a vertex; files without normals get flat face normals and
+    // one vertex per corner. The file is memory-mapped and parsed in
+    // place, without per-line allocations. With a pool, newline-aligned chunks
+    // of the file are parsed in parallel and merged in file order; the mesh is
+    // the same either way.
+    static bool load(const QString &path, Mesh &mesh, ThreadPool *pool = nullptr);
 };
\ No newline at end of file
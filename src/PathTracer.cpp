@@ -1,21 +1,11 @@
 #include "PathTracer.h"
+#include "Denoiser.h"
+#include "SceneBVH.h"
+#include "ThreadPool.h"
 #include <QFile>
 #include <QDebug>
+#include <QElapsedTimer>
 #include <algorithm>
-#include <numeric>
-#include <functional>
-
-// GPU triangle: 3 vertices + 3 normals + material index, padded to std430
-struct GPUTriangle {
-    float v0[3], pad0;
-    float v1[3], pad1;
-    float v2[3], pad2;
-    float n0[3], pad3;
-    float n1[3], pad4;
-    float n2[3], pad5;
-    int materialIndex;
-    int _pad[3];
-};
 
 struct GPUMaterial {
     float color[3];
@@ -24,6 +14,25 @@ struct GPUMaterial {
     float _pad[3];
 };
 
+// Scene light quad, same fields as AreaLight in CpuRenderer.h
+struct GPULight {
+    float corner[3], selectPdf;
+    float edge1[3], cdf;
+    float edge2[3], area;
+    float normal[3], pad0;
+    float emission[3], pad1;
+};
+
+// Object placement for the TLAS; matrices are column-major like GLSL's mat4
+struct GPUInstance {
+    float worldToObject[16];
+    float normalToWorld[16]; // inverse transpose of the object-to-world matrix
+    int nodeOffset;          // root of the mesh's BLAS in the node buffer
+    int triOffset;           // first triangle of the mesh in the triangle buffer
+    int materialIndex;
+    int _pad;
+};
+
 void PathTracer::init(QOpenGLFunctions_4_3_Core *gl)
 {
     m_gl = gl;
@@ -40,6 +49,18 @@ void PathTracer::init(QOpenGLFunctions_4_3_Core *gl)
             qWarning() << "Compute program link error:" << m_computeProgram->log();
     }
 
+    // --- Denoise shader ---
+    m_denoiseProgram = new QOpenGLShaderProgram();
+    {
+        QFile f(":/shaders/denoise.comp");
+        f.open(QIODevice::ReadOnly);
+        QString src = f.readAll();
+        if (!m_denoiseProgram->addShaderFromSourceCode(QOpenGLShader::Compute, src))
+            qWarning() << "Denoise shader compile error:" << m_denoiseProgram->log();
+        if (!m_denoiseProgram->link())
+            qWarning() << "Denoise program link error:" << m_denoiseProgram->log();
+    }
+
     // --- Tonemap shader ---
     m_tonemapProgram = new QOpenGLShaderProgram();
     {
@@ -76,14 +97,29 @@ void PathTracer::init(QOpenGLFunctions_4_3_Core *gl)
     m_gl->glGenBuffers(1, &m_triangleSSBO);
     m_gl->glGenBuffers(1, &m_materialSSBO);
     m_gl->glGenBuffers(1, &m_bvhSSBO);
+    m_gl->glGenBuffers(1, &m_tlasSSBO);
+    m_gl->glGenBuffers(1, &m_instanceSSBO);
+    m_gl->glGenBuffers(1, &m_blueNoiseSSBO);
+    m_gl->glGenBuffers(1, &m_lightSSBO);
+
+    // Blue-noise tile shared with the CPU sampler
+    m_gl->glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_blueNoiseSSBO);
+    m_gl->glBufferData(GL_SHADER_STORAGE_BUFFER,
+                       Sampler::BlueNoiseSize * Sampler::BlueNoiseSize * sizeof(float),
+                       Sampler::blueNoiseTexture(), GL_STATIC_DRAW);
 
-    // output texture
+    // output, feature and denoise textures
     m_gl->glGenTextures(1, &m_outputTexture);
-    m_gl->glBindTexture(GL_TEXTURE_2D, m_outputTexture);
-    m_gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    m_gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    m_gl->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, m_width, m_height, 0,
-                       GL_RGBA, GL_FLOAT, nullptr);
+    m_gl->glGenTextures(1, &m_albedoTexture);
+    m_gl->glGenTextures(1, &m_normalDepthTexture);
+    m_gl->glGenTextures(2, m_denoiseTextures);
+    for (GLuint tex : {m_outputTexture, m_denoiseTextures[0], m_denoiseTextures[1]}) {
+        m_gl->glBindTexture(GL_TEXTURE_2D, tex);
+        m_gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        m_gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    }
+    allocateTextures();
+    m_displayTexture = m_outputTexture;
 
     m_initialized = true;
 }
@@ -92,13 +128,25 @@ void PathTracer::destroy()
 {
     if (!m_initialized) return;
     delete m_computeProgram;
+    delete m_denoiseProgram;
     delete m_tonemapProgram;
     m_quadVBO.destroy();
     m_quadVAO.destroy();
     m_gl->glDeleteTextures(1, &m_outputTexture);
+    m_gl->glDeleteTextures(1, &m_albedoTexture);
+    m_gl->glDeleteTextures(1, &m_normalDepthTexture);
+    m_gl->glDeleteTextures(2, m_denoiseTextures);
     m_gl->glDeleteBuffers(1, &m_triangleSSBO);
     m_gl->glDeleteBuffers(1, &m_materialSSBO);
     m_gl->glDeleteBuffers(1, &m_bvhSSBO);
+    m_gl->glDeleteBuffers(1, &m_tlasSSBO);
+    m_gl->glDeleteBuffers(1, &m_instanceSSBO);
+    m_gl->glDeleteBuffers(1, &m_blueNoiseSSBO);
+    m_gl->glDeleteBuffers(1, &m_lightSSBO);
+    m_blas.clear();
+    m_blasDirty = true;
+    m_tlas = BVHBuilder::Result();
+    m_tlasMeshes.clear();
     m_initialized = false;
 }
 
@@ -106,26 +154,77 @@ void PathTracer::resize(int w, int h)
 {
     m_width = w;
     m_height = h;
-    if (m_initialized) {
-        m_gl->glBindTexture(GL_TEXTURE_2D, m_outputTexture);
-        m_gl->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, w, h, 0,
+    if (m_initialized)
+        allocateTextures();
+}
+
+void PathTracer::allocateTextures()
+{
+    auto allocate = [this](GLuint tex, GLenum format) {
+        m_gl->glBindTexture(GL_TEXTURE_2D, tex);
+        m_gl->glTexImage2D(GL_TEXTURE_2D, 0, format, m_width, m_height, 0,
                            GL_RGBA, GL_FLOAT, nullptr);
+    };
+    allocate(m_outputTexture, GL_RGBA32F);
+    allocate(m_albedoTexture, GL_RGBA16F);
+    allocate(m_normalDepthTexture, GL_RGBA32F);
+    allocate(m_denoiseTextures[0], GL_RGBA32F);
+    allocate(m_denoiseTextures[1], GL_RGBA32F);
+}
+
+PathTracer::PathTracer() = default;
+PathTracer::~PathTracer() = default;
+
+QVector<PathTracer::BVHNode> PathTracer::toGPUNodes(const std::vector<::BVHNode> &nodes)
+{
+    QVector<BVHNode> out;
+    out.reserve(int(nodes.size()));
+    for (const ::BVHNode &n : nodes) {
+        BVHNode node;
+        node.minX = n.box.mn.x(); node.minY = n.box.mn.y(); node.minZ = n.box.mn.z();
+        node.maxX = n.box.mx.x(); node.maxY = n.box.mx.y(); node.maxZ = n.box.mx.z();
+        if (n.isLeaf()) {
+            node.leftOrStart = n.triStart;
+            node.rightOrCount = n.triCount;
+        } else {
+            node.leftOrStart = n.left;
+            node.rightOrCount = -(n.right + 1); // negative means interior
+        }
+        out.append(node);
     }
+    return out;
+}
+
+static void storeMatrix(float dst[16], const QMatrix4x4 &m)
+{
+    std::copy(m.constData(), m.constData() + 16, dst);
 }
 
 void PathTracer::buildBVH(const Scene &scene)
 {
-    // Collect all triangle centroids for a simple SAH-less BVH (midpoint split)
-    struct TriRef {
-        int globalIdx;
-        QVector3D centroid;
-    };
+    QElapsedTimer timer;
+    timer.start();
+
+    // Meshes no object holds any more leave the packed buffers
+    for (auto it = m_blas.begin(); it != m_blas.end();) {
+        if (it->second.mesh.expired()) {
+            it = m_blas.erase(it);
+            m_blasDirty = true;
+        } else {
+            ++it;
+        }
+    }
 
-    // First build flat triangle list
-    QVector<GPUTriangle> allTris;
-    int matIdx = 0;
+    // Same binned SAH tree as the CPU renderer, once per mesh
+    int built = 0;
     for (const auto &obj : scene.objects()) {
-        const Mesh &m = obj->mesh();
+        std::shared_ptr<const Mesh> mesh = obj->sharedMesh();
+        if (mesh->indices.isEmpty() || m_blas.count(mesh.get())) continue;
+        if (!m_pool) m_pool = std::make_unique<ThreadPool>();
+
+        const Mesh &m = *mesh;
+        QVector<GPUTriangle> tris;
+        std::vector<AABB> bounds;
         for (int i = 0; i + 2 < m.indices.size(); i += 3) {
             GPUTriangle t{};
             auto store = [](float dst[3], const QVector3D &v) {
@@ -137,106 +236,110 @@ void PathTracer::buildBVH(const Scene &scene)
             store(t.n0, m.normals[m.indices[i]]);
             store(t.n1, m.normals[m.indices[i+1]]);
             store(t.n2, m.normals[m.indices[i+2]]);
-            t.materialIndex = matIdx;
-            allTris.append(t);
+            tris.append(t);
+
+            AABB box;
+            box.expand(m.vertices[m.indices[i]]);
+            box.expand(m.vertices[m.indices[i+1]]);
+            box.expand(m.vertices[m.indices[i+2]]);
+            bounds.push_back(box);
         }
-        matIdx++;
-    }
 
-    m_totalTriangles = allTris.size();
-
-    // Build references
-    QVector<TriRef> refs(m_totalTriangles);
-    for (int i = 0; i < m_totalTriangles; ++i) {
-        refs[i].globalIdx = i;
-        const auto &t = allTris[i];
-        refs[i].centroid = QVector3D(
-            (t.v0[0] + t.v1[0] + t.v2[0]) / 3.0f,
-            (t.v0[1] + t.v1[1] + t.v2[1]) / 3.0f,
-            (t.v0[2] + t.v1[2] + t.v2[2]) / 3.0f);
+        BVHBuilder::Result tree = BVHBuilder::build(bounds, BVHBuildSettings(), m_pool.get());
+        MeshBLAS &blas = m_blas[mesh.get()];
+        blas.mesh = mesh;
+        blas.nodes = toGPUNodes(tree.nodes);
+        blas.bounds = tree.nodes[0].box;
+        blas.triangles.resize(tris.size());
+        for (int i = 0; i < tris.size(); ++i)
+            blas.triangles[i] = tris[tree.primOrder[i]];
+        m_blasDirty = true;
+        ++built;
+    }
+    if (m_blasDirty)
+        uploadBLAS();
+
+    // Top level over every object. Objects move freely, so while the objects
+    // keep their meshes the last tree is refit and only rebuilt once it degrades
+    std::vector<AABB> instanceBounds;
+    std::vector<const Mesh *> instanceMeshes;
+    QVector<GPUInstance> instances;
+    const auto &objects = scene.objects();
+    for (int i = 0; i < objects.size(); ++i) {
+        auto it = m_blas.find(objects[i]->sharedMesh().get());
+        if (it == m_blas.end()) continue;
+        const MeshBLAS &blas = it->second;
+
+        QMatrix4x4 objectToWorld = objects[i]->transform();
+        QMatrix4x4 worldToObject = objectToWorld.inverted();
+        GPUInstance inst{};
+        storeMatrix(inst.worldToObject, worldToObject);
+        storeMatrix(inst.normalToWorld, worldToObject.transposed());
+        inst.nodeOffset = blas.nodeOffset;
+        inst.triOffset = blas.triOffset;
+        inst.materialIndex = i;
+        instances.append(inst);
+        instanceBounds.push_back(transformBounds(blas.bounds, objectToWorld));
+        instanceMeshes.push_back(it->first);
     }
 
-    m_bvhNodes.clear();
-    m_bvhNodes.reserve(2 * m_totalTriangles);
-
-    // Reorder triangles in-place according to BVH build
-    QVector<GPUTriangle> orderedTris(m_totalTriangles);
-    int orderedCount = 0;
-
-    // Recursive BVH build using lambda
-    std::function<int(int, int)> buildNode = [&](int start, int end) -> int {
-        int nodeIdx = m_bvhNodes.size();
-        m_bvhNodes.append(BVHNode{});
-
-        // compute bounds
-        float minX = 1e30f, minY = 1e30f, minZ = 1e30f;
-        float maxX = -1e30f, maxY = -1e30f, maxZ = -1e30f;
-        for (int i = start; i < end; ++i) {
-            const auto &t = allTris[refs[i].globalIdx];
-            for (const float *v : {t.v0, t.v1, t.v2}) {
-                minX = std::min(minX, v[0]); maxX = std::max(maxX, v[0]);
-                minY = std::min(minY, v[1]); maxY = std::max(maxY, v[1]);
-                minZ = std::min(minZ, v[2]); maxZ = std::max(maxZ, v[2]);
-            }
-        }
-
-        m_bvhNodes[nodeIdx].minX = minX;
-        m_bvhNodes[nodeIdx].minY = minY;
-        m_bvhNodes[nodeIdx].minZ = minZ;
-        m_bvhNodes[nodeIdx].maxX = maxX;
-        m_bvhNodes[nodeIdx].maxY = maxY;
-        m_bvhNodes[nodeIdx].maxZ = maxZ;
-
-        int count = end - start;
-        if (count <= 4) {
-            // leaf
-            int triStart = orderedCount;
-            for (int i = start; i < end; ++i) {
-                orderedTris[orderedCount++] = allTris[refs[i].globalIdx];
-            }
-            m_bvhNodes[nodeIdx].leftOrStart = triStart;
-            m_bvhNodes[nodeIdx].rightOrCount = count;
-            return nodeIdx;
-        }
+    BVHBuildSettings tlasSettings;
+    tlasSettings.maxLeafSize = 1;
+    bool refit = !m_tlas.nodes.empty() && instanceMeshes == m_tlasMeshes;
+    if (refit) {
+        BVHBuilder::refit(m_tlas.nodes, m_tlas.primOrder, instanceBounds);
+        refit = BVHBuilder::sahCost(m_tlas.nodes, tlasSettings)
+                <= m_tlasBuiltCost * tlasSettings.refitRebuildRatio;
+    }
+    if (!refit) {
+        m_tlas = BVHBuilder::build(instanceBounds, tlasSettings);
+        m_tlasMeshes = std::move(instanceMeshes);
+        m_tlasBuiltCost = m_tlas.nodes.empty() ? 0.0f : BVHBuilder::sahCost(m_tlas.nodes, tlasSettings);
+    }
 
-        // split along longest axis
-        float extX = maxX - minX, extY = maxY - minY, extZ = maxZ - minZ;
-        int axis = 0;
-        if (extY > extX && extY > extZ) axis = 1;
-        else if (extZ > extX && extZ > extY) axis = 2;
-
-        int mid = (start + end) / 2;
-        std::nth_element(refs.begin() + start, refs.begin() + mid, refs.begin() + end,
-                         [axis](const TriRef &a, const TriRef &b) {
-                             return a.centroid[axis] < b.centroid[axis];
-                         });
-
-        m_bvhNodes[nodeIdx].leftOrStart = buildNode(start, mid);
-        m_bvhNodes[nodeIdx].rightOrCount = buildNode(mid, end);
-        // mark as interior: negative count — we'll use a flag: if rightOrCount >= 0
-        // Actually we use a convention: leaf has leftOrStart >= 0 and rightOrCount > 0 but
-        // interior also has positive values. We need a separate flag.
-        // Convention: if rightOrCount < 0, it's interior with right child = -rightOrCount - 1
-        // Wait, let's use a simpler scheme:
-        // For leaf: rightOrCount > 0 means leaf, leftOrStart = first tri index
-        // For interior: rightOrCount <= 0 means interior node, leftOrStart = left child,
-        //   rightOrCount = -(right child + 1)
-        // Let's fix:
-        int left = m_bvhNodes[nodeIdx].leftOrStart;
-        int right = m_bvhNodes[nodeIdx].rightOrCount;
-        m_bvhNodes[nodeIdx].leftOrStart = left;
-        m_bvhNodes[nodeIdx].rightOrCount = -(right + 1); // negative means interior
-        return nodeIdx;
-    };
+    QVector<BVHNode> tlasNodes = toGPUNodes(m_tlas.nodes);
+    QVector<GPUInstance> orderedInstances;
+    orderedInstances.reserve(instances.size());
+    for (int prim : m_tlas.primOrder)
+        orderedInstances.append(instances[prim]);
+    m_numInstances = orderedInstances.size();
+
+    qDebug() << "GPU BVH" << (refit ? "refit" : "build") << "time:" << timer.elapsed() << "ms,"
+             << built << "new meshes," << m_numInstances << "instances of" << m_blas.size() << "meshes";
+
+    // Zero-size SSBOs are not bindable, keep one dummy entry
+    if (tlasNodes.isEmpty()) tlasNodes.append(BVHNode{});
+    if (orderedInstances.isEmpty()) orderedInstances.append(GPUInstance{});
+    m_gl->glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_tlasSSBO);
+    m_gl->glBufferData(GL_SHADER_STORAGE_BUFFER, tlasNodes.size() * sizeof(BVHNode),
+                       tlasNodes.constData(), GL_DYNAMIC_DRAW);
+    m_gl->glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_instanceSSBO);
+    m_gl->glBufferData(GL_SHADER_STORAGE_BUFFER, orderedInstances.size() * sizeof(GPUInstance),
+                       orderedInstances.constData(), GL_DYNAMIC_DRAW);
+}
 
-    if (m_totalTriangles > 0)
-        buildNode(0, m_totalTriangles);
+void PathTracer::uploadBLAS()
+{
+    QVector<GPUTriangle> tris;
+    QVector<BVHNode> nodes;
+    for (auto &entry : m_blas) {
+        MeshBLAS &blas = entry.second;
+        blas.nodeOffset = nodes.size();
+        blas.triOffset = tris.size();
+        nodes += blas.nodes;
+        tris += blas.triangles;
+    }
+    m_totalTriangles = tris.size();
 
-    // Upload ordered triangles
+    if (tris.isEmpty()) tris.append(GPUTriangle{});
+    if (nodes.isEmpty()) nodes.append(BVHNode{});
     m_gl->glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_triangleSSBO);
-    m_gl->glBufferData(GL_SHADER_STORAGE_BUFFER,
-                       orderedCount * sizeof(GPUTriangle),
-                       orderedTris.constData(), GL_STATIC_DRAW);
+    m_gl->glBufferData(GL_SHADER_STORAGE_BUFFER, tris.size() * sizeof(GPUTriangle),
+                       tris.constData(), GL_STATIC_DRAW);
+    m_gl->glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_bvhSSBO);
+    m_gl->glBufferData(GL_SHADER_STORAGE_BUFFER, nodes.size() * sizeof(BVHNode),
+                       nodes.constData(), GL_STATIC_DRAW);
+    m_blasDirty = false;
 }
 
 void PathTracer::uploadSceneData(const Scene &scene)
@@ -260,14 +363,47 @@ void PathTracer::uploadSceneData(const Scene &scene)
                        mats.size() * sizeof(GPUMaterial),
                        mats.constData(), GL_STATIC_DRAW);
 
-    // BVH nodes
-    m_gl->glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_bvhSSBO);
+    // Lights, with a power-proportional selection CDF
+    auto store = [](float dst[3], const QVector3D &v) {
+        dst[0] = v.x(); dst[1] = v.y(); dst[2] = v.z();
+    };
+    QVector<GPULight> lights;
+    float totalPower = 0.0f;
+    for (const auto &light : scene.lights()) {
+        QVector3D v0, v1, v2, v3;
+        light.getCorners(v0, v1, v2, v3);
+        QVector3D emission = light.color * light.intensity;
+
+        GPULight l{};
+        store(l.corner, v0);
+        store(l.edge1, v1 - v0);
+        store(l.edge2, v3 - v0);
+        store(l.normal, light.normal());
+        store(l.emission, emission);
+        l.area = QVector3D::crossProduct(v1 - v0, v3 - v0).length();
+        l.selectPdf = (0.2126f * emission.x() + 0.7152f * emission.y() + 0.0722f * emission.z()) * l.area;
+        totalPower += l.selectPdf;
+        lights.append(l);
+    }
+    float cdf = 0.0f;
+    for (auto &l : lights) {
+        l.selectPdf = totalPower > 0.0f ? l.selectPdf / totalPower : 1.0f / lights.size();
+        cdf += l.selectPdf;
+        l.cdf = cdf;
+    }
+    if (!lights.isEmpty()) lights.back().cdf = 1.0f;
+    m_numLights = lights.size();
+
+    // Zero-size SSBOs are not bindable, keep one dummy entry
+    if (lights.isEmpty()) lights.append(GPULight{});
+    m_gl->glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_lightSSBO);
     m_gl->glBufferData(GL_SHADER_STORAGE_BUFFER,
-                       m_bvhNodes.size() * sizeof(BVHNode),
-                       m_bvhNodes.constData(), GL_STATIC_DRAW);
+                       lights.size() * sizeof(GPULight),
+                       lights.constData(), GL_STATIC_DRAW);
 }
 
-void PathTracer::render(const Scene &scene, int width, int height, int samplesPerPixel)
+void PathTracer::render(const Scene &scene, int width, int height, int samplesPerPixel,
+                        SamplerType sampler, bool denoise)
 {
     if (!m_initialized) return;
 
@@ -277,13 +413,19 @@ void PathTracer::render(const Scene &scene, int width, int height, int samplesPe
 
     m_computeProgram->bind();
 
-    // Bind output image
+    // Bind output and feature images
     m_gl->glBindImageTexture(0, m_outputTexture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+    m_gl->glBindImageTexture(1, m_albedoTexture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA16F);
+    m_gl->glBindImageTexture(2, m_normalDepthTexture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
 
     // Bind SSBOs
     m_gl->glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, m_triangleSSBO);
     m_gl->glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, m_materialSSBO);
     m_gl->glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, m_bvhSSBO);
+    m_gl->glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, m_blueNoiseSSBO);
+    m_gl->glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, m_lightSSBO);
+    m_gl->glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, m_tlasSSBO);
+    m_gl->glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, m_instanceSSBO);
 
     // Uniforms
     const Camera &cam = scene.camera();
@@ -297,8 +439,10 @@ void PathTracer::render(const Scene &scene, int width, int height, int samplesPe
     m_computeProgram->setUniformValue("u_fov", cam.fov());
     m_computeProgram->setUniformValue("u_samples", samplesPerPixel);
     m_computeProgram->setUniformValue("u_numTriangles", m_totalTriangles);
-    m_computeProgram->setUniformValue("u_numBVHNodes", (int)m_bvhNodes.size());
+    m_computeProgram->setUniformValue("u_numInstances", m_numInstances);
+    m_computeProgram->setUniformValue("u_numLights", m_numLights);
     m_computeProgram->setUniformValue("u_seed", (float)(rand() % 10000));
+    m_computeProgram->setUniformValue("u_sampler", int(sampler));
 
     // Dispatch
     int groupX = (m_width + 15) / 16;
@@ -307,6 +451,38 @@ void PathTracer::render(const Scene &scene, int width, int height, int samplesPe
     m_gl->glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
 
     m_computeProgram->release();
+
+    m_displayTexture = denoise ? runDenoise() : m_outputTexture;
+}
+
+GLuint PathTracer::runDenoise()
+{
+    // Same filter and defaults as the CPU Denoiser
+    const DenoiseSettings settings;
+
+    m_denoiseProgram->bind();
+    m_gl->glBindImageTexture(1, m_albedoTexture, 0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA16F);
+    m_gl->glBindImageTexture(2, m_normalDepthTexture, 0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
+    m_denoiseProgram->setUniformValue("u_depthSigma", settings.depthSigma);
+
+    GLuint input = m_outputTexture;
+    float colorSigma = settings.colorSigma;
+    for (int it = 0, step = 1; it < settings.iterations; ++it, step *= 2) {
+        GLuint output = m_denoiseTextures[it & 1];
+        m_gl->glBindImageTexture(0, input, 0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
+        m_gl->glBindImageTexture(3, output, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+        m_denoiseProgram->setUniformValue("u_step", step);
+        m_denoiseProgram->setUniformValue("u_colorSigma", colorSigma);
+
+        m_gl->glDispatchCompute((m_width + 15) / 16, (m_height + 15) / 16, 1);
+        m_gl->glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+
+        input = output;
+        colorSigma *= 0.5f;
+    }
+
+    m_denoiseProgram->release();
+    return input;
 }
 
 void PathTracer::displayResult()
@@ -317,7 +493,7 @@ void PathTracer::displayResult()
 
     m_tonemapProgram->bind();
     m_gl->glActiveTexture(GL_TEXTURE0);
-    m_gl->glBindTexture(GL_TEXTURE_2D, m_outputTexture);
+    m_gl->glBindTexture(GL_TEXTURE_2D, m_displayTexture);
     m_tonemapProgram->setUniformValue("u_texture", 0);
 
     m_quadVAO.bind();
@@ -4,30 +4,44 @@
 #include <QOpenGLShaderProgram>
 #include <QOpenGLBuffer>
 #include <QOpenGLVertexArrayObject>
+#include <map>
+#include <memory>
 #include "Scene.h"
+#include "Sampler.h"
+#include "BVH.h"
+
+class ThreadPool;
 
 class PathTracer {
 public:
-    PathTracer() = default;
+    PathTracer();
+    ~PathTracer();
 
     void init(QOpenGLFunctions_4_3_Core *gl);
     void destroy();
 
     void resize(int w, int h);
-    void render(const Scene &scene, int width, int height, int samplesPerPixel = 64);
+    // denoise runs the edge-aware filter (shaders/denoise.comp) on the result
+    void render(const Scene &scene, int width, int height, int samplesPerPixel = 64,
+                SamplerType sampler = SamplerType::Sobol, bool denoise = false);
     void displayResult();
 
     bool isReady() const { return m_initialized; }
 
 private:
     void uploadSceneData(const Scene &scene);
+    // Builds BLASes for new meshes and the TLAS over the objects
     void buildBVH(const Scene &scene);
+    void uploadBLAS();
+    void allocateTextures();
+    GLuint runDenoise();
 
     QOpenGLFunctions_4_3_Core *m_gl = nullptr;
     bool m_initialized = false;
 
-    // compute shader
+    // compute shaders
     QOpenGLShaderProgram *m_computeProgram = nullptr;
+    QOpenGLShaderProgram *m_denoiseProgram = nullptr;
 
     // tonemap (fullscreen quad)
     QOpenGLShaderProgram *m_tonemapProgram = nullptr;
@@ -36,14 +50,36 @@ private:
 
     // textures / buffers
     GLuint m_outputTexture = 0;
+    GLuint m_albedoTexture = 0;
+    GLuint m_normalDepthTexture = 0;
+    GLuint m_denoiseTextures[2] = {0, 0}; // A-trous ping-pong
+    GLuint m_displayTexture = 0;          // output or the last denoise target
     GLuint m_triangleSSBO = 0;
     GLuint m_materialSSBO = 0;
-    GLuint m_bvhSSBO = 0;
+    GLuint m_bvhSSBO = 0;      // every BLAS, packed
+    GLuint m_tlasSSBO = 0;
+    GLuint m_instanceSSBO = 0;
+    GLuint m_blueNoiseSSBO = 0;
+    GLuint m_lightSSBO = 0;
 
     int m_width = 800;
     int m_height = 600;
 
     int m_totalTriangles = 0;
+    int m_numInstances = 0;
+    int m_numLights = 0;
+
+    // GPU triangle: 3 vertices + 3 normals + material index, padded to std430
+    struct GPUTriangle {
+        float v0[3], pad0;
+        float v1[3], pad1;
+        float v2[3], pad2;
+        float n0[3], pad3;
+        float n1[3], pad4;
+        float n2[3], pad5;
+        int materialIndex; // unused, instances carry the material
+        int _pad[3];
+    };
 
     // BVH node on CPU for upload
     struct BVHNode {
@@ -52,5 +88,26 @@ private:
         float maxX, maxY, maxZ;
         int rightOrCount;  // if leaf: triangle count; else: right child
     };
-    QVector<BVHNode> m_bvhNodes;
+
+    // Object-space BVH of one mesh. Child and triangle indices are local; the
+    // shader adds the offsets of the mesh in the packed buffers.
+    struct MeshBLAS {
+        std::weak_ptr<const Mesh> mesh; // expired: the mesh is gone
+        QVector<GPUTriangle> triangles;
+        QVector<BVHNode> nodes;
+        AABB bounds;
+        int nodeOffset = 0;
+        int triOffset = 0;
+    };
+    std::map<const Mesh *, MeshBLAS> m_blas;
+    std::unique_ptr<ThreadPool> m_pool; // BLAS builds; started on the first one
+
+    // Shader layout of a built tree; leaves index into the builder's primOrder
+    static QVector<BVHNode> toGPUNodes(const std::vector<::BVHNode> &nodes);
+    bool m_blasDirty = true; // packed buffers need a re-upload
+
+    // Top level of the last build, refit while the objects keep their meshes
+    BVHBuilder::Result m_tlas;
+    std::vector<const Mesh *> m_tlasMeshes; // mesh of each instance, object order
+    float m_tlasBuiltCost = 0.0f;
 };
@@ -5,6 +5,7 @@
 #include <QFormLayout>
 #include <QLabel>
 #include <QInputDialog>
+#include <QThread>
 
 PropertiesPanel::PropertiesPanel(QWidget *parent) : QWidget(parent)
 {
@@ -39,12 +40,61 @@ void PropertiesPanel::buildObjectTab(QWidget *tab)
 {
     auto *layout = new QVBoxLayout(tab);
 
+    auto *objRow = new QHBoxLayout;
     m_objectCombo = new QComboBox;
-    layout->addWidget(m_objectCombo);
+    m_duplicateObjectBtn = new QPushButton("Duplicate");
+    m_duplicateObjectBtn->setToolTip("Add an instance sharing this object's mesh");
+    objRow->addWidget(m_objectCombo, 1);
+    objRow->addWidget(m_duplicateObjectBtn);
+    layout->addLayout(objRow);
 
     connect(m_objectCombo, QOverload<int>::of(&QComboBox::currentIndexChanged),
             this, &PropertiesPanel::onObjectSelected);
 
+    connect(m_duplicateObjectBtn, &QPushButton::clicked, this, [this]() {
+        if (!m_scene) return;
+        auto obj = m_scene->duplicateObject(m_objectCombo->currentIndex());
+        if (!obj) return;
+        m_objectCombo->addItem(obj->name());
+        m_objectCombo->setCurrentIndex(m_objectCombo->count() - 1);
+        emit sceneChanged();
+    });
+
+    // Transform; moving an object only rebuilds the renderers' top-level BVH
+    auto *xfGroup = new QGroupBox("Transform");
+    auto *xfLayout = new QFormLayout(xfGroup);
+    const char *axes[3] = {"X", "Y", "Z"};
+    for (int a = 0; a < 3; ++a) {
+        m_objPos[a] = new QDoubleSpinBox; m_objPos[a]->setRange(-50, 50); m_objPos[a]->setSingleStep(0.1); m_objPos[a]->setDecimals(2);
+        xfLayout->addRow(QString("Pos %1:").arg(axes[a]), m_objPos[a]);
+    }
+    for (int a = 0; a < 3; ++a) {
+        m_objRot[a] = new QDoubleSpinBox; m_objRot[a]->setRange(-180, 180); m_objRot[a]->setSingleStep(5);
+        xfLayout->addRow(QString("Rot %1:").arg(axes[a]), m_objRot[a]);
+    }
+    for (int a = 0; a < 3; ++a) {
+        m_objScale[a] = new QDoubleSpinBox; m_objScale[a]->setRange(0.01, 100); m_objScale[a]->setSingleStep(0.1); m_objScale[a]->setDecimals(2);
+        m_objScale[a]->setValue(1.0);
+        xfLayout->addRow(QString("Scale %1:").arg(axes[a]), m_objScale[a]);
+    }
+    layout->addWidget(xfGroup);
+
+    auto onTransformChanged = [this]() {
+        int idx = m_objectCombo->currentIndex();
+        if (!m_scene || idx < 0 || idx >= m_scene->objects().size()) return;
+
+        auto &obj = m_scene->objects()[idx];
+        obj->setPosition(QVector3D(m_objPos[0]->value(), m_objPos[1]->value(), m_objPos[2]->value()));
+        obj->setRotation(QVector3D(m_objRot[0]->value(), m_objRot[1]->value(), m_objRot[2]->value()));
+        obj->setScale(QVector3D(m_objScale[0]->value(), m_objScale[1]->value(), m_objScale[2]->value()));
+        emit sceneChanged();
+    };
+    for (int a = 0; a < 3; ++a) {
+        connect(m_objPos[a], QOverload<double>::of(&QDoubleSpinBox::valueChanged), this, onTransformChanged);
+        connect(m_objRot[a], QOverload<double>::of(&QDoubleSpinBox::valueChanged), this, onTransformChanged);
+        connect(m_objScale[a], QOverload<double>::of(&QDoubleSpinBox::valueChanged), this, onTransformChanged);
+    }
+
     auto *matGroup = new QGroupBox("Material");
     auto *matLayout = new QFormLayout(matGroup);
 
@@ -123,6 +173,25 @@ void PropertiesPanel::onObjectSelected(int index)
 {
     if (!m_scene || index < 0 || index >= m_scene->objects().size()) return;
     updateMaterialUI();
+    updateTransformUI();
+}
+
+void PropertiesPanel::updateTransformUI()
+{
+    int idx = m_objectCombo->currentIndex();
+    if (!m_scene || idx < 0 || idx >= m_scene->objects().size()) return;
+
+    const auto &obj = m_scene->objects()[idx];
+    QVector3D pos = obj->position(), rot = obj->rotation(), scale = obj->scale();
+    for (int a = 0; a < 3; ++a) {
+        for (QDoubleSpinBox *spin : {m_objPos[a], m_objRot[a], m_objScale[a]})
+            spin->blockSignals(true);
+        m_objPos[a]->setValue(pos[a]);
+        m_objRot[a]->setValue(rot[a]);
+        m_objScale[a]->setValue(scale[a]);
+        for (QDoubleSpinBox *spin : {m_objPos[a], m_objRot[a], m_objScale[a]})
+            spin->blockSignals(false);
+    }
 }
 
 void PropertiesPanel::updateMaterialUI()
@@ -354,6 +423,10 @@ void PropertiesPanel::buildRenderTab(QWidget *tab)
     m_viewportSamplesSpin->setRange(1, 64);
     m_viewportSamplesSpin->setValue(4);
     vpLayout->addRow("Samples:", m_viewportSamplesSpin);
+    m_viewportSamplerCombo = createSamplerCombo();
+    vpLayout->addRow("Sampler:", m_viewportSamplerCombo);
+    m_viewportDenoiseCheck = new QCheckBox;
+    vpLayout->addRow("Denoise:", m_viewportDenoiseCheck);
     layout->addWidget(vpGroup);
 
     connect(m_viewportSamplesSpin, QOverload<int>::of(&QSpinBox::valueChanged),
@@ -362,11 +435,57 @@ void PropertiesPanel::buildRenderTab(QWidget *tab)
     auto *renderGroup = new QGroupBox("Render Output");
     auto *renderLayout = new QFormLayout(renderGroup);
 
+    m_renderModeCombo = new QComboBox;
+    m_renderModeCombo->addItem("Fixed samples");
+    m_renderModeCombo->addItem("Quality (noise threshold)");
+    m_renderModeCombo->addItem("Time budget");
+    renderLayout->addRow("Mode:", m_renderModeCombo);
+
     m_renderSamplesSpin = new QSpinBox;
     m_renderSamplesSpin->setRange(1, 10000);
     m_renderSamplesSpin->setValue(128);
     renderLayout->addRow("Samples:", m_renderSamplesSpin);
 
+    // Error of the displayed value; 0.004 is about one 8-bit step
+    m_renderNoiseSpin = new QDoubleSpinBox;
+    m_renderNoiseSpin->setRange(0.001, 0.5);
+    m_renderNoiseSpin->setSingleStep(0.001);
+    m_renderNoiseSpin->setDecimals(3);
+    m_renderNoiseSpin->setValue(0.01);
+    m_renderNoiseSpin->setEnabled(false);
+    renderLayout->addRow("Noise threshold:", m_renderNoiseSpin);
+
+    m_renderTimeSpin = new QSpinBox;
+    m_renderTimeSpin->setRange(1, 7 * 24 * 3600);
+    m_renderTimeSpin->setValue(90);
+    m_renderTimeSpin->setSuffix(" s");
+    m_renderTimeSpin->setEnabled(false);
+    renderLayout->addRow("Time budget:", m_renderTimeSpin);
+
+    connect(m_renderModeCombo, QOverload<int>::of(&QComboBox::currentIndexChanged),
+            this, [this](int mode) {
+        m_renderNoiseSpin->setEnabled(mode == 1);
+        m_renderTimeSpin->setEnabled(mode == 2);
+        m_renderSamplesSpin->setToolTip(mode != 0 ? "Maximum samples per pixel" : QString());
+    });
+
+    m_renderSamplerCombo = createSamplerCombo();
+    renderLayout->addRow("Sampler:", m_renderSamplerCombo);
+
+    // Edge-aware filter on the final frame; 16-32 spp is usually enough
+    m_renderDenoiseCheck = new QCheckBox;
+    renderLayout->addRow("Denoise:", m_renderDenoiseCheck);
+
+    // Build speed against traversal speed; SBVH builds on one thread, the others
+    // use every render thread
+    m_renderBvhCombo = new QComboBox;
+    m_renderBvhCombo->addItem("Simple (median split)", int(BVHSplitMethod::Median));
+    m_renderBvhCombo->addItem("Fast build (LBVH)", int(BVHSplitMethod::Morton));
+    m_renderBvhCombo->addItem("Quality (SAH)", int(BVHSplitMethod::BinnedSAH));
+    m_renderBvhCombo->addItem("Final quality (SBVH)", int(BVHSplitMethod::SpatialSAH));
+    m_renderBvhCombo->setCurrentIndex(m_renderBvhCombo->findData(int(BVHSplitMethod::BinnedSAH)));
+    renderLayout->addRow("BVH:", m_renderBvhCombo);
+
     m_renderWidthSpin = new QSpinBox;
     m_renderWidthSpin->setRange(64, 4096);
     m_renderWidthSpin->setValue(320);
@@ -377,6 +496,11 @@ void PropertiesPanel::buildRenderTab(QWidget *tab)
     m_renderHeightSpin->setValue(240);
     renderLayout->addRow("Height:", m_renderHeightSpin);
 
+    m_renderThreadsSpin = new QSpinBox;
+    m_renderThreadsSpin->setRange(1, 256);
+    m_renderThreadsSpin->setValue(QThread::idealThreadCount());
+    renderLayout->addRow("Threads:", m_renderThreadsSpin);
+
     m_renderButton = new QPushButton("Render");
     renderLayout->addRow(m_renderButton);
     layout->addWidget(renderGroup);
@@ -388,6 +512,15 @@ void PropertiesPanel::buildRenderTab(QWidget *tab)
     layout->addStretch();
 }
 
+QComboBox *PropertiesPanel::createSamplerCombo() const
+{
+    auto *combo = new QComboBox;
+    for (SamplerType t : {SamplerType::Random, SamplerType::Sobol, SamplerType::BlueNoise})
+        combo->addItem(samplerTypeName(t), int(t));
+    combo->setCurrentIndex(combo->findData(int(SamplerType::Sobol)));
+    return combo;
+}
+
 void PropertiesPanel::setScene(Scene *scene)
 {
     m_scene = scene;
@@ -419,3 +552,58 @@ int PropertiesPanel::renderSamples() const
 {
     return m_renderSamplesSpin->value();
 }
+
+int PropertiesPanel::renderWidth() const
+{
+    return m_renderWidthSpin->value();
+}
+
+int PropertiesPanel::renderHeight() const
+{
+    return m_renderHeightSpin->value();
+}
+
+int PropertiesPanel::renderThreads() const
+{
+    return m_renderThreadsSpin->value();
+}
+
+SamplerType PropertiesPanel::viewportSampler() const
+{
+    return SamplerType(m_viewportSamplerCombo->currentData().toInt());
+}
+
+bool PropertiesPanel::viewportDenoise() const
+{
+    return m_viewportDenoiseCheck->isChecked();
+}
+
+SamplerType PropertiesPanel::renderSampler() const
+{
+    return SamplerType(m_renderSamplerCombo->currentData().toInt());
+}
+
+bool PropertiesPanel::renderAdaptive() const
+{
+    return m_renderModeCombo->currentIndex() == 1;
+}
+
+double PropertiesPanel::renderNoiseThreshold() const
+{
+    return m_renderNoiseSpin->value();
+}
+
+double PropertiesPanel::renderTimeBudget() const
+{
+    return m_renderModeCombo->currentIndex() == 2 ? m_renderTimeSpin->value() : 0.0;
+}
+
+bool PropertiesPanel::renderDenoise() const
+{
+    return m_renderDenoiseCheck->isChecked();
+}
+
+BVHSplitMethod PropertiesPanel::renderBvhMethod() const
+{
+    return BVHSplitMethod(m_renderBvhCombo->currentData().toInt());
+}
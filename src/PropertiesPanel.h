@@ -4,12 +4,15 @@
 #include <QSpinBox>
 #include <QDoubleSpinBox>
 #include <QComboBox>
+#include <QCheckBox>
 #include <QPushButton>
 #include <QSlider>
 #include <QLabel>
 #include <QTabWidget>
 #include <QListWidget>
 #include "Scene.h"
+#include "Sampler.h"
+#include "BVH.h"
 
 class PropertiesPanel : public QWidget {
     Q_OBJECT
@@ -19,6 +22,17 @@ public:
     void setScene(Scene *scene);
     int viewportSamples() const;
     int renderSamples() const;
+    int renderWidth() const;
+    int renderHeight() const;
+    int renderThreads() const;
+    SamplerType viewportSampler() const;
+    bool viewportDenoise() const;
+    SamplerType renderSampler() const;
+    bool renderAdaptive() const;
+    double renderNoiseThreshold() const;
+    double renderTimeBudget() const; // seconds, 0 unless the time budget mode is selected
+    bool renderDenoise() const;
+    BVHSplitMethod renderBvhMethod() const;
 
 signals:
     void sceneChanged();
@@ -33,10 +47,12 @@ private:
 
     void onObjectSelected(int index);
     void updateMaterialUI();
+    void updateTransformUI();
 
     void onLightSelected(int index);
     void updateLightUI();
     void refreshLightList();
+    QComboBox *createSamplerCombo() const;
 
     Scene *m_scene = nullptr;
 
@@ -44,6 +60,7 @@ private:
 
     // --- Object tab ---
     QComboBox *m_objectCombo = nullptr;
+    QPushButton *m_duplicateObjectBtn = nullptr;
     QSlider *m_redSlider = nullptr;
     QSlider *m_greenSlider = nullptr;
     QSlider *m_blueSlider = nullptr;
@@ -55,6 +72,10 @@ private:
     QSlider *m_iorSlider = nullptr;
     QLabel *m_iorLabel = nullptr;
 
+    QDoubleSpinBox *m_objPos[3] = {};
+    QDoubleSpinBox *m_objRot[3] = {};
+    QDoubleSpinBox *m_objScale[3] = {};
+
     // --- Light tab ---
     QListWidget *m_lightList = nullptr;
     QPushButton *m_addLightBtn = nullptr;
@@ -79,8 +100,17 @@ private:
 
     // --- Render tab ---
     QSpinBox *m_viewportSamplesSpin = nullptr;
+    QComboBox *m_viewportSamplerCombo = nullptr;
+    QCheckBox *m_viewportDenoiseCheck = nullptr;
     QSpinBox *m_renderSamplesSpin = nullptr;
     QSpinBox *m_renderWidthSpin = nullptr;
     QSpinBox *m_renderHeightSpin = nullptr;
+    QSpinBox *m_renderThreadsSpin = nullptr;
+    QComboBox *m_renderSamplerCombo = nullptr;
+    QComboBox *m_renderModeCombo = nullptr;
+    QDoubleSpinBox *m_renderNoiseSpin = nullptr;
+    QSpinBox *m_renderTimeSpin = nullptr;
+    QCheckBox *m_renderDenoiseCheck = nullptr;
+    QComboBox *m_renderBvhCombo = nullptr;
     QPushButton *m_renderButton = nullptr;
 };
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstdint>
+
+// Counter-based hashing used by Sampler. Every value is a pure function of its
+// inputs, so a pixel's sample stream does not depend on which thread renders it
+// or in which order tiles are scheduled.
+
+// PCG output permutation applied to a single 32-bit counter (Jarzynski & Olano 2020)
+inline uint32_t pcgHash(uint32_t v)
+{
+    uint32_t state = v * 747796405u + 2891336453u;
+    uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+inline uint32_t hashCombine(uint32_t seed, uint32_t v)
+{
+    return pcgHash(seed ^ (v + 0x9e3779b9u + (seed << 6) + (seed >> 2)));
+}
+
+// Maps the top 24 bits to [0, 1)
+inline float uintToFloat(uint32_t v)
+{
+    return float(v >> 8) * (1.0f / 16777216.0f);
+}
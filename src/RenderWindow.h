@@ -6,40 +6,82 @@
 #include <QPushButton>
 #include <QImage>
 #include <QThread>
+#include <QMutex>
+#include <QPixmap>
+#include <atomic>
+#include <memory>
+#include <vector>
 #include "Scene.h"
 #include "PathTracer.h"
+#include "CpuRenderer.h"
+
+// Delivered to the window through a queued connection
+Q_DECLARE_METATYPE(RenderStats)
+
+// Double-buffered 8-bit preview. The worker tonemaps changed tiles into the
+// back image and publishes it with swap(); the window converts the front image
+// under the same lock, so no whole-frame copy crosses the thread boundary.
+class PreviewBuffer {
+public:
+    PreviewBuffer(int width, int height, int tileCount);
+
+    // Worker side, no locking needed
+    QImage &back() { return m_images[m_back]; }
+    std::vector<int> &backTileSamples() { return m_tileSamples[m_back]; }
+    void swap();
+
+    // Window side
+    QPixmap frontPixmap(const QSize &size, Qt::TransformationMode mode);
+    QImage frontImage();
+
+private:
+    QMutex m_mutex;
+    QImage m_images[2];
+    std::vector<int> m_tileSamples[2]; // film samples last tonemapped into each image
+    int m_back = 0;
+};
 
 class RenderWorker : public QObject {
     Q_OBJECT
 public:
-    RenderWorker(Scene *scene, int width, int height, int totalSpp);
+    // Minimum time between preview frames
+    static constexpr int ProgressIntervalMs = 250;
+
+    // cancelFlag is polled between tiles; the caller keeps its own reference so
+    // it can be set without touching the worker object. The renderer is released
+    // before finished() so the next render can reuse it.
+    RenderWorker(std::shared_ptr<CpuRenderer> renderer, const RenderSettings &settings,
+                 std::shared_ptr<PreviewBuffer> preview,
+                 std::shared_ptr<std::atomic<bool>> cancelFlag);
 
 public slots:
     void process();
 
 signals:
-    void progressUpdated(int currentSample, int totalSamples, QImage image);
-    void finished(QImage finalImage);
+    void progressUpdated(int currentSample, int totalSamples, qint64 elapsedMs);
+    void finished(QImage finalImage, RenderStats stats);
 
 private:
-    Scene *m_scene;
-    int m_width;
-    int m_height;
-    int m_totalSpp;
+    std::shared_ptr<CpuRenderer> m_renderer;
+    RenderSettings m_settings;
+    std::shared_ptr<PreviewBuffer> m_preview;
+    std::shared_ptr<std::atomic<bool>> m_cancel;
 };
 
 class RenderWindow : public QDialog {
     Q_OBJECT
 public:
-    RenderWindow(Scene *scene, int width, int height, int spp, QWidget *parent = nullptr);
+    RenderWindow(std::shared_ptr<CpuRenderer> renderer, const RenderSettings &settings,
+                 QWidget *parent = nullptr);
     ~RenderWindow() override;
 
     void startRender();
 
 private slots:
-    void onProgressUpdated(int current, int total, QImage image);
-    void onFinished(QImage finalImage);
+    void onProgressUpdated(int current, int total, qint64 elapsedMs);
+    void onFinished(QImage finalImage, RenderStats stats);
     void saveImage();
+    void saveCheckpoint();
 
 private:
     QLabel *m_imageLabel = nullptr;
@@ -47,11 +89,16 @@ private:
     QLabel *m_statusLabel = nullptr;
     QPushButton *m_saveButton = nullptr;
     QPushButton *m_cancelButton = nullptr;
+    QPushButton *m_checkpointButton = nullptr;
 
     QThread *m_thread = nullptr;
     RenderWorker *m_worker = nullptr;
+    std::shared_ptr<PreviewBuffer> m_preview;
+    std::shared_ptr<std::atomic<bool>> m_cancel;
+    QString m_checkpointPath;
 
     QImage m_finalImage;
     int m_width;
     int m_height;
+    double m_timeBudgetSec;
 };
\ No newline at end of file
@@ -0,0 +1,229 @@
+#include "Sampler.h"
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
+// Hash-based Owen scrambling after Burley, "Practical Hash-based Owen
+// Scrambling" (JCGT 2020). shaders/pathtracer.comp carries a GLSL copy of
+// these functions; keep the two in sync.
+
+static uint32_t reverseBits(uint32_t x)
+{
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+static uint32_t laineKarrasPermutation(uint32_t x, uint32_t seed)
+{
+    x ^= x * 0x3d20adeau;
+    x += seed;
+    x *= (seed >> 16) | 1u;
+    x ^= x * 0x05526c56u;
+    x ^= x * 0x53a22864u;
+    return x;
+}
+
+static uint32_t nestedUniformScramble(uint32_t x, uint32_t seed)
+{
+    x = reverseBits(x);
+    x = laineKarrasPermutation(x, seed);
+    return reverseBits(x);
+}
+
+// First two Sobol dimensions: van der Corput and its (0,2) partner
+static void sobol2D(uint32_t index, uint32_t &x, uint32_t &y)
+{
+    x = reverseBits(index);
+    y = 0;
+    for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1) {
+        if (index & 1u) y ^= v;
+    }
+}
+
+// Shuffled, scrambled 2D Sobol point; each seed gives an independent (0,2) sequence
+static void sobolOwen2D(uint32_t index, uint32_t seed, uint32_t &x, uint32_t &y)
+{
+    index = nestedUniformScramble(index, seed);
+    sobol2D(index, x, y);
+    x = nestedUniformScramble(x, hashCombine(seed, 0xa511e9b3u));
+    y = nestedUniformScramble(y, hashCombine(seed, 0x63d83595u));
+}
+
+// Shuffled, Owen-scrambled van der Corput point, the 1D counterpart of sobolOwen2D()
+static uint32_t sobolOwen1D(uint32_t index, uint32_t seed)
+{
+    index = nestedUniformScramble(index, seed);
+    return nestedUniformScramble(reverseBits(index), hashCombine(seed, 0x1b873593u));
+}
+
+const char *samplerTypeName(SamplerType type)
+{
+    switch (type) {
+    case SamplerType::Random: return "Random";
+    case SamplerType::Sobol: return "Sobol (Owen)";
+    case SamplerType::BlueNoise: return "Blue noise";
+    }
+    return "Unknown";
+}
+
+Sampler::Sampler(SamplerType type, int px, int py, uint32_t sampleIndex)
+    : m_type(type), m_px(px), m_py(py), m_sampleIndex(sampleIndex),
+      m_pixelSeed(hashCombine(pcgHash(uint32_t(px)), uint32_t(py)))
+{
+}
+
+float Sampler::get1D()
+{
+    uint32_t dim = m_dimension++;
+
+    if (m_type == SamplerType::Random)
+        return uintToFloat(pcgHash(hashCombine(hashCombine(m_pixelSeed, m_sampleIndex), dim)));
+
+    if (m_type == SamplerType::Sobol)
+        return uintToFloat(sobolOwen1D(m_sampleIndex, hashCombine(m_pixelSeed, dim)));
+
+    float u = uintToFloat(sobolOwen1D(m_sampleIndex, pcgHash(dim))) + blueNoiseShift(dim, 0);
+    return u >= 1.0f ? u - 1.0f : u;
+}
+
+void Sampler::get2D(float &u, float &v)
+{
+    uint32_t dim = m_dimension++;
+
+    if (m_type == SamplerType::Random) {
+        uint32_t h = hashCombine(hashCombine(m_pixelSeed, m_sampleIndex), dim);
+        u = uintToFloat(pcgHash(h));
+        v = uintToFloat(pcgHash(h + 1));
+        return;
+    }
+
+    uint32_t x, y;
+    if (m_type == SamplerType::Sobol) {
+        // Independent scramble per pixel and dimension
+        sobolOwen2D(m_sampleIndex, hashCombine(m_pixelSeed, dim), x, y);
+        u = uintToFloat(x);
+        v = uintToFloat(y);
+        return;
+    }
+
+    // Blue noise: every pixel shares the scrambled sequence of this dimension and
+    // is offset by a blue-noise value, so low-spp error is spread as blue noise
+    sobolOwen2D(m_sampleIndex, pcgHash(dim), x, y);
+    u = uintToFloat(x) + blueNoiseShift(dim, 0);
+    v = uintToFloat(y) + blueNoiseShift(dim, 1);
+    if (u >= 1.0f) u -= 1.0f;
+    if (v >= 1.0f) v -= 1.0f;
+}
+
+float Sampler::blueNoiseShift(uint32_t dimension, int channel) const
+{
+    // Decorrelate dimensions and channels by a toroidal offset into the tile
+    uint32_t h = hashCombine(dimension, uint32_t(channel));
+    int ox = int(h & (BlueNoiseSize - 1));
+    int oy = int((h >> 8) & (BlueNoiseSize - 1));
+    int x = (m_px + ox) & (BlueNoiseSize - 1);
+    int y = (m_py + oy) & (BlueNoiseSize - 1);
+    return blueNoiseTexture()[y * BlueNoiseSize + x];
+}
+
+// Void-and-cluster (Ulichney 1993) on a toroidal 64x64 grid
+static std::vector<float> generateBlueNoise()
+{
+    const int N = Sampler::BlueNoiseSize;
+    const int count = N * N;
+    const float sigma = 1.5f;
+
+    // Gaussian energy kernel indexed by wrapped offset
+    std::vector<float> kernel(count);
+    for (int dy = 0; dy < N; ++dy) {
+        for (int dx = 0; dx < N; ++dx) {
+            int wx = std::min(dx, N - dx);
+            int wy = std::min(dy, N - dy);
+            kernel[dy * N + dx] = std::exp(-(wx * wx + wy * wy) / (2.0f * sigma * sigma));
+        }
+    }
+
+    std::vector<char> pattern(count, 0);
+    std::vector<float> energy(count, 0.0f);
+
+    auto splat = [&](int p, float sign) {
+        int px = p % N, py = p / N;
+        for (int y = 0; y < N; ++y) {
+            int ky = ((y - py) & (N - 1)) * N;
+            for (int x = 0; x < N; ++x)
+                energy[y * N + x] += sign * kernel[ky + ((x - px) & (N - 1))];
+        }
+    };
+
+    auto tightestCluster = [&]() {
+        int best = -1;
+        for (int i = 0; i < count; ++i)
+            if (pattern[i] && (best < 0 || energy[i] > energy[best])) best = i;
+        return best;
+    };
+
+    auto largestVoid = [&]() {
+        int best = -1;
+        for (int i = 0; i < count; ++i)
+            if (!pattern[i] && (best < 0 || energy[i] < energy[best])) best = i;
+        return best;
+    };
+
+    // Initial random pattern, relaxed until moving the tightest cluster into the
+    // largest void no longer changes anything
+    std::mt19937 rng(0x5eed);
+    int ones = count / 10;
+    for (int placed = 0; placed < ones;) {
+        int p = int(rng() % count);
+        if (pattern[p]) continue;
+        pattern[p] = 1;
+        splat(p, 1.0f);
+        ++placed;
+    }
+    for (;;) {
+        int c = tightestCluster();
+        pattern[c] = 0;
+        splat(c, -1.0f);
+        int v = largestVoid();
+        pattern[v] = 1;
+        splat(v, 1.0f);
+        if (v == c) break;
+    }
+
+    std::vector<int> rank(count, 0);
+    std::vector<char> initial = pattern;
+    std::vector<float> initialEnergy = energy;
+
+    // Phase 1: rank the initial points by removing tightest clusters
+    for (int r = ones - 1; r >= 0; --r) {
+        int c = tightestCluster();
+        pattern[c] = 0;
+        splat(c, -1.0f);
+        rank[c] = r;
+    }
+
+    // Phase 2 and 3: fill the largest voids until the grid is full
+    pattern = initial;
+    energy = initialEnergy;
+    for (int r = ones; r < count; ++r) {
+        int v = largestVoid();
+        pattern[v] = 1;
+        splat(v, 1.0f);
+        rank[v] = r;
+    }
+
+    std::vector<float> texture(count);
+    for (int i = 0; i < count; ++i)
+        texture[i] = (rank[i] + 0.5f) / count;
+    return texture;
+}
+
+const float *Sampler::blueNoiseTexture()
+{
+    static const std::vector<float> texture = generateBlueNoise();
+    return texture.data();
+}
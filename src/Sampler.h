@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include "Random.h"
+
+enum class SamplerType {
+    Random = 0,    // independent white noise per dimension
+    Sobol = 1,     // Owen-scrambled Sobol (0,2) sequence, decorrelated per pixel
+    BlueNoise = 2  // Sobol with a per-pixel blue-noise Cranley-Patterson shift
+};
+
+const char *samplerTypeName(SamplerType type);
+
+// Per-path sample generator. Dimensions are consumed in order with get1D()/get2D(),
+// one dimension per call whether it draws one value or two;
+// setBounce() moves to a fixed dimension block so the layout of one bounce never
+// depends on how many values an earlier bounce consumed. Values are pure
+// functions of (pixel, sample index, dimension).
+class Sampler {
+public:
+    static constexpr int DimensionsPerBounce = 8;
+    static constexpr int BlueNoiseSize = 64;
+
+    Sampler(SamplerType type, int px, int py, uint32_t sampleIndex);
+
+    // Bounce 0 is the camera ray
+    void setBounce(int bounce)
+    {
+        m_dimension = uint32_t(bounce) * DimensionsPerBounce;
+    }
+
+    float get1D();
+    void get2D(float &u, float &v);
+
+    // Ranked 64x64 blue-noise tile in [0, 1), generated once by void-and-cluster
+    static const float *blueNoiseTexture();
+
+private:
+    float blueNoiseShift(uint32_t dimension, int channel) const;
+
+    SamplerType m_type;
+    int m_px;
+    int m_py;
+    uint32_t m_sampleIndex;
+    uint32_t m_pixelSeed;
+    uint32_t m_dimension = 0;
+};
@@ -4,7 +4,16 @@
 #include <QJsonArray>
 #include <QJsonObject>
 #include <QDebug>
+#include <QHash>
 #include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QThread>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include "MeshCache.h"
+#include "ThreadPool.h"
 
 void Scene::clear()
 {
@@ -23,7 +32,84 @@ void Scene::removeLight(int index)
         m_lights.removeAt(index);
 }
 
-void Scene::createDefault()
+std::shared_ptr<SceneObject> Scene::duplicateObject(int index)
+{
+    if (index < 0 || index >= m_objects.size()) return nullptr;
+    const SceneObject &src = *m_objects[index];
+
+    auto obj = std::make_shared<SceneObject>(src.name() + " copy", src.objPath());
+    obj->material() = src.material();
+    obj->setMesh(src.sharedMesh());
+    obj->setPosition(src.position());
+    obj->setRotation(src.rotation());
+    obj->setScale(src.scale());
+    m_objects.append(obj);
+    return obj;
+}
+
+// Loads each OBJ once, on a thread pool; objects with the same path share the
+// mesh. Every distinct OBJ is one task. With fewer OBJs than cores, each task
+// parses its OBJ in chunks on a pool of its own with its share of the other
+// cores; tasks never wait on the pool they run on. The calling thread runs
+// progress while it waits and assigns the meshes once all tasks are joined,
+// before any object reaches initGL().
+static void loadMeshes(const QVector<std::shared_ptr<SceneObject>> &objects,
+                       const Scene::LoadProgress &progress)
+{
+    QHash<QString, int> slotOf;
+    QVector<QString> paths;
+    for (const auto &obj : objects) {
+        if (!slotOf.contains(obj->objPath())) {
+            slotOf.insert(obj->objPath(), paths.size());
+            paths.append(obj->objPath());
+        }
+    }
+    const int total = paths.size();
+    if (total == 0) return;
+
+    std::vector<std::shared_ptr<Mesh>> meshes(total);
+    std::vector<char> ok(total, 0);
+    std::atomic<int> loaded{0};
+    if (progress) progress(0, total);
+
+    QElapsedTimer timer;
+    timer.start();
+    {
+        const int cores = std::max(1, QThread::idealThreadCount());
+        ThreadPool pool(std::min(total, cores));
+        // One parse pool per worker of pool, used only by that worker
+        std::vector<std::unique_ptr<ThreadPool>> parsePools;
+        if (cores / total > 1) {
+            for (int w = 0; w < pool.threadCount(); ++w)
+                parsePools.push_back(std::make_unique<ThreadPool>(cores / total));
+        }
+        std::future<void> all = std::async(std::launch::async, [&]() {
+            pool.parallelFor(total, [&](int i, int worker) {
+                meshes[i] = std::make_shared<Mesh>();
+                ThreadPool *parsePool = parsePools.empty() ? nullptr : parsePools[worker].get();
+                ok[i] = MeshCache::global().loadOrParse(paths[i], *meshes[i], parsePool);
+                loaded.fetch_add(1, std::memory_order_relaxed);
+            });
+        });
+        while (all.wait_for(std::chrono::milliseconds(50)) != std::future_status::ready) {
+            if (progress) progress(loaded.load(std::memory_order_relaxed), total);
+        }
+        all.get();
+    }
+
+    for (int i = 0; i < total; ++i) {
+        if (ok[i]) qDebug() << "OK:" << paths[i] << "tris:" << meshes[i]->indices.size() / 3;
+        else qWarning() << "FAILED to load:" << paths[i];
+    }
+    for (const auto &obj : objects) {
+        int i = slotOf.value(obj->objPath());
+        if (ok[i]) obj->setMesh(meshes[i]);
+    }
+    qDebug() << "Loaded" << total << "meshes in" << timer.elapsed() << "ms";
+    if (progress) progress(total, total);
+}
+
+void Scene::createDefault(const LoadProgress &progress)
 {
     clear();
     m_camera.reset();
@@ -50,14 +136,9 @@ void Scene::createDefault()
         obj->material().color = d.color;
         obj->material().roughness = d.roughness;
         obj->material().transparency = 0.0f;
-
-        if (!obj->loadMesh()) {
-            qWarning() << "FAILED to load:" << d.path;
-        } else {
-            qDebug() << "OK:" << d.path << "tris:" << obj->mesh().indices.size() / 3;
-        }
         m_objects.append(obj);
     }
+    loadMeshes(m_objects, progress);
 
     // Default light
     Light defaultLight;
@@ -71,7 +152,7 @@ void Scene::createDefault()
     m_lights.append(defaultLight);
 }
 
-bool Scene::load(const QString &path)
+bool Scene::load(const QString &path, const LoadProgress &progress)
 {
     QFile f(path);
     if (!f.open(QIODevice::ReadOnly)) return false;
@@ -104,9 +185,12 @@ bool Scene::load(const QString &path)
         obj->material().transparency = matObj["transparency"].toDouble(0.0);
         obj->material().ior = matObj["ior"].toDouble(1.5);
 
-        obj->loadMesh();
+        obj->setPosition(QVector3D(jo["px"].toDouble(), jo["py"].toDouble(), jo["pz"].toDouble()));
+        obj->setRotation(QVector3D(jo["rx"].toDouble(), jo["ry"].toDouble(), jo["rz"].toDouble()));
+        obj->setScale(QVector3D(jo["sx"].toDouble(1), jo["sy"].toDouble(1), jo["sz"].toDouble(1)));
         m_objects.append(obj);
     }
+    loadMeshes(m_objects, progress);
 
     QJsonArray lightArr = root["lights"].toArray();
     for (const auto &val : lightArr) {
@@ -142,6 +226,16 @@ bool Scene::save(const QString &path) const
         matObj["ior"] = obj->material().ior;
         jo["material"] = matObj;
 
+        jo["px"] = obj->position().x();
+        jo["py"] = obj->position().y();
+        jo["pz"] = obj->position().z();
+        jo["rx"] = obj->rotation().x();
+        jo["ry"] = obj->rotation().y();
+        jo["rz"] = obj->rotation().z();
+        jo["sx"] = obj->scale().x();
+        jo["sy"] = obj->scale().y();
+        jo["sz"] = obj->scale().z();
+
         objArr.append(jo);
     }
 
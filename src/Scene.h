@@ -2,6 +2,7 @@
 
 #include <QVector>
 #include <QString>
+#include <functional>
 #include <memory>
 #include "SceneObject.h"
 #include "Camera.h"
@@ -9,10 +10,14 @@
 
 class Scene {
 public:
-    void createDefault();
+    // Runs on the calling thread while meshes load; loaded of total distinct OBJs
+    using LoadProgress = std::function<void(int loaded, int total)>;
+
+    // Both load the object meshes in parallel and return once all are loaded
+    void createDefault(const LoadProgress &progress = {});
     void clear();
 
-    bool load(const QString &path);
+    bool load(const QString &path, const LoadProgress &progress = {});
     bool save(const QString &path) const;
 
     QVector<std::shared_ptr<SceneObject>> &objects() { return m_objects; }
@@ -24,6 +29,9 @@ public:
     void addLight(const Light &light);
     void removeLight(int index);
 
+    // Adds an instance of objects()[index]: same mesh, material and transform
+    std::shared_ptr<SceneObject> duplicateObject(int index);
+
     Camera &camera() { return m_camera; }
     const Camera &camera() const { return m_camera; }
 
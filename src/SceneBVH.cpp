@@ -0,0 +1,319 @@
+#include "SceneBVH.h"
+#include "ObjLoader.h"
+#include <QCryptographicHash>
+#include <QDebug>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QStandardPaths>
+
+AABB transformBounds(const AABB &box, const QMatrix4x4 &m)
+{
+    AABB out;
+    for (int c = 0; c < 8; ++c) {
+        QVector3D corner(c & 1 ? box.mx.x() : box.mn.x(),
+                         c & 2 ? box.mx.y() : box.mn.y(),
+                         c & 4 ? box.mx.z() : box.mn.z());
+        out.expand(m.map(corner));
+    }
+    return out;
+}
+
+void SceneBVH::place(Instance &inst)
+{
+    const BVHInstance &desc = inst.desc;
+    inst.identity = desc.objectToWorld.isIdentity();
+    inst.worldToObject = desc.objectToWorld.inverted();
+    inst.normalToWorld = inst.worldToObject.transposed();
+    inst.worldBounds = inst.identity ? desc.blas->bounds()
+                                     : transformBounds(desc.blas->bounds(), desc.objectToWorld);
+}
+
+void SceneBVH::build(std::vector<BVHInstance> instances)
+{
+    m_instances.clear();
+    m_nodes.clear();
+    m_inputCount = int(instances.size());
+    m_builtCost = 0.0f;
+
+    std::vector<Instance> placed;
+    std::vector<AABB> bounds;
+    for (int i = 0; i < (int)instances.size(); ++i) {
+        if (!instances[i].blas || instances[i].blas->triangles().isEmpty()) continue;
+        Instance inst;
+        inst.desc = std::move(instances[i]);
+        inst.input = i;
+        place(inst);
+        bounds.push_back(inst.worldBounds);
+        placed.push_back(std::move(inst));
+    }
+    if (placed.empty()) return;
+
+    // An instance test costs a whole BLAS traversal, so every instance gets its own leaf
+    BVHBuildSettings settings;
+    settings.maxLeafSize = 1;
+    BVHBuilder::Result tree = BVHBuilder::build(bounds, settings);
+
+    m_nodes = BVHBuilder::flatten(tree.nodes);
+    m_instances.reserve(placed.size());
+    for (int prim : tree.primOrder)
+        m_instances.push_back(std::move(placed[prim]));
+    m_builtCost = BVHBuilder::flatCost(m_nodes, settings);
+}
+
+bool SceneBVH::refit(std::vector<BVHInstance> instances)
+{
+    bool match = !m_instances.empty() && int(instances.size()) == m_inputCount;
+    size_t nonEmpty = 0;
+    for (size_t i = 0; match && i < instances.size(); ++i)
+        nonEmpty += instances[i].blas && !instances[i].blas->triangles().isEmpty();
+    match = match && nonEmpty == m_instances.size();
+    for (size_t i = 0; match && i < m_instances.size(); ++i)
+        match = instances[m_instances[i].input].blas == m_instances[i].desc.blas;
+    if (!match) {
+        build(std::move(instances));
+        return false;
+    }
+
+    for (Instance &inst : m_instances) {
+        inst.desc = std::move(instances[inst.input]);
+        place(inst);
+    }
+    BVHBuilder::refitFlat(m_nodes, [this](int start, int count) {
+        AABB box;
+        for (int i = start; i < start + count; ++i)
+            box.expand(m_instances[i].worldBounds);
+        return box;
+    });
+
+    BVHBuildSettings settings;
+    if (BVHBuilder::flatCost(m_nodes) > m_builtCost * settings.refitRebuildRatio) {
+        // build() wants the instances in input order again
+        std::vector<BVHInstance> inputs(m_inputCount);
+        for (Instance &inst : m_instances)
+            inputs[inst.input] = std::move(inst.desc);
+        build(std::move(inputs));
+        return false;
+    }
+    return true;
+}
+
+bool SceneBVH::intersect(const QVector3D &orig, const QVector3D &dir, SceneHit &hit) const
+{
+    hit = SceneHit();
+    if (m_nodes.empty()) return false;
+    QVector3D invDir(1.0f / dir.x(), 1.0f / dir.y(), 1.0f / dir.z());
+
+    // Near child first, as in BVH::intersect()
+    struct Entry {
+        int node;
+        float t;
+    };
+    Entry stack[BVHBuilder::MaxDepth];
+    int stackPtr = 0;
+    float tRoot;
+    if (!m_nodes[0].hit(orig, invDir, hit.t, tRoot)) return false;
+    stack[stackPtr++] = {0, tRoot};
+
+    while (stackPtr > 0) {
+        const Entry entry = stack[--stackPtr];
+        if (entry.t >= hit.t) continue;
+        const BVHFlatNode &node = m_nodes[entry.node];
+
+        if (node.count > 0) {
+            for (int i = node.rightOrStart; i < node.rightOrStart + node.count; ++i) {
+                const Instance &inst = m_instances[i];
+                float t;
+                int prim = inst.identity
+                    ? inst.desc.blas->intersect(orig, dir, t, hit.t)
+                    : inst.desc.blas->intersect(inst.worldToObject.map(orig),
+                                                inst.worldToObject.mapVector(dir), t, hit.t);
+                if (prim >= 0) {
+                    hit.instance = i;
+                    hit.prim = prim;
+                    hit.t = t;
+                }
+            }
+            continue;
+        }
+
+        Entry left{entry.node + 1, 0.0f}, right{node.rightOrStart, 0.0f};
+        bool hitLeft = m_nodes[left.node].hit(orig, invDir, hit.t, left.t);
+        bool hitRight = m_nodes[right.node].hit(orig, invDir, hit.t, right.t);
+        if (hitLeft && hitRight) {
+            if (right.t < left.t) std::swap(left, right);
+            stack[stackPtr++] = right;
+            stack[stackPtr++] = left;
+        } else if (hitLeft) {
+            stack[stackPtr++] = left;
+        } else if (hitRight) {
+            stack[stackPtr++] = right;
+        }
+    }
+
+    return hit.instance >= 0;
+}
+
+bool SceneBVH::occluded(const QVector3D &orig, const QVector3D &dir, float tMax) const
+{
+    if (m_nodes.empty()) return false;
+    QVector3D invDir(1.0f / dir.x(), 1.0f / dir.y(), 1.0f / dir.z());
+
+    int stack[BVHBuilder::MaxDepth];
+    int stackPtr = 0;
+    stack[stackPtr++] = 0;
+
+    while (stackPtr > 0) {
+        int ni = stack[--stackPtr];
+        const BVHFlatNode &node = m_nodes[ni];
+
+        if (!node.hit(orig, invDir, tMax))
+            continue;
+
+        if (node.count > 0) {
+            for (int i = node.rightOrStart; i < node.rightOrStart + node.count; ++i) {
+                const Instance &inst = m_instances[i];
+                bool hit = inst.identity
+                    ? inst.desc.blas->occluded(orig, dir, tMax)
+                    : inst.desc.blas->occluded(inst.worldToObject.map(orig),
+                                               inst.worldToObject.mapVector(dir), tMax);
+                if (hit) return true;
+            }
+        } else {
+            stack[stackPtr++] = ni + 1;
+            stack[stackPtr++] = node.rightOrStart;
+        }
+    }
+
+    return false;
+}
+
+QVector3D SceneBVH::normal(const SceneHit &hit) const
+{
+    const Instance &inst = m_instances[hit.instance];
+    const QVector3D &n = triangle(hit).normal;
+    return inst.identity ? n : inst.normalToWorld.mapVector(n).normalized();
+}
+
+long long SceneBVH::instancedTriangles() const
+{
+    long long total = 0;
+    for (const Instance &inst : m_instances)
+        total += inst.desc.blas->triangles().size();
+    return total;
+}
+
+BLASCache::BLASCache()
+{
+    QString base = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+    if (!base.isEmpty())
+        m_diskDir = base + "/bvh";
+}
+
+BLASCache &BLASCache::global()
+{
+    static BLASCache cache;
+    return cache;
+}
+
+QVector<RenderTriangle> BLASCache::meshTriangles(const Mesh &mesh)
+{
+    QVector<RenderTriangle> tris;
+    tris.reserve(mesh.indices.size() / 3);
+    for (int i = 0; i + 2 < mesh.indices.size(); i += 3) {
+        unsigned int idx0 = mesh.indices[i];
+        unsigned int idx1 = mesh.indices[i + 1];
+        unsigned int idx2 = mesh.indices[i + 2];
+
+        if (idx0 >= (unsigned int)mesh.vertices.size() ||
+            idx1 >= (unsigned int)mesh.vertices.size() ||
+            idx2 >= (unsigned int)mesh.vertices.size())
+            continue;
+
+        RenderTriangle tri;
+        tri.v0 = mesh.vertices[idx0];
+        tri.v1 = mesh.vertices[idx1];
+        tri.v2 = mesh.vertices[idx2];
+        tri.normal = QVector3D::crossProduct(tri.v1 - tri.v0, tri.v2 - tri.v0).normalized();
+        tris.append(tri);
+    }
+    return tris;
+}
+
+std::shared_ptr<const BVH> BLASCache::get(const std::shared_ptr<const Mesh> &mesh,
+                                          const BVHBuildSettings &settings, ThreadPool *pool)
+{
+    Key key{mesh.get(), int(settings.method), settings.bins, settings.maxLeafSize,
+            settings.traversalCost, settings.intersectionCost, settings.width,
+            settings.spatialSplitBudget};
+    std::promise<std::shared_ptr<const BVH>> promise;
+    QString diskDir;
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for (auto it = m_entries.begin(); it != m_entries.end();) {
+            if (it->second.mesh.expired()) it = m_entries.erase(it);
+            else ++it;
+        }
+
+        auto it = m_entries.find(key);
+        if (it != m_entries.end()) {
+            std::shared_future<std::shared_ptr<const BVH>> pending = it->second.bvh;
+            lock.unlock();
+            return pending.get();
+        }
+        m_entries[key] = {mesh, promise.get_future().share()};
+        diskDir = m_diskDir;
+    }
+
+    auto bvh = std::make_shared<BVH>();
+    QString path;
+    QByteArray diskKey;
+    if (!diskDir.isEmpty() && !mesh->indices.isEmpty()) {
+        diskKey = diskCacheKey(*mesh, settings);
+        path = diskDir + "/" + QString::fromLatin1(diskKey.toHex()) + ".bvh";
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    if (!path.isEmpty() && bvh->load(path, diskKey, settings)) {
+        qDebug() << "BVH loaded from cache:" << bvh->triangles().size() << "tris in"
+                 << timer.elapsed() << "ms";
+    } else {
+        bvh->build(meshTriangles(*mesh), settings, pool);
+        if (!path.isEmpty() && !bvh->triangles().isEmpty() &&
+            QDir().mkpath(diskDir) && bvh->save(path, diskKey))
+            qDebug() << "BVH cached:" << path;
+    }
+    promise.set_value(bvh);
+    return bvh;
+}
+
+void BLASCache::setDiskCacheDir(const QString &dir)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_diskDir = dir;
+}
+
+QString BLASCache::diskCacheDir()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_diskDir;
+}
+
+QByteArray BLASCache::diskCacheKey(const Mesh &mesh, const BVHBuildSettings &settings)
+{
+    // refitRebuildRatio does not change the tree and is left out
+    const qint32 ints[] = {qint32(settings.method), settings.bins, settings.maxLeafSize,
+                           BVH::traversalWidth(settings.width),
+                           qint32(mesh.vertices.size()), qint32(mesh.indices.size())};
+    const float floats[] = {settings.traversalCost, settings.intersectionCost,
+                            settings.spatialSplitBudget};
+
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(QByteArrayView(reinterpret_cast<const char *>(ints), sizeof(ints)));
+    hash.addData(QByteArrayView(reinterpret_cast<const char *>(floats), sizeof(floats)));
+    hash.addData(QByteArrayView(reinterpret_cast<const char *>(mesh.vertices.constData()),
+                                mesh.vertices.size() * sizeof(QVector3D)));
+    hash.addData(QByteArrayView(reinterpret_cast<const char *>(mesh.indices.constData()),
+                                mesh.indices.size() * sizeof(unsigned int)));
+    return hash.result();
+}
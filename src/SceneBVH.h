@@ -0,0 +1,123 @@
+#pragma once
+
+#include <QMatrix4x4>
+#include <QString>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <vector>
+#include "BVH.h"
+
+struct Mesh;
+class ThreadPool;
+
+// World bounds of an object-space box: the bounds of its eight transformed corners
+AABB transformBounds(const AABB &box, const QMatrix4x4 &objectToWorld);
+
+// One placement of a bottom-level BVH (BLAS) in the scene
+struct BVHInstance {
+    std::shared_ptr<const BVH> blas; // object space, shared by every instance of a mesh
+    QMatrix4x4 objectToWorld;
+    QVector3D color{1.0f, 1.0f, 1.0f}; // material albedo, or radiance for emitters
+    bool emissive = false;
+};
+
+// Closest hit of a world-space ray: the instance and the triangle in its BLAS
+struct SceneHit {
+    int instance = -1;
+    int prim = -1; // index into the instance's blas->triangles()
+    float t = FLT_MAX;
+};
+
+// Two-level acceleration structure: a binary top-level BVH (TLAS) over the
+// world bounds of the instances, and for each instance a bottom-level BVH that
+// rays enter in object space. Building the TLAS is O(instances log instances),
+// so moving or duplicating an object never touches its triangles. The
+// object-space direction is not renormalized, so t is the same in both spaces.
+class SceneBVH {
+public:
+    // Instances with an empty BLAS are dropped
+    void build(std::vector<BVHInstance> instances);
+
+    // Takes new transforms and materials for the instances of the last build,
+    // passed in the same order with the same BLASes (which may have been refit
+    // themselves), and refits the TLAS bounds bottom-up. Builds instead, and
+    // returns false, when the instances do not match or the refit tree's SAH
+    // cost passed BVHBuildSettings::refitRebuildRatio times its built cost.
+    bool refit(std::vector<BVHInstance> instances);
+
+    bool intersect(const QVector3D &orig, const QVector3D &dir, SceneHit &hit) const;
+    // Any hit closer than tMax, see BVH::occluded()
+    bool occluded(const QVector3D &orig, const QVector3D &dir, float tMax) const;
+
+    int instanceCount() const { return int(m_instances.size()); }
+    const BVHInstance &instance(int i) const { return m_instances[i].desc; }
+    const RenderTriangle &triangle(const SceneHit &hit) const {
+        return m_instances[hit.instance].desc.blas->triangles()[hit.prim];
+    }
+    // World-space geometric normal of the hit triangle, unit length
+    QVector3D normal(const SceneHit &hit) const;
+
+    // Triangles across all instances; shared BLASes are counted once per instance
+    long long instancedTriangles() const;
+
+private:
+    struct Instance {
+        BVHInstance desc;
+        QMatrix4x4 worldToObject;
+        QMatrix4x4 normalToWorld; // inverse transpose of objectToWorld
+        bool identity = true;     // rays skip the transform
+        AABB worldBounds;
+        int input = 0;            // index in the instances passed to build()
+    };
+
+    // Transforms and world bounds from desc
+    static void place(Instance &inst);
+
+    std::vector<Instance> m_instances; // TLAS leaf order
+    std::vector<BVHFlatNode> m_nodes;
+    int m_inputCount = 0;
+    float m_builtCost = 0.0f;
+};
+
+// Bottom-level BVHs by mesh, kept for as long as the mesh is alive so that each
+// render only builds the meshes it has not seen. Keyed by the Mesh object and
+// the build settings; meshes are immutable once shared (SceneObject::setMesh).
+// Built trees are also written to a disk cache keyed by the mesh content, so a
+// later run maps the file instead of building (BVH::load()). Thread-safe.
+class BLASCache {
+public:
+    BLASCache();
+
+    static BLASCache &global();
+
+    // The object-space BVH of mesh, loaded or built on first use. The lock is not
+    // held while loading or building; callers asking for a tree in progress wait
+    // for it instead of building it again.
+    std::shared_ptr<const BVH> get(const std::shared_ptr<const Mesh> &mesh,
+                                   const BVHBuildSettings &settings, ThreadPool *pool = nullptr);
+
+    // Directory of the cache files; empty disables the disk cache. Defaults to
+    // "bvh" in the user's cache location. Stale files are never deleted.
+    void setDiskCacheDir(const QString &dir);
+    QString diskCacheDir();
+
+    // Hash of the mesh geometry and of the settings that shape its tree
+    static QByteArray diskCacheKey(const Mesh &mesh, const BVHBuildSettings &settings);
+
+    // Object-space triangles of a mesh; indices outside the vertex array are skipped
+    static QVector<RenderTriangle> meshTriangles(const Mesh &mesh);
+
+private:
+    using Key = std::tuple<const Mesh *, int, int, int, float, float, int, float>;
+    struct Entry {
+        std::weak_ptr<const Mesh> mesh; // expired: the address may be reused
+        std::shared_future<std::shared_ptr<const BVH>> bvh; // ready once loaded or built
+    };
+
+    std::mutex m_mutex;
+    std::map<Key, Entry> m_entries;
+    QString m_diskDir;
+};
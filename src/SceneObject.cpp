@@ -1,4 +1,6 @@
 #include "SceneObject.h"
+#include "MeshCache.h"
+#include "ThreadPool.h"
 #include <QOpenGLFunctions>
 #include <QOpenGLContext>
 
@@ -7,14 +9,40 @@ SceneObject::SceneObject(const QString &name, const QString &objPath)
 {
 }
 
-bool SceneObject::loadMesh()
+bool SceneObject::loadMesh(ThreadPool *pool)
 {
-    return ObjLoader::load(m_objPath, m_mesh);
+    std::unique_ptr<ThreadPool> ownPool;
+    if (!pool) {
+        ownPool = std::make_unique<ThreadPool>();
+        pool = ownPool.get();
+    }
+    auto mesh = std::make_shared<Mesh>();
+    bool ok = MeshCache::global().loadOrParse(m_objPath, *mesh, pool);
+    setMesh(std::move(mesh));
+    return ok;
+}
+
+void SceneObject::setMesh(std::shared_ptr<const Mesh> mesh)
+{
+    destroyGL();
+    m_mesh = mesh ? std::move(mesh) : std::make_shared<Mesh>();
+}
+
+QMatrix4x4 SceneObject::transform() const
+{
+    QMatrix4x4 m;
+    m.translate(m_position);
+    m.rotate(m_rotation.x(), 1, 0, 0);
+    m.rotate(m_rotation.y(), 0, 1, 0);
+    m.rotate(m_rotation.z(), 0, 0, 1);
+    m.scale(m_scale);
+    return m;
 }
 
 void SceneObject::initGL()
 {
-    if (m_mesh.vertices.isEmpty()) return;
+    const Mesh &mesh = *m_mesh;
+    if (mesh.vertices.isEmpty()) return;
 
     QOpenGLFunctions *f = QOpenGLContext::currentContext()->functions();
 
@@ -23,14 +51,14 @@ void SceneObject::initGL()
 
     // interleave: pos(3) + normal(3) per vertex
     QVector<float> data;
-    data.reserve(m_mesh.vertices.size() * 6);
-    for (int i = 0; i < m_mesh.vertices.size(); ++i) {
-        data.append(m_mesh.vertices[i].x());
-        data.append(m_mesh.vertices[i].y());
-        data.append(m_mesh.vertices[i].z());
-        data.append(m_mesh.normals[i].x());
-        data.append(m_mesh.normals[i].y());
-        data.append(m_mesh.normals[i].z());
+    data.reserve(mesh.vertices.size() * 6);
+    for (int i = 0; i < mesh.vertices.size(); ++i) {
+        data.append(mesh.vertices[i].x());
+        data.append(mesh.vertices[i].y());
+        data.append(mesh.vertices[i].z());
+        data.append(mesh.normals[i].x());
+        data.append(mesh.normals[i].y());
+        data.append(mesh.normals[i].z());
     }
 
     m_vbo.create();
@@ -47,8 +75,8 @@ void SceneObject::initGL()
 
     m_ebo.create();
     m_ebo.bind();
-    m_ebo.allocate(m_mesh.indices.constData(), m_mesh.indices.size() * sizeof(unsigned int));
-    m_indexCount = m_mesh.indices.size();
+    m_ebo.allocate(mesh.indices.constData(), mesh.indices.size() * sizeof(unsigned int));
+    m_indexCount = mesh.indices.size();
 
     m_vao.release();
     m_glInitialized = true;
@@ -79,6 +107,9 @@ QJsonObject SceneObject::toJson() const
     obj["name"] = m_name;
     obj["objPath"] = m_objPath;
     obj["material"] = m_material.toJson();
+    obj["px"] = m_position.x(); obj["py"] = m_position.y(); obj["pz"] = m_position.z();
+    obj["rx"] = m_rotation.x(); obj["ry"] = m_rotation.y(); obj["rz"] = m_rotation.z();
+    obj["sx"] = m_scale.x(); obj["sy"] = m_scale.y(); obj["sz"] = m_scale.z();
     return obj;
 }
 
@@ -87,4 +118,7 @@ void SceneObject::fromJson(const QJsonObject &obj)
     m_name = obj["name"].toString();
     m_objPath = obj["objPath"].toString();
     m_material.fromJson(obj["material"].toObject());
+    m_position = QVector3D(obj["px"].toDouble(), obj["py"].toDouble(), obj["pz"].toDouble());
+    m_rotation = QVector3D(obj["rx"].toDouble(), obj["ry"].toDouble(), obj["rz"].toDouble());
+    m_scale = QVector3D(obj["sx"].toDouble(1), obj["sy"].toDouble(1), obj["sz"].toDouble(1));
 }
\ No newline at end of file
@@ -2,10 +2,12 @@
 
 #include <QString>
 #include <QJsonObject>
+#include <QMatrix4x4>
 #include <QOpenGLBuffer>
 #include <QOpenGLVertexArrayObject>
 #include "Material.h"
 #include "ObjLoader.h"
+#include <memory>
 
 class SceneObject {
 public:
@@ -18,10 +20,27 @@ public:
 
     Material &material() { return m_material; }
     const Material &material() const { return m_material; }
-    const Mesh &mesh() const { return m_mesh; }
+    const Mesh &mesh() const { return *m_mesh; }
 
-    bool loadMesh();
-    bool isLoaded() const { return !m_mesh.vertices.isEmpty(); }
+    // Objects made from the same OBJ share one immutable mesh, and the
+    // renderers build one bottom-level BVH per mesh
+    std::shared_ptr<const Mesh> sharedMesh() const { return m_mesh; }
+    void setMesh(std::shared_ptr<const Mesh> mesh);
+
+    // Object-to-world placement: scale, then rotation (euler degrees, same
+    // order as Light), then translation
+    QVector3D position() const { return m_position; }
+    QVector3D rotation() const { return m_rotation; }
+    QVector3D scale() const { return m_scale; }
+    void setPosition(const QVector3D &p) { m_position = p; }
+    void setRotation(const QVector3D &r) { m_rotation = r; }
+    void setScale(const QVector3D &s) { m_scale = s; }
+    QMatrix4x4 transform() const;
+
+    // From the binary mesh cache when it is up to date, else from the OBJ,
+    // parsed in chunks on pool or, without one, on a pool of its own
+    bool loadMesh(ThreadPool *pool = nullptr);
+    bool isLoaded() const { return !m_mesh->vertices.isEmpty(); }
     bool isGLInitialized() const { return m_glInitialized; }
 
     void initGL();
@@ -35,7 +54,10 @@ private:
     QString m_name;
     QString m_objPath;
     Material m_material;
-    Mesh m_mesh;
+    std::shared_ptr<const Mesh> m_mesh = std::make_shared<Mesh>();
+    QVector3D m_position{0.0f, 0.0f, 0.0f};
+    QVector3D m_rotation{0.0f, 0.0f, 0.0f};
+    QVector3D m_scale{1.0f, 1.0f, 1.0f};
 
     QOpenGLVertexArrayObject m_vao;
     QOpenGLBuffer m_vbo{QOpenGLBuffer::VertexBuffer};
@@ -0,0 +1,122 @@
+#include "ThreadPool.h"
+#include <algorithm>
+
+ThreadPool::ThreadPool(int threadCount)
+{
+    if (threadCount <= 0)
+        threadCount = (int)std::max(1u, std::thread::hardware_concurrency());
+    m_threadCount = threadCount;
+    m_ranges.reset(new WorkRange[m_threadCount]);
+
+    // Worker 0 is the thread calling parallelFor()
+    for (int i = 1; i < m_threadCount; ++i)
+        m_threads.emplace_back(&ThreadPool::workerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_quit = true;
+    }
+    m_wake.notify_all();
+    for (auto &t : m_threads)
+        t.join();
+}
+
+void ThreadPool::parallelFor(int count, const std::function<void(int, int)> &fn)
+{
+    if (count <= 0) return;
+
+    if (m_threadCount == 1) {
+        for (int i = 0; i < count; ++i)
+            fn(i, 0);
+        return;
+    }
+
+    // Even initial split; stealing rebalances uneven items (e.g. tiles with glossy corners)
+    for (int w = 0; w < m_threadCount; ++w) {
+        uint32_t begin = uint32_t((int64_t)count * w / m_threadCount);
+        uint32_t end = uint32_t((int64_t)count * (w + 1) / m_threadCount);
+        m_ranges[w].range.store(pack(begin, end), std::memory_order_relaxed);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_job = &fn;
+        m_active = m_threadCount - 1;
+        ++m_generation;
+    }
+    m_wake.notify_all();
+
+    runWorker(0);
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done.wait(lock, [this]() { return m_active == 0; });
+    m_job = nullptr;
+}
+
+void ThreadPool::workerLoop(int worker)
+{
+    uint64_t seen = 0;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wake.wait(lock, [&]() { return m_quit || m_generation != seen; });
+            if (m_quit) return;
+            seen = m_generation;
+        }
+
+        runWorker(worker);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (--m_active == 0)
+            m_done.notify_one();
+    }
+}
+
+void ThreadPool::runWorker(int worker)
+{
+    const auto &fn = *m_job;
+    int index;
+    while (popLocal(worker, index) || steal(worker, index))
+        fn(index, worker);
+}
+
+bool ThreadPool::popLocal(int worker, int &index)
+{
+    auto &r = m_ranges[worker].range;
+    uint64_t old = r.load(std::memory_order_acquire);
+    for (;;) {
+        uint32_t begin = uint32_t(old >> 32);
+        uint32_t end = uint32_t(old);
+        if (begin >= end) return false;
+        if (r.compare_exchange_weak(old, pack(begin + 1, end), std::memory_order_acq_rel)) {
+            index = (int)begin;
+            return true;
+        }
+    }
+}
+
+bool ThreadPool::steal(int worker, int &index)
+{
+    for (int k = 1; k < m_threadCount; ++k) {
+        auto &victim = m_ranges[(worker + k) % m_threadCount].range;
+        uint64_t old = victim.load(std::memory_order_acquire);
+        for (;;) {
+            uint32_t begin = uint32_t(old >> 32);
+            uint32_t end = uint32_t(old);
+            if (begin >= end) break;
+
+            // Take the upper half (at least one item) from the victim
+            uint32_t mid = begin + (end - begin) / 2;
+            if (victim.compare_exchange_weak(old, pack(begin, mid), std::memory_order_acq_rel)) {
+                // Our own range is empty, so only thieves can be reading it
+                m_ranges[worker].range.store(pack(mid + 1, end), std::memory_order_release);
+                index = (int)mid;
+                return true;
+            }
+        }
+    }
+    return false;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent worker pool with per-worker index ranges and lock-free stealing.
+// parallelFor() splits [0, count) evenly across workers; an idle worker steals
+// the upper half of another worker's remaining range, so no lock is taken per item.
+class ThreadPool {
+public:
+    explicit ThreadPool(int threadCount = 0); // 0 = hardware concurrency
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    int threadCount() const { return m_threadCount; }
+
+    // Calls fn(index, worker) for every index in [0, count) and blocks until done.
+    // The calling thread participates as worker 0.
+    void parallelFor(int count, const std::function<void(int, int)> &fn);
+
+private:
+    struct alignas(64) WorkRange {
+        std::atomic<uint64_t> range{0}; // begin in the high word, end in the low word
+    };
+
+    static uint64_t pack(uint32_t begin, uint32_t end) { return (uint64_t(begin) << 32) | end; }
+
+    void workerLoop(int worker);
+    void runWorker(int worker);
+    bool popLocal(int worker, int &index);
+    bool steal(int worker, int &index);
+
+    int m_threadCount = 1;
+    std::vector<std::thread> m_threads;
+    std::unique_ptr<WorkRange[]> m_ranges;
+
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+    const std::function<void(int, int)> *m_job = nullptr;
+    uint64_t m_generation = 0;
+    int m_active = 0;
+    bool m_quit = false;
+};
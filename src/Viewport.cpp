@@ -32,11 +32,11 @@ void Viewport::setPreviewMode()
     update();
 }
 
-void Viewport::renderPathTraced(int spp)
+void Viewport::renderPathTraced(int spp, SamplerType sampler, bool denoise)
 {
     if (!m_scene) return;
     makeCurrent();
-    m_pathTracer.render(*m_scene, width(), height(), spp);
+    m_pathTracer.render(*m_scene, width(), height(), spp, sampler, denoise);
     m_showRender = true;
     doneCurrent();
     update();
@@ -104,9 +104,6 @@ void Viewport::drawPreview()
     m_previewProgram->setUniformValue("uView", view);
     m_previewProgram->setUniformValue("uProjection", proj);
 
-    QMatrix4x4 model;
-    m_previewProgram->setUniformValue("uModel", model);
-
     QVector3D camPos = m_scene->camera().position();
     m_previewProgram->setUniformValue("uViewPos", camPos);
 
@@ -127,6 +124,7 @@ void Viewport::drawPreview()
             obj->initGL();
         }
 
+        m_previewProgram->setUniformValue("uModel", obj->transform());
         m_previewProgram->setUniformValue("uColor", obj->material().color);
         obj->draw();
     }
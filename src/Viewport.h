@@ -17,7 +17,7 @@ public:
     ~Viewport() override;
 
     void setScene(Scene *scene);
-    void renderPathTraced(int spp);
+    void renderPathTraced(int spp, SamplerType sampler = SamplerType::Sobol, bool denoise = false);
     void setPreviewMode();
 
 protected:
@@ -0,0 +1,929 @@
+#include <QtTest>
+#include <QDir>
+#include <QStandardPaths>
+#include <QTemporaryDir>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include "BVH.h"
+#include "CpuRenderer.h"
+#include "Denoiser.h"
+#include "MeshCache.h"
+#include "ObjLoader.h"
+#include "SceneBVH.h"
+#include "SceneObject.h"
+#include "ThreadPool.h"
+
+// Flat normal and depth, so only the color decides the filter weights
+static DenoiseBuffers denoiseBuffers(int width, int height, float (*color)(int x, int y, int c))
+{
+    DenoiseBuffers b;
+    b.width = width;
+    b.height = height;
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            for (int c = 0; c < 3; ++c) {
+                b.color.push_back(color(x, y, c));
+                b.albedo.push_back(0.5f);
+                b.normal.push_back(c == 2 ? 1.0f : 0.0f);
+            }
+            b.depth.push_back(1.0f);
+        }
+    }
+    return b;
+}
+
+static float noise(int x, int y, int c)
+{
+    uint32_t h = uint32_t(x) * 73856093u ^ uint32_t(y) * 19349663u ^ uint32_t(c) * 83492791u;
+    h = (h ^ (h >> 13)) * 0x5bd1e995u;
+    return float((h ^ (h >> 15)) & 0xffff) / 0xffff;
+}
+
+// Two triangles covering the square from -1 to 1 in x and z at y = 0
+static std::shared_ptr<Mesh> floorMesh()
+{
+    auto mesh = std::make_shared<Mesh>();
+    mesh->vertices = {{-1, 0, -1}, {1, 0, -1}, {1, 0, 1}, {-1, 0, 1}};
+    mesh->normals = QVector<QVector3D>(4, QVector3D(0, 1, 0));
+    mesh->indices = {0, 1, 2, 0, 2, 3};
+    return mesh;
+}
+
+static void addFloor(Scene &scene, const std::shared_ptr<Mesh> &mesh, const QVector3D &position)
+{
+    auto obj = std::make_shared<SceneObject>(QString("Floor %1").arg(scene.objects().size()), QString());
+    obj->setMesh(mesh);
+    obj->setPosition(position);
+    scene.objects().append(obj);
+}
+
+// Uniform in [lo, hi), the same on every standard library
+static float uniform(std::mt19937 &rng, float lo, float hi)
+{
+    return lo + (hi - lo) * float(rng() >> 8) * (1.0f / 16777216.0f);
+}
+
+// Small triangles scattered in a 4-unit cube, with long slivers across it that
+// spatial splits cut
+static QVector<RenderTriangle> randomTriangles(std::mt19937 &rng, int count)
+{
+    QVector<RenderTriangle> tris;
+    for (int i = 0; i < count; ++i) {
+        float size = i % 10 == 0 ? 3.0f : 0.3f;
+        RenderTriangle tri;
+        tri.v0 = QVector3D(uniform(rng, -2, 2), uniform(rng, -2, 2), uniform(rng, -2, 2));
+        tri.v1 = tri.v0 + size * QVector3D(uniform(rng, -1, 1), uniform(rng, -1, 1), uniform(rng, -1, 1));
+        tri.v2 = tri.v0 + 0.3f * QVector3D(uniform(rng, -1, 1), uniform(rng, -1, 1), uniform(rng, -1, 1));
+        tris.append(tri);
+    }
+    return tris;
+}
+
+// Distance to the closest of tris, FLT_MAX for a miss
+static float closestHit(const QVector<RenderTriangle> &tris, const QVector3D &orig, const QVector3D &dir)
+{
+    float closest = FLT_MAX;
+    for (const RenderTriangle &tri : tris) {
+        BVHTriangle hot{tri.v0, tri.v1 - tri.v0, tri.v2 - tri.v0};
+        float t;
+        if (BVH::triIntersect(orig, dir, hot, t)) closest = std::min(closest, t);
+    }
+    return closest;
+}
+
+struct TestRay {
+    QVector3D orig, dir;
+    float closest; // closestHit() of the ray
+    float tMax;    // shadow ray length, clear of closest
+};
+
+static std::vector<TestRay> randomRays(std::mt19937 &rng, const QVector<RenderTriangle> &tris, int count)
+{
+    std::vector<TestRay> rays;
+    while ((int)rays.size() < count) {
+        TestRay ray;
+        ray.orig = QVector3D(uniform(rng, -3, 3), uniform(rng, -3, 3), uniform(rng, -3, 3));
+        // Towards a point among the triangles, so most rays hit something
+        QVector3D target(uniform(rng, -2, 2), uniform(rng, -2, 2), uniform(rng, -2, 2));
+        if ((target - ray.orig).length() < 0.1f) continue;
+        ray.dir = (target - ray.orig).normalized();
+        ray.closest = closestHit(tris, ray.orig, ray.dir);
+        ray.tMax = ray.closest < FLT_MAX ? ray.closest * uniform(rng, 0.5f, 1.5f) : 10.0f;
+        if (std::abs(ray.tMax - ray.closest) < 1e-3f * ray.closest) continue;
+        rays.push_back(ray);
+    }
+    return rays;
+}
+
+static bool sameDistance(float a, float b)
+{
+    return (a == FLT_MAX && b == FLT_MAX) || std::abs(a - b) <= 1e-4f * std::max(1.0f, b);
+}
+
+static bool sameHits(const BVH &bvh, const std::vector<TestRay> &rays)
+{
+    for (const TestRay &ray : rays) {
+        float t = FLT_MAX;
+        int hit = bvh.intersect(ray.orig, ray.dir, t);
+        if (!sameDistance(hit >= 0 ? t : FLT_MAX, ray.closest) ||
+            bvh.occluded(ray.orig, ray.dir, ray.tMax) != (ray.closest < ray.tMax))
+            return false;
+    }
+    return true;
+}
+
+static bool writeFile(const QString &path, const QByteArray &contents)
+{
+    QFile file(path);
+    return file.open(QIODevice::WriteOnly) && file.write(contents) == contents.size();
+}
+
+static std::shared_ptr<Mesh> triangleMesh(const QVector<RenderTriangle> &tris)
+{
+    auto mesh = std::make_shared<Mesh>();
+    for (const RenderTriangle &tri : tris) {
+        for (const QVector3D &v : {tri.v0, tri.v1, tri.v2}) {
+            mesh->indices.append(mesh->vertices.size());
+            mesh->vertices.append(v);
+        }
+    }
+    return mesh;
+}
+
+class RenderCoreTest : public QObject {
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void renderIsIndependentOfThreadCount();
+    void denoiseKeepsFlatImage();
+    void denoiseIsMirrorSymmetric();
+    void prepareRefitsMovedObjects();
+    void qualityModeStopsWhenConverged();
+    void resumedRenderMatchesUninterrupted();
+    void checkpointRejectsMismatches();
+    void spatialSplitsCoverTriangles();
+    void spatialSplitRefitKeepsTree();
+    void traversalMatchesBruteForce();
+    void sceneTraversalMatchesBruteForce();
+    void degenerateInputStaysWithinMaxDepth();
+    void bvhDiskCacheRoundTrip();
+    void bvhDiskCacheRebuildsDamagedFiles();
+    void objNumbersParseLikeQt();
+    void objChunkedLoadMatchesSerial();
+    void objSharesCornersWithSamePositionAndNormal();
+    void meshCacheRoundTrip();
+    void meshCacheRejectsStaleAndDamagedFiles();
+};
+
+void RenderCoreTest::initTestCase()
+{
+    // Keeps the BVH and mesh disk caches out of the user's cache directory
+    QStandardPaths::setTestModeEnabled(true);
+}
+
+// Randoms depend on pixel, sample and bounce only, so how tiles are spread over
+// threads does not change a single sum
+void RenderCoreTest::renderIsIndependentOfThreadCount()
+{
+    Scene scene;
+    addFloor(scene, floorMesh(), QVector3D(0, 0, 0));
+    scene.addLight(Light());
+
+    RenderSettings settings;
+    settings.width = 70;
+    settings.height = 50;
+    settings.spp = 4;
+    std::vector<float> accum[2];
+    const int threads[2] = {1, 4};
+    for (int i = 0; i < 2; ++i) {
+        ThreadPool pool(threads[i]);
+        CpuRenderer renderer(scene, settings);
+        QVERIFY(renderer.prepare(pool));
+        Film film(settings.width, settings.height, renderer.tiles());
+        renderer.render(film, pool);
+        accum[i] = film.accum;
+    }
+    QVERIFY(*std::max_element(accum[0].begin(), accum[0].end()) > 0.0f);
+    QVERIFY(accum[0] == accum[1]);
+}
+
+// Images narrower or shorter than the widest kernel step, where most taps fall
+// outside the image
+void RenderCoreTest::denoiseKeepsFlatImage()
+{
+    ThreadPool pool(2);
+    const int sizes[][2] = {{1, 1}, {1, 9}, {9, 1}, {2, 3}, {40, 17}};
+    for (const auto &size : sizes) {
+        DenoiseBuffers in = denoiseBuffers(size[0], size[1], [](int, int, int c) {
+            return 0.25f * (c + 1);
+        });
+        std::vector<float> out = Denoiser::denoise(in, pool);
+        QCOMPARE(out.size(), in.color.size());
+        for (size_t i = 0; i < out.size(); ++i)
+            QVERIFY2(std::abs(out[i] - in.color[i]) < 1e-5f,
+                     qPrintable(QString("%1x%2 value %3").arg(size[0]).arg(size[1]).arg(i)));
+    }
+}
+
+// Border pixels only see taps inside the image, so filtering a mirrored image
+// gives the mirrored result
+void RenderCoreTest::denoiseIsMirrorSymmetric()
+{
+    ThreadPool pool(2);
+    constexpr int w = 5, h = 4;
+    DenoiseBuffers in = denoiseBuffers(w, h, noise);
+    DenoiseBuffers mirrored = denoiseBuffers(w, h, [](int x, int y, int c) {
+        return noise(w - 1 - x, y, c);
+    });
+    std::vector<float> out = Denoiser::denoise(in, pool);
+    std::vector<float> outMirrored = Denoiser::denoise(mirrored, pool);
+    for (int y = 0; y < h; ++y) {
+        for (int x = 0; x < w; ++x) {
+            for (int c = 0; c < 3; ++c) {
+                float a = out[(size_t(y) * w + x) * 3 + c];
+                float b = outMirrored[(size_t(y) * w + (w - 1 - x)) * 3 + c];
+                QVERIFY2(std::abs(a - b) < 1e-5f, qPrintable(QString("pixel %1,%2").arg(x).arg(y)));
+            }
+        }
+    }
+}
+
+// A renderer kept across renders refits its BVHs when only transforms and
+// lights moved, and builds them again for other build settings
+void RenderCoreTest::prepareRefitsMovedObjects()
+{
+    auto mesh = floorMesh();
+    Scene scene;
+    for (int i = 0; i < 2; ++i)
+        addFloor(scene, mesh, QVector3D(3.0f * i, 0, 0));
+    scene.addLight(Light());
+
+    ThreadPool pool(2);
+    RenderSettings settings;
+    settings.width = 16;
+    settings.height = 16;
+    CpuRenderer renderer(scene, settings);
+    QVERIFY(renderer.prepare(pool));
+    QVERIFY(!renderer.refitted());
+
+    scene.objects()[1]->setPosition(QVector3D(0, 1, 2));
+    scene.objects()[0]->setRotation(QVector3D(0, 30, 0));
+    scene.lights()[0].position += QVector3D(0.5f, 0, 0);
+    QVERIFY(renderer.prepare(pool));
+    QVERIFY(renderer.refitted());
+
+    settings.bvh.method = BVHSplitMethod::Median;
+    renderer.setSettings(settings);
+    QVERIFY(renderer.prepare(pool));
+    QVERIFY(!renderer.refitted());
+}
+
+// An image below the noise threshold ends at minAdaptiveSpp however high the spp
+// cap, also when saved samples may be spent
+void RenderCoreTest::qualityModeStopsWhenConverged()
+{
+    // The view only sees the sky, whose pixels vary a little with the jitter.
+    // The wall behind the camera gives prepare() something to build.
+    auto mesh = std::make_shared<Mesh>();
+    mesh->vertices = {{-1, 0, 10}, {1, 0, 10}, {1, 2, 10}, {-1, 2, 10}};
+    mesh->normals = QVector<QVector3D>(4, QVector3D(0, 0, -1));
+    mesh->indices = {0, 1, 2, 0, 2, 3};
+    auto wall = std::make_shared<SceneObject>("Wall", QString());
+    wall->setMesh(mesh);
+    Scene scene;
+    scene.objects().append(wall);
+
+    ThreadPool pool(2);
+    for (bool spendSaved : {false, true}) {
+        RenderSettings settings;
+        settings.width = 48;
+        settings.height = 40;
+        settings.spp = 4096;
+        settings.adaptive = true;
+        settings.noiseThreshold = 0.05f;
+        settings.spendSavedSamples = spendSaved;
+        CpuRenderer renderer(scene, settings);
+        QVERIFY(renderer.prepare(pool));
+        Film film(settings.width, settings.height, renderer.tiles());
+        RenderStats stats = renderer.render(film, pool);
+        QVERIFY(!stats.cancelled && !stats.outOfTime);
+        QCOMPARE(film.maxTileSamples(), settings.minAdaptiveSpp);
+        QCOMPARE(stats.averageSpp, double(settings.minAdaptiveSpp));
+    }
+}
+
+static bool sameFilm(const Film &a, const Film &b)
+{
+    return a.tileSamples == b.tileSamples && a.accum == b.accum && a.lumSq == b.lumSq &&
+           a.albedo == b.albedo && a.normal == b.normal && a.depth == b.depth;
+}
+
+// Samples are seeded by pixel and sample index, so stopping at a checkpoint and
+// resuming adds exactly the samples an uninterrupted render adds, in the same order
+void RenderCoreTest::resumedRenderMatchesUninterrupted()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    Scene scene;
+    addFloor(scene, floorMesh(), QVector3D(0, 0, 0));
+    scene.addLight(Light());
+
+    ThreadPool pool(2);
+    RenderSettings settings;
+    settings.width = 40;
+    settings.height = 36;
+    settings.spp = 6;
+    CpuRenderer renderer(scene, settings);
+    QVERIFY(renderer.prepare(pool));
+    Film full(settings.width, settings.height, renderer.tiles());
+    renderer.render(full, pool);
+
+    settings.spp = 2;
+    settings.checkpointPath = dir.filePath("film.ckpt");
+    renderer.setSettings(settings);
+    Film first(settings.width, settings.height, renderer.tiles());
+    renderer.render(first, pool);
+
+    settings.spp = 6;
+    settings.checkpointPath.clear();
+    settings.resumePath = dir.filePath("film.ckpt");
+    renderer.setSettings(settings);
+    Film resumed(settings.width, settings.height, renderer.tiles());
+    RenderStats stats = renderer.render(resumed, pool);
+    QVERIFY(!stats.resumeFailed);
+    QCOMPARE(stats.samples, full.totalSamples() - first.totalSamples());
+    QVERIFY(sameFilm(resumed, full));
+}
+
+// A checkpoint only loads into a film of the same scene and sampler, and a
+// damaged one leaves the film untouched
+void RenderCoreTest::checkpointRejectsMismatches()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QString path = dir.filePath("film.ckpt");
+    auto mesh = floorMesh();
+    Scene scene;
+    addFloor(scene, mesh, QVector3D(0, 0, 0));
+    scene.addLight(Light());
+
+    ThreadPool pool(2);
+    RenderSettings settings;
+    settings.width = 40;
+    settings.height = 36;
+    settings.spp = 2;
+    CpuRenderer renderer(scene, settings);
+    QVERIFY(renderer.prepare(pool));
+    Film film(settings.width, settings.height, renderer.tiles());
+    renderer.render(film, pool);
+    const QByteArray hash = CpuRenderer::sceneHash(scene);
+    QVERIFY(film.saveCheckpoint(path, settings.sampler, hash));
+
+    const Film empty(settings.width, settings.height, renderer.tiles());
+    Film loaded = empty;
+    QVERIFY(loaded.loadCheckpoint(path, settings.sampler, hash));
+    QVERIFY(sameFilm(loaded, film));
+
+    loaded = empty;
+    QVERIFY(!loaded.loadCheckpoint(path, SamplerType::Random, hash));
+    QVERIFY(sameFilm(loaded, empty));
+
+    // Moved light, and a mesh edited in place with its sizes kept
+    scene.lights()[0].position += QVector3D(0.5f, 0, 0);
+    QVERIFY(!loaded.loadCheckpoint(path, settings.sampler, CpuRenderer::sceneHash(scene)));
+    scene.lights()[0].position -= QVector3D(0.5f, 0, 0);
+    QCOMPARE(CpuRenderer::sceneHash(scene), hash);
+    mesh->vertices[2] += QVector3D(0, 0.25f, 0);
+    QVERIFY(!loaded.loadCheckpoint(path, settings.sampler, CpuRenderer::sceneHash(scene)));
+    QVERIFY(sameFilm(loaded, empty));
+
+    // Cut inside the header, the tile counts and the last float array
+    const qint64 size = QFileInfo(path).size();
+    for (qint64 cut : {qint64(6), qint64(56), size - 4}) {
+        QVERIFY(film.saveCheckpoint(path, settings.sampler, hash));
+        QVERIFY(QFile::resize(path, cut));
+        QVERIFY2(!loaded.loadCheckpoint(path, settings.sampler, hash), qPrintable(QString::number(cut)));
+        QVERIFY(sameFilm(loaded, empty));
+    }
+}
+
+// Every point of a triangle lies in a leaf that lists it, however often the SBVH
+// split it, and every inner box holds its children
+void RenderCoreTest::spatialSplitsCoverTriangles()
+{
+    // Long crossing slivers, which spatial splits cut many times
+    std::vector<QVector3D> vertices;
+    std::vector<AABB> bounds;
+    for (int i = 0; i < 300; ++i) {
+        float a = 0.1f * i, y = noise(i, 0, 0) * 4.0f;
+        QVector3D dir(std::cos(a), 0.3f * noise(i, 1, 0), std::sin(a));
+        QVector3D mid(noise(i, 2, 0), y, noise(i, 3, 0));
+        QVector3D tri[3] = {mid - dir * 5.0f, mid + dir * 5.0f, mid + QVector3D(0, 0.05f, 0)};
+        AABB box;
+        for (const QVector3D &v : tri) {
+            vertices.push_back(v);
+            box.expand(v);
+        }
+        bounds.push_back(box);
+    }
+
+    BVHBuildSettings settings;
+    settings.method = BVHSplitMethod::SpatialSAH;
+    settings.maxLeafSize = 2;
+    settings.spatialSplitBudget = 2.0f;
+    BVHBuilder::Result result = BVHBuilder::build(bounds, settings, nullptr, &vertices);
+    QVERIFY(result.primOrder.size() > bounds.size());
+
+    auto contains = [](const AABB &box, const QVector3D &p) {
+        const float eps = 1e-4f;
+        for (int a = 0; a < 3; ++a)
+            if (p[a] < box.mn[a] - eps || p[a] > box.mx[a] + eps) return false;
+        return true;
+    };
+    std::vector<std::vector<AABB>> leafBoxes(bounds.size());
+    for (const BVHNode &node : result.nodes) {
+        if (node.isLeaf()) {
+            for (int i = node.triStart; i < node.triStart + node.triCount; ++i)
+                leafBoxes[result.primOrder[i]].push_back(node.box);
+            continue;
+        }
+        for (int child : {node.left, node.right}) {
+            QVERIFY(contains(node.box, result.nodes[child].box.mn));
+            QVERIFY(contains(node.box, result.nodes[child].box.mx));
+        }
+    }
+
+    constexpr int Steps = 32;
+    for (size_t prim = 0; prim < bounds.size(); ++prim) {
+        const QVector3D *v = &vertices[prim * 3];
+        for (int i = 0; i <= Steps; ++i) {
+            for (int j = 0; i + j <= Steps; ++j) {
+                QVector3D p = v[0] + (v[1] - v[0]) * (float(i) / Steps) + (v[2] - v[0]) * (float(j) / Steps);
+                bool covered = false;
+                for (const AABB &box : leafBoxes[prim]) covered = covered || contains(box, p);
+                QVERIFY2(covered, qPrintable(QString("triangle %1 point %2,%3").arg(prim).arg(i).arg(j)));
+            }
+        }
+    }
+}
+
+// Refitting an SBVH to unmoved triangles grows its clipped leaves to the whole
+// triangles, which must not count as a degraded tree
+void RenderCoreTest::spatialSplitRefitKeepsTree()
+{
+    std::mt19937 rng(9);
+    const QVector<RenderTriangle> tris = randomTriangles(rng, 400);
+    const std::vector<TestRay> rays = randomRays(rng, tris, 500);
+
+    for (int width : {2, 4, 8}) {
+        if (BVH::traversalWidth(width) != width) continue;
+        BVHBuildSettings settings;
+        settings.method = BVHSplitMethod::SpatialSAH;
+        settings.width = width;
+        settings.maxLeafSize = 2;
+        settings.spatialSplitBudget = 2.0f;
+        BVH bvh;
+        bvh.build(tris, settings);
+        QVERIFY(bvh.triangles().size() > tris.size());
+        QVERIFY2(bvh.refit(tris), qPrintable(QString("width %1").arg(width)));
+        QVERIFY(sameHits(bvh, rays));
+    }
+}
+
+// Closest hits and any-hit shadow queries of every split method and traversal
+// width (the binary near-first kernel, BVH4 and BVH8) agree with testing every
+// triangle
+void RenderCoreTest::traversalMatchesBruteForce()
+{
+    std::mt19937 rng(7);
+    const QVector<RenderTriangle> tris = randomTriangles(rng, 400);
+    const std::vector<TestRay> rays = randomRays(rng, tris, 1500);
+
+    for (BVHSplitMethod method : {BVHSplitMethod::Median, BVHSplitMethod::Morton,
+                                  BVHSplitMethod::BinnedSAH, BVHSplitMethod::SpatialSAH}) {
+        for (int width : {2, 4, 8}) {
+            if (BVH::traversalWidth(width) != width) continue; // not on this CPU
+            BVHBuildSettings settings;
+            settings.method = method;
+            settings.width = width;
+            settings.maxLeafSize = 4;
+            BVH bvh;
+            bvh.build(tris, settings);
+            QCOMPARE(bvh.width(), width);
+
+            const QString name = QString("%1 width %2").arg(bvhSplitMethodName(method)).arg(width);
+            for (size_t r = 0; r < rays.size(); ++r) {
+                const TestRay &ray = rays[r];
+                float t = FLT_MAX;
+                int hit = bvh.intersect(ray.orig, ray.dir, t);
+                QVERIFY2((hit >= 0) == (ray.closest < FLT_MAX), qPrintable(name + QString(" ray %1").arg(r)));
+                QVERIFY2(sameDistance(hit >= 0 ? t : FLT_MAX, ray.closest),
+                         qPrintable(name + QString(" ray %1").arg(r)));
+                QVERIFY2(bvh.occluded(ray.orig, ray.dir, ray.tMax) == (ray.closest < ray.tMax),
+                         qPrintable(name + QString(" shadow ray %1").arg(r)));
+            }
+        }
+    }
+}
+
+// The same through the top level, with one instance placed as built and one
+// rotated, scaled and moved
+void RenderCoreTest::sceneTraversalMatchesBruteForce()
+{
+    std::mt19937 rng(11);
+    const QVector<RenderTriangle> tris = randomTriangles(rng, 200);
+    QMatrix4x4 moved;
+    moved.translate(1.5f, -0.5f, 0.5f);
+    moved.rotate(35.0f, 0.3f, 1.0f, 0.2f);
+    moved.scale(0.7f);
+
+    QVector<RenderTriangle> world = tris;
+    for (const RenderTriangle &tri : tris) {
+        RenderTriangle w = tri;
+        w.v0 = moved.map(tri.v0);
+        w.v1 = moved.map(tri.v1);
+        w.v2 = moved.map(tri.v2);
+        world.append(w);
+    }
+    const std::vector<TestRay> rays = randomRays(rng, world, 1500);
+
+    for (int width : {2, 4, 8}) {
+        if (BVH::traversalWidth(width) != width) continue;
+        BVHBuildSettings settings;
+        settings.width = width;
+        auto blas = std::make_shared<BVH>();
+        blas->build(tris, settings);
+        std::vector<BVHInstance> instances(2);
+        instances[0].blas = blas;
+        instances[1].blas = blas;
+        instances[1].objectToWorld = moved;
+        SceneBVH scene;
+        scene.build(instances);
+
+        for (size_t r = 0; r < rays.size(); ++r) {
+            const TestRay &ray = rays[r];
+            SceneHit hit;
+            bool found = scene.intersect(ray.orig, ray.dir, hit);
+            const QString name = QString("width %1 ray %2").arg(width).arg(r);
+            QVERIFY2(found == (ray.closest < FLT_MAX), qPrintable(name));
+            QVERIFY2(sameDistance(found ? hit.t : FLT_MAX, ray.closest), qPrintable(name));
+            QVERIFY2(scene.occluded(ray.orig, ray.dir, ray.tMax) == (ray.closest < ray.tMax),
+                     qPrintable(name + " shadow"));
+        }
+    }
+}
+
+// Exponentially spaced triangles, where SAH splits peel one triangle off per
+// level, build trees no deeper than the traversal stacks allow, and those trees
+// still find every hit
+void RenderCoreTest::degenerateInputStaysWithinMaxDepth()
+{
+    QVector<RenderTriangle> tris;
+    std::vector<QVector3D> vertices;
+    std::vector<AABB> bounds;
+    for (int i = 0; i < 3000; ++i) {
+        float x = std::pow(1.02f, float(i % 1500)) + i * 1e-4f;
+        RenderTriangle tri;
+        tri.v0 = QVector3D(x, 0, 0);
+        tri.v1 = QVector3D(x, 0.1f, 0);
+        tri.v2 = QVector3D(x, 0, 0.1f);
+        tris.append(tri);
+        AABB box;
+        for (const QVector3D &v : {tri.v0, tri.v1, tri.v2}) {
+            vertices.push_back(v);
+            box.expand(v);
+        }
+        bounds.push_back(box);
+    }
+
+    // Along the row, starting just before every seventh triangle
+    std::vector<TestRay> rays;
+    for (int i = 0; i < tris.size(); i += 7) {
+        TestRay ray;
+        ray.orig = QVector3D(tris[i].v0.x() * 0.9999f, 0.02f, 0.02f);
+        ray.dir = QVector3D(1, 0, 0);
+        ray.closest = closestHit(tris, ray.orig, ray.dir);
+        rays.push_back(ray);
+    }
+
+    for (BVHSplitMethod method : {BVHSplitMethod::Median, BVHSplitMethod::Morton,
+                                  BVHSplitMethod::BinnedSAH, BVHSplitMethod::SpatialSAH}) {
+        BVHBuildSettings settings;
+        settings.method = method;
+        settings.maxLeafSize = 1;
+        BVHBuilder::Result result = BVHBuilder::build(bounds, settings, nullptr, &vertices);
+
+        // Depth of every node, the root being level 1
+        std::vector<int> depth(result.nodes.size(), 0);
+        depth[0] = 1;
+        int maxDepth = 0;
+        std::vector<int> stack = {0};
+        while (!stack.empty()) {
+            int n = stack.back();
+            stack.pop_back();
+            maxDepth = std::max(maxDepth, depth[n]);
+            const BVHNode &node = result.nodes[n];
+            if (node.isLeaf()) continue;
+            for (int child : {node.left, node.right}) {
+                depth[child] = depth[n] + 1;
+                stack.push_back(child);
+            }
+        }
+        QVERIFY2(maxDepth <= BVHBuilder::MaxDepth,
+                 qPrintable(QString("%1: %2 levels").arg(bvhSplitMethodName(method)).arg(maxDepth)));
+
+        for (int width : {2, 4, 8}) {
+            if (BVH::traversalWidth(width) != width) continue;
+            settings.width = width;
+            BVH bvh;
+            bvh.build(tris, settings);
+            for (size_t r = 0; r < rays.size(); ++r) {
+                float t = FLT_MAX;
+                bool found = bvh.intersect(rays[r].orig, rays[r].dir, t) >= 0;
+                QVERIFY2(found && sameDistance(t, rays[r].closest),
+                         qPrintable(QString("%1 width %2 ray %3").arg(bvhSplitMethodName(method))
+                                        .arg(width).arg(r)));
+            }
+        }
+    }
+}
+
+QTEST_GUILESS_MAIN(RenderCoreTest)
+// A tree the cache wrote maps back with the same hits, and only under its own key
+void RenderCoreTest::bvhDiskCacheRoundTrip()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    std::mt19937 rng(5);
+    const QVector<RenderTriangle> tris = randomTriangles(rng, 300);
+    const std::vector<TestRay> rays = randomRays(rng, tris, 500);
+    auto mesh = triangleMesh(tris);
+    BVHBuildSettings settings;
+    const QByteArray key = BLASCache::diskCacheKey(*mesh, settings);
+    const QString path = dir.filePath(QString::fromLatin1(key.toHex()) + ".bvh");
+
+    {
+        BLASCache cache;
+        cache.setDiskCacheDir(dir.path());
+        auto built = cache.get(mesh, settings);
+        QVERIFY(sameHits(*built, rays));
+        QVERIFY(QFileInfo::exists(path));
+    }
+
+    BVH loaded;
+    QVERIFY(loaded.load(path, key, settings));
+    QCOMPARE(loaded.triangles().size(), tris.size());
+    QVERIFY(sameHits(loaded, rays));
+
+    BVHBuildSettings other = settings;
+    other.maxLeafSize += 1;
+    QVERIFY(!BVH().load(path, BLASCache::diskCacheKey(*mesh, other), other));
+}
+
+// Truncated files and files with a broken primitive order are refused, and the
+// cache builds the tree again and rewrites them
+void RenderCoreTest::bvhDiskCacheRebuildsDamagedFiles()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    std::mt19937 rng(6);
+    const QVector<RenderTriangle> tris = randomTriangles(rng, 300);
+    const std::vector<TestRay> rays = randomRays(rng, tris, 500);
+    auto mesh = triangleMesh(tris);
+    BVHBuildSettings settings;
+    const QByteArray key = BLASCache::diskCacheKey(*mesh, settings);
+    const QString path = dir.filePath(QString::fromLatin1(key.toHex()) + ".bvh");
+
+    for (int damage = 0; damage < 3; ++damage) {
+        {
+            BLASCache cache;
+            cache.setDiskCacheDir(dir.path());
+            cache.get(mesh, settings);
+        }
+        QVERIFY(BVH().load(path, key, settings));
+
+        const qint64 size = QFileInfo(path).size();
+        if (damage < 2) {
+            // Inside the header, then inside the triangles at the end
+            QVERIFY(QFile::resize(path, damage == 0 ? 16 : size - 8));
+        } else {
+            // The primitive order sits just before the shading triangles
+            QFile file(path);
+            QVERIFY(file.open(QIODevice::ReadOnly));
+            QByteArray bytes = file.readAll();
+            file.close();
+            const qint64 primBytes = qint64(tris.size()) * sizeof(qint32);
+            const qint64 primEnd = size - qint64(tris.size()) * sizeof(RenderTriangle);
+            bytes.replace(primEnd - primBytes, primBytes, QByteArray(primBytes, '\xff'));
+            QVERIFY(file.open(QIODevice::WriteOnly));
+            QCOMPARE(file.write(bytes), qint64(bytes.size()));
+            file.close();
+        }
+        QVERIFY2(!BVH().load(path, key, settings), qPrintable(QString::number(damage)));
+
+        BLASCache cache;
+        cache.setDiskCacheDir(dir.path());
+        auto rebuilt = cache.get(mesh, settings);
+        QVERIFY(sameHits(*rebuilt, rays));
+        QVERIFY2(BVH().load(path, key, settings), qPrintable(QString::number(damage)));
+    }
+}
+
+// Coordinates read as QByteArray::toDouble() narrowed to float, 0 where Qt
+// rejects the token; face indices may be signed or carry texture and normal
+// slots, and unreadable ones give the origin
+void RenderCoreTest::objNumbersParseLikeQt()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QString path = dir.filePath("numbers.obj");
+    const std::vector<QByteArray> tokens = {
+        "1.5", "-2", "+3e2", ".5", "1e-3", "-0.000125", "123456789.123", "1e30", "7",
+        "0.1234567890123456789012", "12345678901234567890123", "2.5E+3", "-0", "0.000",
+        "abc", "1.5x", "-", "1e"};
+    QByteArray obj;
+    for (size_t i = 0; i < tokens.size(); i += 3)
+        obj += "v " + tokens[i] + " " + tokens[i + 1] + "\t" + tokens[i + 2] + "\r\n";
+    obj += "f 1 2 3\nf 4 5 6\n";
+    QVERIFY(writeFile(path, obj));
+
+    Mesh mesh;
+    QVERIFY(ObjLoader::load(path, mesh));
+    QCOMPARE(mesh.vertices.size(), 6);
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        bool ok = false;
+        double value = tokens[i].toDouble(&ok);
+        QVERIFY2(mesh.vertices[int(i / 3)][int(i % 3)] == (ok ? float(value) : 0.0f), tokens[i].constData());
+    }
+
+    QVERIFY(writeFile(path, "v 1 0 0\nv 2 0 0\nv 3 0 0\nv 4 0 0\n"
+                            "f +1 2/9 -1\n"
+                            "f 3/1/1 -3 99999999999\n"
+                            "f 1x 0 4//\n"));
+    QVERIFY(ObjLoader::load(path, mesh));
+    const float expected[] = {1, 2, 4, 3, 2, 0, 0, 0, 4};
+    QCOMPARE(mesh.vertices.size(), 9);
+    for (int i = 0; i < 9; ++i)
+        QVERIFY2(mesh.vertices[i] == QVector3D(expected[i], 0, 0), qPrintable(QString::number(i)));
+}
+
+// A file of several MinChunkBytes pieces parses the same in parallel as
+// serially. Odd rows index their quads from the end (negative indices), so
+// faces just past a chunk boundary reach back into the previous chunk.
+void RenderCoreTest::objChunkedLoadMatchesSerial()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QString path = dir.filePath("grid.obj");
+    const int Columns = 200, Rows = 320;
+    auto position = [](int r, int c) { return QVector3D(c * 0.125f, r * 0.0625f, (c * r % 7) * 0.25f); };
+    auto normal = [](int r, int c) { return QVector3D(0, 1, (c + r) % 3 * 0.5f); };
+
+    QByteArray obj;
+    std::vector<QVector3D> expected; // corner positions of every triangle
+    char line[160];
+    for (int r = 0; r < Rows; ++r) {
+        for (int c = 0; c < Columns; ++c) {
+            QVector3D p = position(r, c), n = normal(r, c);
+            std::snprintf(line, sizeof(line), "v %g %g %g\nvn %g %g %g\n", p.x(), p.y(), p.z(),
+                          n.x(), n.y(), n.z());
+            obj += line;
+        }
+        if (r == 0) continue;
+        for (int c = 0; c + 1 < Columns; ++c) {
+            const int quad[4][2] = {{r - 1, c}, {r - 1, c + 1}, {r, c + 1}, {r, c}};
+            obj += "f";
+            for (const auto &q : quad) {
+                // 1-based, or counted back from the last vertex of row r
+                int index = r % 2 ? q[0] * Columns + q[1] - (r + 1) * Columns : q[0] * Columns + q[1] + 1;
+                std::snprintf(line, sizeof(line), " %d//%d", index, index);
+                obj += line;
+            }
+            obj += "\n";
+            for (int corner : {0, 1, 2, 0, 2, 3})
+                expected.push_back(position(quad[corner][0], quad[corner][1]));
+        }
+    }
+    QVERIFY(writeFile(path, obj));
+    QVERIFY(obj.size() > 4 * (1 << 20));
+
+    Mesh serial;
+    QVERIFY(ObjLoader::load(path, serial));
+    QCOMPARE(serial.vertices.size(), Rows * Columns);
+    QCOMPARE(serial.indices.size(), int(expected.size()));
+    for (int i = 0; i < serial.indices.size(); ++i)
+        QVERIFY2(serial.vertices[serial.indices[i]] == expected[i], qPrintable(QString::number(i)));
+
+    ThreadPool pool(4);
+    Mesh chunked;
+    QVERIFY(ObjLoader::load(path, chunked, &pool));
+    QVERIFY(chunked.vertices == serial.vertices);
+    QVERIFY(chunked.normals == serial.normals);
+    QVERIFY(chunked.indices == serial.indices);
+}
+
+// Corners share a vertex only when both the position and the normal match;
+// without normals every corner is its own vertex with the face normal
+void RenderCoreTest::objSharesCornersWithSamePositionAndNormal()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QString path = dir.filePath("quad.obj");
+    QVERIFY(writeFile(path, "v 0 0 0\nv 1 0 0\nv 1 1 0\nv 0 1 0\nvn 0 0 1\nvn 0 0 -1\n"
+                            "f 1//1 2//1 3//1 4//1\n"
+                            "f 1//2 3//2 2//2\n"
+                            "f -4//-2 -2//-2 -1//-2\n"));
+    Mesh mesh;
+    QVERIFY(ObjLoader::load(path, mesh));
+    QCOMPARE(mesh.vertices.size(), 7);
+    QCOMPARE(mesh.indices, QVector<unsigned int>({0, 1, 2, 0, 2, 3, 4, 5, 6, 0, 2, 3}));
+    for (int v = 0; v < 7; ++v)
+        QVERIFY(mesh.normals[v] == QVector3D(0, 0, v < 4 ? 1 : -1));
+
+    QVERIFY(writeFile(path, "v 0 0 0\nv 1 0 0\nv 1 1 0\nv 0 1 0\nf 1 2 3\nf 1 3 4\n"));
+    QVERIFY(ObjLoader::load(path, mesh));
+    QCOMPARE(mesh.vertices.size(), 6);
+    QCOMPARE(mesh.indices, QVector<unsigned int>({0, 1, 2, 3, 4, 5}));
+    for (const QVector3D &n : mesh.normals)
+        QVERIFY(n == QVector3D(0, 0, 1));
+}
+
+static const QByteArray CachedObj = "v 0 0 0\nv 1 0 0\nv 1 1 0\nv 0 1 0\nvn 0 0 1\n"
+                                   "f 1//1 2//1 3//1 4//1\n";
+
+// A parsed OBJ is cached, and the next load maps the same arrays from the file
+void RenderCoreTest::meshCacheRoundTrip()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QString objPath = dir.filePath("quad.obj");
+    QVERIFY(writeFile(objPath, CachedObj));
+    MeshCache cache;
+    cache.setDiskCacheDir(dir.filePath("mesh"));
+
+    Mesh parsed;
+    QVERIFY(!cache.load(objPath, parsed));
+    QVERIFY(cache.loadOrParse(objPath, parsed));
+    QVERIFY(!parsed.mapping);
+    QCOMPARE(QDir(dir.filePath("mesh")).entryList(QDir::Files).size(), 1);
+
+    Mesh mapped;
+    QVERIFY(cache.loadOrParse(objPath, mapped));
+    QVERIFY(mapped.mapping);
+    QVERIFY(mapped.vertices == parsed.vertices);
+    QVERIFY(mapped.normals == parsed.normals);
+    QVERIFY(mapped.indices == parsed.indices);
+}
+
+// Files for another version of the OBJ, truncated files and files with an index
+// past the vertices are refused, and loadOrParse() parses and rewrites them
+void RenderCoreTest::meshCacheRejectsStaleAndDamagedFiles()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QString objPath = dir.filePath("quad.obj");
+    QVERIFY(writeFile(objPath, CachedObj));
+    MeshCache cache;
+    cache.setDiskCacheDir(dir.filePath("mesh"));
+    Mesh mesh;
+    QVERIFY(cache.loadOrParse(objPath, mesh));
+    const QStringList files = QDir(dir.filePath("mesh")).entryList(QDir::Files);
+    QCOMPARE(files.size(), 1);
+    const QString path = dir.filePath("mesh/" + files.at(0));
+
+    // The OBJ grew by a comment, so its size no longer matches
+    QVERIFY(writeFile(objPath, CachedObj + "# edited\n"));
+    QVERIFY(!cache.load(objPath, mesh));
+    QVERIFY(cache.loadOrParse(objPath, mesh));
+    QVERIFY(cache.load(objPath, mesh));
+    mesh = Mesh();
+
+    for (int damage = 0; damage < 3; ++damage) {
+        const qint64 size = QFileInfo(path).size();
+        if (damage < 2) {
+            // Inside the header, then inside the index array at the end
+            QVERIFY(QFile::resize(path, damage == 0 ? 16 : size - 4));
+        } else {
+            QFile file(path);
+            QVERIFY(file.open(QIODevice::ReadOnly));
+            QByteArray bytes = file.readAll();
+            file.close();
+            const quint32 index = 4; // one past the last vertex
+            bytes.replace(bytes.size() - 4, 4, QByteArray(reinterpret_cast<const char *>(&index), 4));
+            QVERIFY(writeFile(path, bytes));
+        }
+        QVERIFY2(!cache.load(objPath, mesh), qPrintable(QString::number(damage)));
+
+        QVERIFY(cache.loadOrParse(objPath, mesh));
+        QVERIFY(!mesh.mapping);
+        QCOMPARE(mesh.vertices.size(), 4);
+        QCOMPARE(mesh.indices, QVector<unsigned int>({0, 1, 2, 0, 2, 3}));
+        QVERIFY2(cache.load(objPath, mesh), qPrintable(QString::number(damage)));
+        mesh = Mesh();
+    }
+}
+
+#include "tst_rendercore.moc"